@@ -0,0 +1,509 @@
+/*
+microbench.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* Microbenchmarks of the inner loops the allocator, directory and file code
+spend their time in.
+
+Each kernel is calibrated to run for about SAMPLE_NS per sample, warmed up,
+then timed over a number of samples; the summary is per call, in TSC ticks on
+x86 and nanoseconds elsewhere. The bitmap scanners and the directory entry
+walk run on synthetic blocks. Given an image, inode read and write back,
+block map decoding and name lookup are timed against its largest file and
+largest directory. The image is only written with the bytes it already holds;
+the cost of each durability mode is measured on a scratch clone of it, made
+next to it and removed afterwards.
+
+usage: microbench [-r samples] [disk.img] */
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#define WARMUP		5
+#define SAMPLES		50
+#define SAMPLE_NS	500000		// Target length of one sample
+#define WALK_MAX	100000		// Inodes visited when looking for targets
+#define BENCH_BLOCK	4096
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TICK_UNIT	"ticks"
+static inline uint64_t ticks() {
+	return __builtin_ia32_rdtsc();
+}
+#else
+#define TICK_UNIT	"ns"
+static inline uint64_t ticks() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Results are folded in here so the compiler can't drop the work */
+static volatile uint64_t sink;
+static int samples = SAMPLES;
+
+typedef void (*kernel)(void* arg, uint32_t iters);
+
+static int double_cmp(const void* a, const void* b) {
+	double x = *(double*) a;
+	double y = *(double*) b;
+	return (x > y) - (x < y);
+}
+
+/* Time fn and print min, median, mean, standard deviation and 95th
+percentile per call. items is the work done per call (bits, entries or
+pointers), for the per-item median in the last column. Returns the number of
+calls made, calibration included */
+static uint64_t bench(const char* name, kernel fn, void* arg, double items) {
+	uint32_t iters = 1;
+	uint64_t calls = 0;
+	for (;;) {
+		calls += iters;
+		uint64_t t = now_ns();
+		fn(arg, iters);
+		if (now_ns() - t >= SAMPLE_NS || iters >= (1 << 30))
+			break;
+		iters *= 2;
+	}
+
+	for (int q = 0; q < WARMUP; q++)
+		fn(arg, iters);
+	calls += (uint64_t) (WARMUP + samples) * iters;
+
+	double* s = malloc(samples * sizeof(double));
+	double sum = 0;
+	for (int q = 0; q < samples; q++) {
+		uint64_t t = ticks();
+		fn(arg, iters);
+		s[q] = (double) (ticks() - t) / iters;
+		sum += s[q];
+	}
+	qsort(s, samples, sizeof(double), double_cmp);
+
+	double mean = sum / samples;
+	double var = 0;
+	for (int q = 0; q < samples; q++)
+		var += (s[q] - mean) * (s[q] - mean);
+	double median = s[samples / 2];
+
+	printf("%-34s %10.1f %10.1f %10.1f %8.1f %10.1f %10.3f\n", name, s[0], median, mean,
+		sqrt(var / samples), s[(samples * 95) / 100], median / items);
+	free(s);
+	return calls;
+}
+
+/* Bitmap scanning ----------------------------------------------------------*/
+
+struct bitmap_arg {
+	uint8_t* bitmap;
+	int bits;
+};
+
+/* A bitmap with the first fill percent of bits used, the way a group fills
+from its start, with one free bit left at the end so a full scan still finds
+something */
+static void bitmap_fill(struct bitmap_arg* a, int fill) {
+	int used = (int) ((int64_t) a->bits * fill / 100);
+	memset(a->bitmap, 0, a->bits / 8);
+	for (int q = 0; q < used && q < a->bits - 1; q++)
+		a->bitmap[q / 8] |= 1 << (q % 8);
+}
+
+static void k_first_free(void* arg, uint32_t iters) {
+	struct bitmap_arg* a = arg;
+	uint64_t r = 0;
+	for (uint32_t q = 0; q < iters; q++)
+		r += ext2_first_free((uint32_t*) a->bitmap, a->bits / 32);
+	sink += r;
+}
+
+static void k_next_free(void* arg, uint32_t iters) {
+	struct bitmap_arg* a = arg;
+	uint64_t r = 0;
+	for (uint32_t q = 0; q < iters; q++)
+		r += ext2_next_free(a->bitmap, 0, a->bits);
+	sink += r;
+}
+
+static void bench_bitmaps() {
+	static const int fills[] = { 0, 50, 90, 99, 100 };
+	struct bitmap_arg a;
+	a.bits = BENCH_BLOCK * 8;
+	a.bitmap = malloc(BENCH_BLOCK);
+
+	char name[64];
+	for (int q = 0; q < sizeof(fills) / sizeof(fills[0]); q++) {
+		bitmap_fill(&a, fills[q]);
+		double scanned = (double) a.bits * fills[q] / 100 + 1;
+		sprintf(name, "ext2_first_free %3d%% used", fills[q]);
+		bench(name, k_first_free, &a, scanned);
+		sprintf(name, "ext2_next_free  %3d%% used", fills[q]);
+		bench(name, k_next_free, &a, scanned);
+	}
+	free(a.bitmap);
+}
+
+/* Directory entry walk -----------------------------------------------------*/
+
+struct dirent_arg {
+	char* buf;
+	int len;
+	int entries;
+	char* name;			// Last name in the block, so every lookup walks it all
+	int name_len;
+};
+
+/* Fill a block with entries of 4 to 24 character names, rec_len rounded to
+4 bytes and the last entry stretched to the end of the block */
+static void dirent_fill(struct dirent_arg* a) {
+	a->len = BENCH_BLOCK;
+	a->buf = calloc(1, a->len);
+	a->entries = 0;
+	srand(1);
+
+	struct ext2_dirent* d = NULL;
+	int off = 0;
+	for (;;) {
+		int name_len = 4 + rand() % 21;
+		int rec_len = (sizeof(struct ext2_dirent) + name_len + 3) & ~3;
+		if (off + rec_len > a->len)
+			break;
+		d = (struct ext2_dirent*) (a->buf + off);
+		d->inode = 12 + a->entries;
+		d->rec_len = rec_len;
+		d->name_len = name_len;
+		d->file_type = EXT2_FT_REG_FILE;
+		for (int q = 0; q < name_len; q++)
+			d->name[q] = 'a' + rand() % 26;
+		off += rec_len;
+		a->entries++;
+	}
+	d->rec_len += a->len - off;
+	a->name = (char*) d->name;
+	a->name_len = d->name_len;
+}
+
+/* The rec_len chain walk used by ls, extract and the directory index build */
+static void k_dirent_walk(void* arg, uint32_t iters) {
+	struct dirent_arg* a = arg;
+	uint64_t r = 0;
+	for (uint32_t q = 0; q < iters; q++) {
+		for (int off = 0; off < a->len; ) {
+			struct ext2_dirent* d = (struct ext2_dirent*) (a->buf + off);
+			if (d->rec_len == 0)
+				break;
+			off += d->rec_len;
+			if (d->inode)
+				r += d->name_len;
+		}
+	}
+	sink += r;
+}
+
+/* The same walk comparing every name, as a lookup without an index does */
+static void k_dirent_lookup(void* arg, uint32_t iters) {
+	struct dirent_arg* a = arg;
+	uint64_t r = 0;
+	for (uint32_t q = 0; q < iters; q++) {
+		for (int off = 0; off < a->len; ) {
+			struct ext2_dirent* d = (struct ext2_dirent*) (a->buf + off);
+			if (d->rec_len == 0)
+				break;
+			off += d->rec_len;
+			if (d->inode && d->name_len == a->name_len && !memcmp(d->name, a->name, a->name_len)) {
+				r += d->inode;
+				break;
+			}
+		}
+	}
+	sink += r;
+}
+
+static void bench_dirents() {
+	struct dirent_arg a;
+	dirent_fill(&a);
+	bench("dirent walk (4 KiB block)", k_dirent_walk, &a, a.entries);
+	bench("dirent linear lookup (4 KiB block)", k_dirent_lookup, &a, a.entries);
+	free(a.buf);
+}
+
+/* Image kernels ------------------------------------------------------------*/
+
+struct image_arg {
+	struct ext2_fs* f;
+	uint32_t* inodes;		// Inodes in use, for read_inode
+	int count;
+	int size;
+
+	uint32_t big_file;		// Largest regular file
+	uint32_t big_size;
+	uint32_t big_dir;		// Directory with the most entries
+	int big_entries;
+
+	char** names;			// Entries of big_dir, for find_child
+	int name_count;
+	struct ext2_inode* file;
+	uint32_t indirect;		// Single indirect block of big_file, if any
+};
+
+static void image_walk(struct image_arg* a, uint32_t dir_inode) {
+	struct ext2_fs* f = a->f;
+	struct ext2_inode* dir = ext2_read_inode(f, dir_inode);
+	int len;
+	char* buf = ext2_read_dir(f, dir, &len);
+	free(dir);
+
+	int entries = 0;
+	for (int off = 0; off < len && a->count < WALK_MAX; ) {
+		struct ext2_dirent* d = (struct ext2_dirent*) (buf + off);
+		if (d->rec_len == 0)
+			break;
+		off += d->rec_len;
+		if (!d->inode)
+			continue;
+		entries++;
+		if (d->name[0] == '.' && (d->name_len == 1 || (d->name_len == 2 && d->name[1] == '.')))
+			continue;
+
+		if (a->count == a->size) {
+			a->size = (a->size) ? a->size * 2 : 1024;
+			a->inodes = realloc(a->inodes, a->size * sizeof(uint32_t));
+		}
+		a->inodes[a->count++] = d->inode;
+
+		struct ext2_inode* in = ext2_read_inode(f, d->inode);
+		if ((in->mode & 0xF000) == EXT2_IFDIR)
+			image_walk(a, d->inode);
+		else if ((in->mode & 0xF000) == EXT2_IFREG && in->size >= a->big_size) {
+			a->big_file = d->inode;
+			a->big_size = in->size;
+		}
+		free(in);
+	}
+	if (entries > a->big_entries) {
+		a->big_dir = dir_inode;
+		a->big_entries = entries;
+	}
+	free(buf);
+}
+
+static void image_names(struct image_arg* a) {
+	struct ext2_inode* dir = ext2_read_inode(a->f, a->big_dir);
+	int len;
+	char* buf = ext2_read_dir(a->f, dir, &len);
+	free(dir);
+
+	a->names = malloc(a->big_entries * sizeof(char*));
+	a->name_count = 0;
+	for (int off = 0; off < len && a->name_count < a->big_entries; ) {
+		struct ext2_dirent* d = (struct ext2_dirent*) (buf + off);
+		if (d->rec_len == 0)
+			break;
+		off += d->rec_len;
+		if (d->inode)
+			a->names[a->name_count++] = strndup((char*) d->name, d->name_len);
+	}
+	free(buf);
+}
+
+static void k_read_inode(void* arg, uint32_t iters) {
+	struct image_arg* a = arg;
+	uint64_t r = 0;
+	for (uint32_t q = 0; q < iters; q++) {
+		struct ext2_inode* in = ext2_read_inode(a->f, a->inodes[q % a->count]);
+		r += in->mode;
+		free(in);
+	}
+	sink += r;
+}
+
+static void k_write_inode(void* arg, uint32_t iters) {
+	struct image_arg* a = arg;
+	for (uint32_t q = 0; q < iters; q++)
+		ext2_write_inode(a->f, a->big_file, a->file);
+}
+
+static void k_block_map(void* arg, uint32_t iters) {
+	struct image_arg* a = arg;
+	uint64_t r = 0;
+	for (uint32_t q = 0; q < iters; q++) {
+		uint32_t n;
+		uint32_t* map = ext2_block_map(a->f, a->file, &n);
+		r += map[n - 1];
+		free(map);
+	}
+	sink += r;
+}
+
+static void k_read_indirect(void* arg, uint32_t iters) {
+	struct image_arg* a = arg;
+	uint32_t per = a->f->block_size / sizeof(uint32_t);
+	uint64_t r = 0;
+	for (uint32_t q = 0; q < iters; q++)
+		r += ext2_read_indirect(a->f, a->indirect, q % per);
+	sink += r;
+}
+
+static void k_find_child(void* arg, uint32_t iters) {
+	struct image_arg* a = arg;
+	uint64_t r = 0;
+	for (uint32_t q = 0; q < iters; q++)
+		r += ext2_find_child(a->f, a->names[q % a->name_count], a->big_dir);
+	sink += r;
+}
+
+/* Durability modes -------------------------------------------------------*/
+
+struct durable_arg {
+	struct ext2_fs* f;
+	char* data;
+	uint32_t next;
+};
+
+/* Create a 4 KiB file and unlink it again, two operations that each end in
+ext2_sync() */
+static void k_create_unlink(void* arg, uint32_t iters) {
+	struct durable_arg* a = arg;
+	char name[32];
+	char path[40];
+	for (uint32_t q = 0; q < iters; q++) {
+		sprintf(name, "microbench-%u", a->next++);
+		ext2_touch_file(a->f, EXT2_ROOTDIR, name, a->data, 0644, BENCH_BLOCK);
+		sprintf(path, "/%s", name);
+		ext2_unlink(a->f, path);
+	}
+}
+
+static void bench_durability(struct ext2_fs* f, char* image) {
+	static const char* modes[] = { "none", "ordered", "op" };
+	char* scratch = malloc(strlen(image) + 16);
+	sprintf(scratch, "%s.microbench", image);
+	if (ext2_clone(f, scratch, 1)) {
+		free(scratch);
+		return;
+	}
+
+	int fd = open(scratch, O_RDWR);
+	struct durable_arg a;
+	a.f = (fd < 0) ? NULL : ext2_mount(fd, NULL);
+	a.data = calloc(1, BENCH_BLOCK);
+	a.next = 0;
+	if (a.f) {
+		char name[64];
+		for (int mode = EXT2_DURABLE_NONE; mode <= EXT2_DURABLE_OP; mode++) {
+			a.f->durability = mode;
+			uint64_t flushes = a.f->flushes;
+			sprintf(name, "create+unlink, durability %s", modes[mode]);
+			uint64_t calls = bench(name, k_create_unlink, &a, 2);
+			printf("%-34s %10.2f flushes per call\n", "", (double) (a.f->flushes - flushes) / calls);
+		}
+		ext2_umount(a.f);
+	}
+	if (fd >= 0)
+		close(fd);
+	unlink(scratch);
+	free(scratch);
+	free(a.data);
+}
+
+static int bench_image(char* image) {
+	int fd = open(image, O_RDWR);
+	struct ext2_fs* f = (fd < 0) ? NULL : ext2_mount(fd, NULL);
+	if (!f) {
+		printf("%s: not an ext2 image\n", image);
+		return -1;
+	}
+
+	struct image_arg a;
+	memset(&a, 0, sizeof(a));
+	a.f = f;
+	image_walk(&a, EXT2_ROOTDIR);
+	image_names(&a);
+	printf("%s: %d inodes, largest file %u bytes, largest directory %d entries\n",
+		image, a.count, a.big_size, a.big_entries);
+
+	if (a.count)
+		bench("ext2_read_inode", k_read_inode, &a, 1);
+	if (a.big_file) {
+		a.file = ext2_read_inode(f, a.big_file);
+		bench("ext2_write_inode (same bytes)", k_write_inode, &a, 1);
+		if (a.big_size) {
+			uint32_t n = (a.big_size + f->block_size - 1) / f->block_size;
+			bench("ext2_block_map (largest file)", k_block_map, &a, n);
+		}
+		if ((a.indirect = a.file->block[EXT2_IND_BLOCK]))
+			bench("ext2_read_indirect", k_read_indirect, &a, 1);
+		free(a.file);
+	}
+	if (a.name_count)
+		bench("ext2_find_child (largest dir)", k_find_child, &a, 1);
+	bench_durability(f, image);
+
+	for (int q = 0; q < a.name_count; q++)
+		free(a.names[q]);
+	free(a.names);
+	free(a.inodes);
+	ext2_umount(f);
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	int c;
+	while ((c = getopt(argc, argv, "r:")) != -1) {
+		if (c == 'r')
+			samples = atoi(optarg);
+		else {
+			printf("usage: %s [-r samples] [disk.img]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (samples < 1)
+		samples = 1;
+
+	printf("%d warmup + %d samples per kernel, times in %s per call\n", WARMUP, samples, TICK_UNIT);
+	printf("%-34s %10s %10s %10s %8s %10s %10s\n", "kernel", "min", "median", "mean", "stddev", "p95", "per item");
+	bench_bitmaps();
+	bench_dirents();
+	if (optind < argc)
+		return (bench_image(argv[optind])) ? 1 : 0;
+	return 0;
+}
@@ -0,0 +1,291 @@
+/*
+cache.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* Block cache with adaptive sequential readahead.
+
+Single-block reads from buffer_read are served from a fixed-size cache.
+Every read is matched against a handful of streams, each remembering the
+block it expects next; a stream is any run of reads that keeps walking
+forward, such as an inode's indirect blocks or a scan of an inode table,
+and several can be live at once. A stream that keeps hitting has its window
+doubled, up to CACHE_RA_MAX, and the next window is read in one go when the
+reader gets halfway through the current one. A read that matches no stream
+starts a new one and reads just its block.
+
+The cache only ever holds what is on the image: every write passes through
+ext2_cache_write, which patches the cached copies it overlaps. Large multi-
+block reads go straight to the image and don't touch the cache. */
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define CACHE_BYTES		(8 << 20)	// Cache size
+#define CACHE_STREAMS	8			// Streams tracked at once
+#define CACHE_RA_MIN	(16 << 10)	// First readahead window
+#define CACHE_RA_MAX	(512 << 10)	// Largest readahead window
+
+#define CACHE_NONE		UINT32_MAX
+
+struct cache_entry {
+	uint32_t block;		// CACHE_NONE when empty
+	uint32_t next;		// Hash chain
+	int ref;			// Set on use, cleared by the clock hand
+};
+
+struct cache_stream {
+	uint32_t next;		// Block expected next
+	uint32_t ra_end;	// First block past the readahead
+	uint32_t window;	// Blocks in the current window, 0 before the first
+	uint64_t used;		// For picking the stream to replace
+};
+
+struct block_cache {
+	pthread_mutex_t lock;
+	uint32_t size;		// Entries
+	uint32_t buckets;	// Power of two
+	uint32_t* head;		// Hash buckets, CACHE_NONE terminated
+	struct cache_entry* e;
+	uint8_t* data;		// Entry q at data + q * block_size
+	uint32_t hand;		// Clock hand for replacement
+	uint64_t gen;		// Bumped on every write
+	uint64_t clock;
+	struct cache_stream s[CACHE_STREAMS];
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t ra_blocks;	// Blocks brought in by readahead
+	uint64_t ra_reads;	// Readahead requests issued
+	uint32_t ra_peak;	// Widest window used, in blocks
+};
+
+static uint32_t cache_hash(struct block_cache* c, uint32_t block) {
+	return (block * 2654435761u) & (c->buckets - 1);
+}
+
+static int cache_find(struct block_cache* c, uint32_t block) {
+	for (uint32_t q = c->head[cache_hash(c, block)]; q != CACHE_NONE; q = c->e[q].next)
+		if (c->e[q].block == block)
+			return q;
+	return -1;
+}
+
+static void cache_unlink(struct block_cache* c, uint32_t q) {
+	uint32_t* p = &c->head[cache_hash(c, c->e[q].block)];
+	while (*p != q)
+		p = &c->e[*p].next;
+	*p = c->e[q].next;
+	c->e[q].block = CACHE_NONE;
+}
+
+/* Store a copy of block, evicting whatever the clock hand settles on */
+static void cache_insert(struct ext2_fs *f, struct block_cache* c, uint32_t block, const void* src) {
+	if (cache_find(c, block) >= 0)
+		return;
+	while (c->e[c->hand].block != CACHE_NONE && c->e[c->hand].ref) {
+		c->e[c->hand].ref = 0;
+		c->hand = (c->hand + 1) % c->size;
+	}
+	uint32_t q = c->hand;
+	c->hand = (c->hand + 1) % c->size;
+	if (c->e[q].block != CACHE_NONE)
+		cache_unlink(c, q);
+
+	struct cache_entry* e = &c->e[q];
+	e->block = block;
+	e->ref = 0;
+	e->next = c->head[cache_hash(c, block)];
+	c->head[cache_hash(c, block)] = q;
+	memcpy(c->data + (size_t) q * f->block_size, src, f->block_size);
+}
+
+/* The stream this read continues, or a new one in place of the least
+recently used. A stream is continued by a read anywhere from its last
+block to the end of its readahead */
+static struct cache_stream* cache_stream(struct block_cache* c, uint32_t block, int* fresh) {
+	struct cache_stream* old = &c->s[0];
+	for (int q = 0; q < CACHE_STREAMS; q++) {
+		struct cache_stream* s = &c->s[q];
+		if (s->used && block + 1 >= s->next && block < s->ra_end + 1) {
+			s->used = ++c->clock;
+			*fresh = 0;
+			return s;
+		}
+		if (s->used < old->used)
+			old = s;
+	}
+	old->next = block + 1;
+	old->ra_end = block + 1;
+	old->window = 0;
+	old->used = ++c->clock;
+	*fresh = 1;
+	return old;
+}
+
+struct block_cache* ext2_cache_init(struct ext2_fs *f) {
+	struct block_cache* c = calloc(1, sizeof(struct block_cache));
+	pthread_mutex_init(&c->lock, NULL);
+	c->size = CACHE_BYTES / f->block_size;
+	for (c->buckets = 1; c->buckets < c->size; c->buckets *= 2)
+		;
+	c->head = malloc(c->buckets * sizeof(uint32_t));
+	memset(c->head, 0xff, c->buckets * sizeof(uint32_t));
+	c->e = malloc(c->size * sizeof(struct cache_entry));
+	for (uint32_t q = 0; q < c->size; q++)
+		c->e[q].block = CACHE_NONE;
+	c->data = malloc((size_t) c->size * f->block_size);
+	return c;
+}
+
+void ext2_cache_release(struct ext2_fs *f) {
+	struct block_cache* c = f->cache;
+	if (!c)
+		return;
+	pthread_mutex_destroy(&c->lock);
+	free(c->head);
+	free(c->e);
+	free(c->data);
+	free(c);
+	f->cache = NULL;
+}
+
+/* Read one block into dst through the cache. Returns 0, or -1 if the image
+could not be read */
+int ext2_cache_read(struct ext2_fs *f, uint32_t block, void* dst) {
+	struct block_cache* c = f->cache;
+	int bs = f->block_size;
+	pthread_mutex_lock(&c->lock);
+
+	int fresh;
+	struct cache_stream* s = cache_stream(c, block, &fresh);
+	int sequential = !fresh;
+	if (block >= s->next)
+		s->next = block + 1;
+
+	int q = cache_find(c, block);
+	if (q >= 0) {
+		c->hits++;
+		c->e[q].ref = 1;
+		memcpy(dst, c->data + (size_t) q * bs, bs);
+	} else
+		c->misses++;
+
+	/* Decide what to read: nothing, the block alone, or for a sequential
+	stream a whole window. A miss reads the window from the block on; a hit
+	close to the end of the window already read fetches the next one */
+	uint32_t start = block, count = (q < 0);
+	if (sequential && (q < 0 || s->ra_end - block <= s->window / 2)) {
+		s->window = (s->window) ? s->window * 2 : CACHE_RA_MIN / bs;
+		if (s->window > CACHE_RA_MAX / bs)
+			s->window = CACHE_RA_MAX / bs;
+		if (s->window > c->ra_peak)
+			c->ra_peak = s->window;
+
+		if (q >= 0)
+			start = (s->ra_end > block) ? s->ra_end : block + 1;
+		count = (start < f->sb->blocks_count) ? f->sb->blocks_count - start : 0;
+		if (count > s->window)
+			count = s->window;
+		s->ra_end = start + count;
+		if (count > (q < 0)) {
+			c->ra_reads++;
+			c->ra_blocks += count - (q < 0);
+		}
+	}
+
+	if (!count) {
+		pthread_mutex_unlock(&c->lock);
+		return 0;
+	}
+	uint64_t gen = c->gen;
+	pthread_mutex_unlock(&c->lock);
+
+	/* Page aligned, so that direct I/O can read straight into it */
+	uint8_t* buf = dst;
+	if (count > 1 || q >= 0)
+		posix_memalign((void**) &buf, 4096, (size_t) count * bs);
+	int ret = buffer_read_blocks(f, start, count, buf);
+	if (ret != (size_t) count * bs) {
+		if (buf != dst)
+			free(buf);
+		/* A failed readahead does not fail a read that already hit */
+		if (q >= 0)
+			return 0;
+		return (buffer_read_blocks(f, block, 1, dst) == bs) ? 0 : -1;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	/* A write that raced with the read may have made it stale; keep it out */
+	if (gen == c->gen)
+		for (uint32_t n = 0; n < count; n++)
+			cache_insert(f, c, start + n, buf + (size_t) n * bs);
+	pthread_mutex_unlock(&c->lock);
+
+	if (buf != dst) {
+		if (q < 0)
+			memcpy(dst, buf + (size_t) (block - start) * bs, bs);
+		free(buf);
+	}
+	return 0;
+}
+
+/* Bring cached copies of anything in [off, off + len) up to date with a
+write of buf there */
+void ext2_cache_write(struct ext2_fs *f, const void* buf, size_t len, uint64_t off) {
+	struct block_cache* c = f->cache;
+	int bs = f->block_size;
+	if (!c || !len)
+		return;
+	pthread_mutex_lock(&c->lock);
+	c->gen++;
+	for (uint64_t b = off / bs; b <= (off + len - 1) / bs; b++) {
+		int q = cache_find(c, b);
+		if (q < 0)
+			continue;
+		uint64_t lo = (b * bs > off) ? b * bs : off;
+		uint64_t hi = ((b + 1) * bs < off + len) ? (b + 1) * bs : off + len;
+		memcpy(c->data + (size_t) q * bs + (lo - b * bs), (const uint8_t*) buf + (lo - off), hi - lo);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+void ext2_cache_stats(struct ext2_fs *f) {
+	struct block_cache* c = f->cache;
+	if (!c)
+		return;
+	pthread_mutex_lock(&c->lock);
+	uint64_t reads = c->hits + c->misses;
+	printf("cache: %llu reads, %llu hits (%.1f%%), %llu misses\n", (unsigned long long) reads,
+		(unsigned long long) c->hits, (reads) ? 100.0 * c->hits / reads : 0.0, (unsigned long long) c->misses);
+	printf("readahead: %llu requests, %llu blocks, widest window %u blocks (%u KiB)\n",
+		(unsigned long long) c->ra_reads, (unsigned long long) c->ra_blocks, c->ra_peak,
+		c->ra_peak * f->block_size / 1024);
+	pthread_mutex_unlock(&c->lock);
+}
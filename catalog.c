@@ -0,0 +1,422 @@
+/*
+catalog.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* Metadata catalog of an image, for lookups without mounting it.
+
+The catalog is written in one walk over the image and read back with mmap.
+Every path is an entry holding the inode's attributes and a range of the
+extent table, which maps runs of logical blocks to physical ones (hard links
+share their extents). Entries are sorted by path, so a path or a path prefix
+is a binary search; the owner index lists the extents by physical block, so
+the file holding a given block is one too. The superblock write time is kept
+in the header, and a catalog whose image has been written since is reported
+as stale.
+
+Catalog file layout (all offsets from the start of the file):
+	struct catalog_header
+	struct catalog_entry		(count, sorted by path)
+	struct catalog_extent		(extent_count, grouped by inode in logical order)
+	uint32_t					(extent_count, extent numbers sorted by physical block)
+	path strings				(NUL terminated)
+*/
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define CATALOG_MAGIC	"E2CAT001"
+#define CATALOG_NONE	UINT32_MAX
+
+struct catalog_header {
+	char magic[8];
+	uint32_t wtime;				// Superblock write time when the catalog was made
+	uint32_t block_size;
+	uint32_t blocks_count;
+	uint32_t inodes_count;
+	uint32_t count;				// Entries
+	uint32_t extent_count;
+	uint64_t entries;			// Offset of the entry table
+	uint64_t extents;			// Offset of the extent table
+	uint64_t owners;			// Offset of the owner index
+	uint64_t strings;			// Offset of the path strings
+	uint64_t size;				// Whole file
+} __attribute__((packed));
+
+struct catalog_entry {
+	uint64_t path;				// Offset into the path strings
+	uint32_t path_len;
+	uint32_t inode;
+	uint64_t size;
+	uint32_t extent;			// First extent
+	uint32_t extents;			// Number of extents
+	uint32_t mtime;
+	uint32_t blocks;			// 512-byte sectors, as in the inode
+	uint16_t mode;
+	uint16_t links;
+	uint16_t uid;
+	uint16_t gid;
+} __attribute__((packed));
+
+struct catalog_extent {
+	uint32_t logical;
+	uint32_t physical;
+	uint32_t length;
+	uint32_t entry;				// First entry (by path) with this inode
+} __attribute__((packed));
+
+struct catalog_job {
+	struct ext2_fs* f;
+	struct catalog_entry* entries;
+	char** paths;
+	int count;
+	int size;
+	struct catalog_extent* extents;
+	uint32_t extent_count;
+	uint32_t extent_size;
+	uint32_t* first;			// Entry number + 1 of the first path of each inode
+	uint64_t strings;
+};
+
+/* Append the runs of in's block map to the extent table */
+static void catalog_extents(struct catalog_job* job, struct catalog_entry* e, struct ext2_inode* in) {
+	uint32_t n;
+	uint32_t* map = ext2_block_map(job->f, in, &n);
+	e->extent = job->extent_count;
+	e->extents = 0;
+
+	for (uint32_t q = 0; q < n; ) {
+		if (!map[q]) {
+			q++;
+			continue;
+		}
+		uint32_t run = 1;
+		while (q + run < n && map[q + run] == map[q] + run)
+			run++;
+
+		if (job->extent_count == job->extent_size) {
+			job->extent_size = (job->extent_size) ? job->extent_size * 2 : 1024;
+			job->extents = realloc(job->extents, job->extent_size * sizeof(struct catalog_extent));
+		}
+		struct catalog_extent* x = &job->extents[job->extent_count++];
+		x->logical = q;
+		x->physical = map[q];
+		x->length = run;
+		x->entry = CATALOG_NONE;
+		e->extents++;
+		q += run;
+	}
+	free(map);
+}
+
+static void catalog_visit(struct walk_entry* w, void* arg) {
+	struct catalog_job* job = arg;
+	struct ext2_inode* in = w->in;
+
+	if (job->count == job->size) {
+		job->size = (job->size) ? job->size * 2 : 1024;
+		job->entries = realloc(job->entries, job->size * sizeof(struct catalog_entry));
+		job->paths = realloc(job->paths, job->size * sizeof(char*));
+	}
+	struct catalog_entry* e = &job->entries[job->count];
+	memset(e, 0, sizeof(struct catalog_entry));
+	job->paths[job->count] = strdup(w->path);
+	e->path_len = strlen(w->path);
+	e->inode = w->inode;
+	e->size = in->size;
+	e->mtime = in->mtime;
+	e->blocks = in->blocks;
+	e->mode = in->mode;
+	e->links = in->links_count;
+	e->uid = in->uid;
+	e->gid = in->gid;
+	job->strings += e->path_len + 1;
+
+	/* Fast symlinks keep their target in the block pointers */
+	int fast_link = (in->mode & 0xF000) == EXT2_IFLNK && in->blocks == 0;
+	if (job->first[w->inode]) {
+		struct catalog_entry* other = &job->entries[job->first[w->inode] - 1];
+		e->extent = other->extent;
+		e->extents = other->extents;
+	} else if (!fast_link) {
+		catalog_extents(job, e, in);
+		job->first[w->inode] = job->count + 1;
+	}
+	job->count++;
+}
+
+/* Entries and extents are sorted through a key and index pair, so the
+tables themselves stay put */
+struct catalog_order {
+	char* path;
+	uint32_t physical;
+	uint32_t index;
+};
+
+static int catalog_path_cmp(const void* a, const void* b) {
+	return strcmp(((struct catalog_order*) a)->path, ((struct catalog_order*) b)->path);
+}
+
+static int catalog_owner_cmp(const void* a, const void* b) {
+	uint32_t x = ((struct catalog_order*) a)->physical;
+	uint32_t y = ((struct catalog_order*) b)->physical;
+	return (x > y) - (x < y);
+}
+
+static uint64_t align8(uint64_t off) {
+	return (off + 7) & ~(uint64_t) 7;
+}
+
+/* Write a catalog of the whole image to out */
+int ext2_catalog_export(struct ext2_fs *f, char* out) {
+	struct catalog_job job;
+	memset(&job, 0, sizeof(job));
+	job.f = f;
+	job.first = calloc((size_t) f->sb->inodes_count + 1, sizeof(uint32_t));
+
+	int ret = ext2_walk(f, "/", catalog_visit, &job);
+	free(job.first);
+	if (ret)
+		return -1;
+
+	struct catalog_order* order = malloc(job.count * sizeof(struct catalog_order) + 1);
+	for (int q = 0; q < job.count; q++) {
+		order[q].path = job.paths[q];
+		order[q].index = q;
+	}
+	qsort(order, job.count, sizeof(struct catalog_order), catalog_path_cmp);
+
+	struct catalog_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CATALOG_MAGIC, sizeof(h.magic));
+	h.wtime = f->sb->wtime;
+	h.block_size = f->block_size;
+	h.blocks_count = f->sb->blocks_count;
+	h.inodes_count = f->sb->inodes_count;
+	h.count = job.count;
+	h.extent_count = job.extent_count;
+	h.entries = align8(sizeof(h));
+	h.extents = align8(h.entries + (uint64_t) job.count * sizeof(struct catalog_entry));
+	h.owners = align8(h.extents + (uint64_t) job.extent_count * sizeof(struct catalog_extent));
+	h.strings = align8(h.owners + (uint64_t) job.extent_count * sizeof(uint32_t));
+	h.size = h.strings + job.strings;
+
+	/* Lay out the entries in path order, and give each extent the first
+	path that owns it */
+	struct catalog_entry* entries = malloc(job.count * sizeof(struct catalog_entry) + 1);
+	char* strings = malloc(job.strings + 1);
+	uint64_t pos = 0;
+	for (int q = 0; q < job.count; q++) {
+		struct catalog_entry* e = &entries[q];
+		*e = job.entries[order[q].index];
+		e->path = pos;
+		memcpy(strings + pos, order[q].path, e->path_len + 1);
+		pos += e->path_len + 1;
+		for (uint32_t x = e->extent; x < e->extent + e->extents; x++)
+			if (job.extents[x].entry == CATALOG_NONE)
+				job.extents[x].entry = q;
+	}
+
+	struct catalog_order* by_block = malloc(job.extent_count * sizeof(struct catalog_order) + 1);
+	for (uint32_t q = 0; q < job.extent_count; q++) {
+		by_block[q].physical = job.extents[q].physical;
+		by_block[q].index = q;
+	}
+	qsort(by_block, job.extent_count, sizeof(struct catalog_order), catalog_owner_cmp);
+	uint32_t* owners = malloc(job.extent_count * sizeof(uint32_t) + 1);
+	for (uint32_t q = 0; q < job.extent_count; q++)
+		owners[q] = by_block[q].index;
+	free(by_block);
+
+	int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, h.size) ||
+		pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+		pwrite(fd, entries, (size_t) job.count * sizeof(struct catalog_entry), h.entries) != (ssize_t) job.count * sizeof(struct catalog_entry) ||
+		pwrite(fd, job.extents, (size_t) job.extent_count * sizeof(struct catalog_extent), h.extents) != (ssize_t) job.extent_count * sizeof(struct catalog_extent) ||
+		pwrite(fd, owners, (size_t) job.extent_count * sizeof(uint32_t), h.owners) != (ssize_t) job.extent_count * sizeof(uint32_t) ||
+		pwrite(fd, strings, job.strings, h.strings) != job.strings) {
+		perror(out);
+		ret = -1;
+	} else
+		printf("catalog: %u paths, %u extents, %llu bytes\n", h.count, h.extent_count, (unsigned long long) h.size);
+	if (fd >= 0)
+		close(fd);
+
+	for (int q = 0; q < job.count; q++)
+		free(job.paths[q]);
+	free(job.paths);
+	free(job.entries);
+	free(job.extents);
+	free(entries);
+	free(strings);
+	free(owners);
+	free(order);
+	return ret;
+}
+
+/* Queries ------------------------------------------------------------------*/
+
+struct catalog {
+	struct catalog_header* h;
+	struct catalog_entry* entries;
+	struct catalog_extent* extents;
+	uint32_t* owners;
+	char* strings;
+};
+
+static char* catalog_path(struct catalog* c, struct catalog_entry* e) {
+	return c->strings + e->path;
+}
+
+static void catalog_print(struct catalog* c, struct catalog_entry* e, int extents) {
+	char when[32];
+	time_t t = e->mtime;
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime(&t));
+	printf("%s\tinode %u mode %06o links %u uid %u gid %u size %llu blocks %u mtime %s\n",
+		catalog_path(c, e), e->inode, e->mode, e->links, e->uid, e->gid,
+		(unsigned long long) e->size, e->blocks, when);
+	if (!extents)
+		return;
+	for (uint32_t x = e->extent; x < e->extent + e->extents; x++) {
+		struct catalog_extent* ext = &c->extents[x];
+		printf("\tlogical %u-%u\tphysical %u-%u\n", ext->logical, ext->logical + ext->length - 1,
+			ext->physical, ext->physical + ext->length - 1);
+	}
+}
+
+/* First entry whose path is not below key in sort order */
+static uint32_t catalog_lower(struct catalog* c, const char* key) {
+	uint32_t lo = 0, hi = c->h->count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (strcmp(catalog_path(c, &c->entries[mid]), key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* The extent covering physical block, or -1 */
+static int64_t catalog_owner(struct catalog* c, uint32_t block) {
+	uint32_t lo = 0, hi = c->h->extent_count;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (c->extents[c->owners[mid]].physical <= block)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		return -1;
+	struct catalog_extent* x = &c->extents[c->owners[lo - 1]];
+	return (block < x->physical + x->length) ? (int64_t) c->owners[lo - 1] : -1;
+}
+
+static int catalog_valid(struct catalog_header* h, size_t size) {
+	if (size < sizeof(*h) || memcmp(h->magic, CATALOG_MAGIC, sizeof(h->magic)) || h->size != size)
+		return 0;
+	return h->entries + (uint64_t) h->count * sizeof(struct catalog_entry) <= h->extents &&
+		h->extents + (uint64_t) h->extent_count * sizeof(struct catalog_extent) <= h->owners &&
+		h->owners + (uint64_t) h->extent_count * sizeof(uint32_t) <= h->strings &&
+		h->strings <= size;
+}
+
+/* Answer query from the catalog alone: a path prints its attributes and
+extents, a path ending in '*' lists everything starting with the part before
+it, and "-b N" names the file holding physical block N. When wtime is not
+zero it is the current write time of the image, checked against the stamp */
+int ext2_catalog_query(char* catalog, char* query, char* arg, uint32_t wtime) {
+	int fd = open(catalog, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(catalog);
+		return -1;
+	}
+	void* map = (st.st_size) ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (map == MAP_FAILED || !catalog_valid(map, st.st_size)) {
+		printf("%s: not a catalog\n", catalog);
+		if (map != MAP_FAILED)
+			munmap(map, st.st_size);
+		return -1;
+	}
+
+	struct catalog c;
+	c.h = map;
+	c.entries = (struct catalog_entry*) ((char*) map + c.h->entries);
+	c.extents = (struct catalog_extent*) ((char*) map + c.h->extents);
+	c.owners = (uint32_t*) ((char*) map + c.h->owners);
+	c.strings = (char*) map + c.h->strings;
+
+	int ret = 0;
+	if (wtime && wtime != c.h->wtime) {
+		printf("%s: stale, the image was written after the catalog was made\n", catalog);
+		ret = -1;
+	} else if (strcmp(query, "-b") == 0 && arg) {
+		uint32_t block = strtoul(arg, NULL, 0);
+		int64_t x = catalog_owner(&c, block);
+		if (x < 0) {
+			printf("block %u: not in any file\n", block);
+			ret = -1;
+		} else {
+			struct catalog_extent* ext = &c.extents[x];
+			printf("block %u: logical block %u of\n", block, ext->logical + (block - ext->physical));
+			catalog_print(&c, &c.entries[ext->entry], 0);
+		}
+	} else if (query[0] && query[strlen(query) - 1] == '*') {
+		char* prefix = strndup(query, strlen(query) - 1);
+		size_t len = strlen(prefix);
+		uint32_t matches = 0;
+		for (uint32_t q = catalog_lower(&c, prefix); q < c.h->count; q++) {
+			if (strncmp(catalog_path(&c, &c.entries[q]), prefix, len))
+				break;
+			catalog_print(&c, &c.entries[q], 0);
+			matches++;
+		}
+		printf("%u matches\n", matches);
+		free(prefix);
+	} else {
+		uint32_t q = catalog_lower(&c, query);
+		if (q < c.h->count && strcmp(catalog_path(&c, &c.entries[q]), query) == 0)
+			catalog_print(&c, &c.entries[q], 1);
+		else {
+			printf("%s: not in catalog\n", query);
+			ret = -1;
+		}
+	}
+	munmap(map, st.st_size);
+	return ret;
+}
@@ -0,0 +1,187 @@
+/*
+clone.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* Copy of an image that moves only its allocated blocks.
+
+The destination is created at the full image size but as one hole, and each
+group's block bitmap, from the resident space summary, decides what is
+copied into it: runs of allocated blocks are read and written as single
+I/Os of up to CLONE_RUN bytes, and free blocks are never touched, so they
+stay holes. Groups are handed out to several workers at once. Metadata is
+allocated in the bitmaps like anything else, so the clone is an exact copy
+of everything the filesystem uses. */
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+
+#define CLONE_RUN	(1 << 20)	// Largest single copy
+
+struct clone_job {
+	struct ext2_fs* f;
+	int fd;
+	char* path;
+
+	pthread_mutex_t lock;
+	int next;				// Next group to hand out
+	int errors;
+	uint64_t blocks;
+	uint64_t copies;
+};
+
+/* Copy count blocks from block on */
+static int clone_copy(struct clone_job* job, char* chunk, uint32_t block, uint32_t count) {
+	struct ext2_fs* f = job->f;
+	size_t len = (size_t) count * f->block_size;
+	off_t pos = (off_t) block * f->block_size;
+	if (buffer_read_blocks(f, block, count, chunk) < 0 || pwrite(job->fd, chunk, len, pos) != len) {
+		perror(job->path);
+		return -1;
+	}
+	return 0;
+}
+
+static void* clone_worker(void* arg) {
+	struct clone_job* job = arg;
+	struct ext2_fs* f = job->f;
+	uint32_t run_max = CLONE_RUN / f->block_size;
+	uint8_t* bitmap = malloc(f->block_size);
+	char* chunk;
+	posix_memalign((void**) &chunk, 4096, CLONE_RUN);
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		int g = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (g >= f->num_bg)
+			break;
+
+		ext2_acquire_fs(f);
+		memcpy(bitmap, ext2_space_bitmap(f, f->bmap, g), f->block_size);
+		ext2_release_fs(f);
+
+		uint32_t base = f->sb->first_data_block + g * f->sb->blocks_per_group;
+		uint32_t bits = ext2_group_bits(f, g);
+		uint64_t blocks = 0, copies = 0;
+		int err = 0;
+		for (uint32_t bit = 0; bit < bits && !err; ) {
+			if (!bitmap[bit / 8] && !(bit % 8)) {
+				bit += 8;
+				continue;
+			}
+			if (!(bitmap[bit / 8] & (1 << (bit % 8)))) {
+				bit++;
+				continue;
+			}
+			uint32_t run = 1;
+			while (bit + run < bits && run < run_max && (bitmap[(bit + run) / 8] & (1 << ((bit + run) % 8))))
+				run++;
+			err = clone_copy(job, chunk, base + bit, run);
+			blocks += run;
+			copies++;
+			bit += run;
+		}
+
+		pthread_mutex_lock(&job->lock);
+		job->blocks += blocks;
+		job->copies += copies;
+		job->errors += err;
+		pthread_mutex_unlock(&job->lock);
+	}
+	free(chunk);
+	free(bitmap);
+	return NULL;
+}
+
+/* Write a sparse copy of the image to path holding only its allocated
+blocks, using workers threads */
+int ext2_clone(struct ext2_fs *f, char* path, int workers) {
+	struct stat src, dst;
+	int fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	if (fstat(f->dev, &src) == 0 && fstat(fd, &dst) == 0 && src.st_dev == dst.st_dev && src.st_ino == dst.st_ino) {
+		printf("%s: is the image being cloned\n", path);
+		close(fd);
+		return -1;
+	}
+	uint64_t size = (uint64_t) f->sb->blocks_count * f->block_size;
+	if (ftruncate(fd, 0) || ftruncate(fd, size)) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	struct clone_job job;
+	memset(&job, 0, sizeof(job));
+	job.f = f;
+	job.fd = fd;
+	job.path = path;
+	pthread_mutex_init(&job.lock, NULL);
+
+	/* The boot block of a 1K-block image lies before group 0 */
+	if (f->sb->first_data_block) {
+		char* chunk = malloc((size_t) f->sb->first_data_block * f->block_size);
+		job.errors += clone_copy(&job, chunk, 0, f->sb->first_data_block);
+		job.blocks += f->sb->first_data_block;
+		job.copies++;
+		free(chunk);
+	}
+
+	if (workers < 1)
+		workers = 1;
+	if (workers > f->num_bg)
+		workers = f->num_bg;
+	pthread_t* threads = malloc(workers * sizeof(pthread_t));
+	for (int q = 0; q < workers; q++)
+		pthread_create(&threads[q], NULL, clone_worker, &job);
+	for (int q = 0; q < workers; q++)
+		pthread_join(threads[q], NULL);
+	free(threads);
+
+	if (!job.errors && fsync(fd)) {
+		perror(path);
+		job.errors++;
+	}
+	if (!job.errors)
+		printf("%s: copied %llu of %u blocks (%llu MiB) in %llu writes, %d workers\n", path,
+			(unsigned long long) job.blocks, f->sb->blocks_count,
+			(unsigned long long) (job.blocks * f->block_size >> 20), (unsigned long long) job.copies, workers);
+
+	pthread_mutex_destroy(&job.lock);
+	close(fd);
+	return (job.errors) ? -1 : 0;
+}
@@ -28,7 +28,7 @@ SOFTWARE.
 #include <stdint.h>
 #include <stdio.h>
 
-void bg_dump(struct ext2_fs* f) {
+void ext2_bg_dump(struct ext2_fs* f) {
 	printf("Block group descriptor informaton:\n");
 	printf("Block bitmap %d\n", f->bg->block_bitmap);
 	printf("Inode bitmap %d\n", f->bg->inode_bitmap);
@@ -40,13 +40,13 @@ void bg_dump(struct ext2_fs* f) {
 	buffer* bbm = buffer_read(f, f->bg->block_bitmap);
 	buffer* ibm = buffer_read(f, f->bg->inode_bitmap);
 
-	printf("First free block: %d\n", ext2_first_free(bbm->data, f->block_size)+1);
-	printf("First free inode: %d\n", ext2_first_free(ibm->data, f->block_size)+1);
+	printf("First free block: %d\n", ext2_first_free(bbm->data, f->block_size / 4)+1);
+	printf("First free inode: %d\n", ext2_first_free(ibm->data, f->block_size / 4)+1);
 }
 
 
 
-void inode_dump(struct ext2_fs* f, struct ext2_inode* in) {
+void ext2_inode_dump(struct ext2_fs* f, struct ext2_inode* in) {
 
 	printf("Mode\t%x\t", in->mode);			// Format of the file, and access rights
 	printf("UID\t%x\t", in->uid);			// User id associated with file
@@ -72,7 +72,7 @@ void inode_dump(struct ext2_fs* f, struct ext2_inode* in) {
 }
 
 // For debugging purposes
-void sb_dump(struct ext2_superblock* sb) {
+void ext2_sb_dump(struct ext2_superblock* sb) {
 	printf("Superblock informaton:\n");
 	printf("EXT2 Magic\t%x\n", sb->magic);
 	printf("Inodes Count\t%d\t", sb->inodes_count);
@@ -0,0 +1,402 @@
+/*
+defrag.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* Defragmentation of regular files in place.
+
+A file's blocks are taken in the order a sequential read visits them: the
+direct blocks, then each indirect block followed by what it maps. Every
+break in that sequence starts a new extent, which is how e2fsck counts a
+file as non-contiguous too.
+
+Every regular file under the given path is measured first. Fragmented ones
+are then moved, worst first, until the byte budget is spent. A file moves
+into the largest free runs the space summary can find, near its inode's
+group, and only if that leaves it in fewer extents than before. Its data is
+copied across in large runs, its indirect blocks are rewritten to point at
+the new copies, and then the inode is; the old blocks are freed last, so
+the image is consistent at every step. Descriptors are synced after every
+DEFRAG_BATCH bytes moved. */
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#define DEFRAG_COPY		(1 << 20)	// Largest single copy
+#define DEFRAG_BATCH	(64 << 20)	// Bytes moved between syncs
+
+struct defrag_item {
+	uint32_t inode;
+	uint32_t extents;
+	uint32_t blocks;		// Data and indirect blocks
+};
+
+/* A file's blocks in read order */
+struct defrag_seq {
+	uint32_t* old;
+	uint8_t* ind;			// Set for indirect blocks
+	uint32_t* new;
+	uint32_t count;
+	uint32_t size;
+};
+
+struct defrag_pair {
+	uint32_t old;
+	uint32_t new;
+};
+
+struct defrag_job {
+	struct ext2_fs* f;
+	struct defrag_item* items;
+	int count;
+	int size;
+	char* chunk;
+
+	int moved;
+	int skipped;			// No better placement found
+	int errors;
+	uint64_t bytes;
+};
+
+static void seq_push(struct defrag_seq* s, uint32_t block, int ind) {
+	if (s->count == s->size) {
+		s->size = (s->size) ? s->size * 2 : 64;
+		s->old = realloc(s->old, s->size * sizeof(uint32_t));
+		s->ind = realloc(s->ind, s->size);
+	}
+	s->ind[s->count] = ind;
+	s->old[s->count++] = block;
+}
+
+static void seq_walk(struct ext2_fs *f, struct defrag_seq* s, uint32_t block, int depth) {
+	uint32_t per = f->block_size / sizeof(uint32_t);
+	seq_push(s, block, 1);
+	buffer* b = buffer_read(f, block);
+	uint32_t* ptr = (uint32_t*) b->data;
+	for (uint32_t q = 0; q < per; q++) {
+		if (!ptr[q])
+			continue;
+		if (depth == 1)
+			seq_push(s, ptr[q], 0);
+		else
+			seq_walk(f, s, ptr[q], depth - 1);
+	}
+	buffer_free(b);
+}
+
+/* Fill s with the inode's blocks in read order; holes are left out */
+static void seq_build(struct ext2_fs *f, struct ext2_inode* in, struct defrag_seq* s) {
+	s->count = 0;
+	for (int q = 0; q < EXT2_IND_BLOCK; q++)
+		if (in->block[q])
+			seq_push(s, in->block[q], 0);
+	for (int depth = 1; depth <= 3; depth++)
+		if (in->block[EXT2_IND_BLOCK + depth - 1])
+			seq_walk(f, s, in->block[EXT2_IND_BLOCK + depth - 1], depth);
+}
+
+static uint32_t seq_extents(uint32_t* b, uint32_t n) {
+	uint32_t extents = (n) ? 1 : 0;
+	for (uint32_t q = 1; q < n; q++)
+		if (b[q] != b[q - 1] + 1)
+			extents++;
+	return extents;
+}
+
+static int pair_cmp(const void* a, const void* b) {
+	uint32_t x = ((const struct defrag_pair*) a)->old;
+	uint32_t y = ((const struct defrag_pair*) b)->old;
+	return (x > y) - (x < y);
+}
+
+static uint32_t pair_new(struct defrag_pair* p, uint32_t n, uint32_t old) {
+	struct defrag_pair key = { old, 0 };
+	struct defrag_pair* hit = bsearch(&key, p, n, sizeof(key), pair_cmp);
+	return (hit) ? hit->new : old;
+}
+
+/* Take n blocks for the file in as few runs as possible, starting the search
+at group g, and store them in new[]. Returns the number of runs, or 0 if the
+image has too little space */
+static uint32_t defrag_alloc(struct ext2_fs *f, int g, uint32_t* new, uint32_t n) {
+	struct ext2_superblock* s = f->sb;
+	uint32_t runs = 0;
+	uint32_t done = 0;
+
+	ext2_acquire_fs(f);
+	while (done < n) {
+		uint32_t want = n - done;
+		int h;
+		while ((h = ext2_space_find(f, f->bmap, g, want)) < 0 && want > 1)
+			want /= 2;
+		if (h < 0)
+			break;
+
+		uint32_t start;
+		uint32_t len = ext2_space_run(f->bmap, h, &start);
+		if (len > n - done)
+			len = n - done;
+		uint8_t* bitmap = ext2_space_bitmap(f, f->bmap, h);
+		for (uint32_t q = 0; q < len; q++) {
+			uint32_t bit = start + q;
+			bitmap[bit / 8] |= 1 << (bit % 8);
+			new[done++] = s->first_data_block + h * s->blocks_per_group + bit;
+		}
+		ext2_space_sync_group(f, f->bmap, h);
+		f->bg[h].free_blocks_count -= len;
+		s->free_blocks_count -= len;
+		ext2_bg_dirty(f, h);
+		runs++;
+		g = h;
+	}
+	ext2_release_fs(f);
+
+	if (done < n) {
+		ext2_free_blocks(f, new, done);
+		return 0;
+	}
+	return runs;
+}
+
+/* Move one file into fewer extents. Returns the bytes moved, 0 if the file
+was left where it was, or -1 on error */
+static int64_t defrag_file(struct defrag_job* job, struct defrag_item* it, struct defrag_seq* s) {
+	struct ext2_fs* f = job->f;
+	struct ext2_inode* in = ext2_read_inode(f, it->inode);
+	seq_build(f, in, s);
+	uint32_t n = s->count;
+	s->new = realloc(s->new, (n + 1) * sizeof(uint32_t));
+
+	int g = (it->inode - 1) / f->sb->inodes_per_group;
+	uint32_t runs = defrag_alloc(f, g, s->new, n);
+	if (!runs || runs >= seq_extents(s->old, n)) {
+		if (runs)
+			ext2_free_blocks(f, s->new, n);
+		free(in);
+		return 0;
+	}
+
+	struct defrag_pair* pairs = malloc(n * sizeof(struct defrag_pair));
+	for (uint32_t q = 0; q < n; q++) {
+		pairs[q].old = s->old[q];
+		pairs[q].new = s->new[q];
+	}
+	qsort(pairs, n, sizeof(struct defrag_pair), pair_cmp);
+
+	uint32_t per = f->block_size / sizeof(uint32_t);
+	uint32_t run_max = DEFRAG_COPY / f->block_size;
+	int err = 0;
+	for (uint32_t q = 0; q < n && !err; ) {
+		if (s->ind[q]) {
+			uint32_t* ptr = (uint32_t*) job->chunk;
+			err = buffer_read_blocks(f, s->old[q], 1, ptr) < 0;
+			for (uint32_t p = 0; p < per; p++)
+				if (ptr[p])
+					ptr[p] = pair_new(pairs, n, ptr[p]);
+			err = err || buffer_write_blocks(f, s->new[q], 1, ptr) < 0;
+			q++;
+			continue;
+		}
+		uint32_t run = 1;
+		while (q + run < n && run < run_max && !s->ind[q + run] &&
+			s->old[q + run] == s->old[q] + run && s->new[q + run] == s->new[q] + run)
+			run++;
+		err = buffer_read_blocks(f, s->old[q], run, job->chunk) < 0 ||
+			buffer_write_blocks(f, s->new[q], run, job->chunk) < 0;
+		q += run;
+	}
+
+	if (err) {
+		/* Nothing points at the copies yet */
+		ext2_free_blocks(f, s->new, n);
+		free(pairs);
+		free(in);
+		return -1;
+	}
+
+	for (int q = 0; q < 15; q++)
+		if (in->block[q])
+			in->block[q] = pair_new(pairs, n, in->block[q]);
+	/* In ordered mode the copies are on disk before the inode points at
+	them, and the inode is before the old blocks can be reused */
+	ext2_barrier(f);
+	ext2_write_inode(f, it->inode, in);
+	ext2_barrier(f);
+	ext2_free_blocks(f, s->old, n);
+
+	it->extents = runs;
+	free(pairs);
+	free(in);
+	return (int64_t) n * f->block_size;
+}
+
+static void defrag_walk(struct defrag_job* job, int dir_inode) {
+	struct ext2_fs* f = job->f;
+	struct ext2_inode* dir = ext2_read_inode(f, dir_inode);
+	int len;
+	char* buf = ext2_read_dir(f, dir, &len);
+	free(dir);
+
+	for (int off = 0; off < len; ) {
+		struct ext2_dirent* d = (struct ext2_dirent*) (buf + off);
+		if (d->rec_len == 0)
+			break;
+		off += d->rec_len;
+		if (!d->inode)
+			continue;
+		if (d->name[0] == '.' && (d->name_len == 1 || (d->name_len == 2 && d->name[1] == '.')))
+			continue;
+
+		struct ext2_inode* in = ext2_read_inode(f, d->inode);
+		if ((in->mode & 0xF000) == EXT2_IFDIR)
+			defrag_walk(job, d->inode);
+		else if ((in->mode & 0xF000) == EXT2_IFREG) {
+			if (job->count == job->size) {
+				job->size = (job->size) ? job->size * 2 : 64;
+				job->items = realloc(job->items, job->size * sizeof(struct defrag_item));
+			}
+			job->items[job->count++].inode = d->inode;
+		}
+		free(in);
+	}
+	free(buf);
+}
+
+static int item_inode_cmp(const void* a, const void* b) {
+	uint32_t x = ((const struct defrag_item*) a)->inode;
+	uint32_t y = ((const struct defrag_item*) b)->inode;
+	return (x > y) - (x < y);
+}
+
+/* Most extents first, then the larger file */
+static int item_worst_cmp(const void* a, const void* b) {
+	const struct defrag_item* x = a;
+	const struct defrag_item* y = b;
+	if (x->extents != y->extents)
+		return (x->extents < y->extents) - (x->extents > y->extents);
+	return (x->blocks < y->blocks) - (x->blocks > y->blocks);
+}
+
+static void defrag_report(struct defrag_job* job, char* when) {
+	uint64_t extents = 0;
+	uint32_t worst = 0;
+	int fragmented = 0;
+	for (int q = 0; q < job->count; q++) {
+		struct defrag_item* it = &job->items[q];
+		extents += it->extents;
+		fragmented += (it->extents > 1);
+		if (it->extents > worst)
+			worst = it->extents;
+	}
+	printf("%s: %d files, %d fragmented, %llu extents (%.2f per file), worst %u\n", when, job->count,
+		fragmented, (unsigned long long) extents, (job->count) ? (double) extents / job->count : 0.0, worst);
+}
+
+/* Defragment every regular file under path, moving at most budget bytes
+(0 for no limit) */
+int ext2_defrag(struct ext2_fs *f, char* path, uint64_t budget) {
+	char* p = strdup(path);
+	int i_no = ext2_pathize(f, p);
+	free(p);
+	if (i_no <= 0) {
+		printf("%s: not found in image\n", path);
+		return -1;
+	}
+
+	struct defrag_job job;
+	memset(&job, 0, sizeof(job));
+	job.f = f;
+
+	struct ext2_inode* in = ext2_read_inode(f, i_no);
+	if ((in->mode & 0xF000) == EXT2_IFDIR)
+		defrag_walk(&job, i_no);
+	else if ((in->mode & 0xF000) == EXT2_IFREG) {
+		job.items = malloc(sizeof(struct defrag_item));
+		job.items[job.count++].inode = i_no;
+	}
+	free(in);
+
+	/* Hard links would otherwise be measured and moved once per name */
+	qsort(job.items, job.count, sizeof(struct defrag_item), item_inode_cmp);
+	int unique = 0;
+	for (int q = 0; q < job.count; q++)
+		if (!unique || job.items[unique - 1].inode != job.items[q].inode)
+			job.items[unique++] = job.items[q];
+	job.count = unique;
+
+	struct defrag_seq s;
+	memset(&s, 0, sizeof(s));
+	for (int q = 0; q < job.count; q++) {
+		struct defrag_item* it = &job.items[q];
+		in = ext2_read_inode(f, it->inode);
+		seq_build(f, in, &s);
+		free(in);
+		it->extents = seq_extents(s.old, s.count);
+		it->blocks = s.count;
+	}
+	defrag_report(&job, "before");
+
+	qsort(job.items, job.count, sizeof(struct defrag_item), item_worst_cmp);
+	job.chunk = malloc(DEFRAG_COPY);
+	uint64_t batch = 0;
+	for (int q = 0; q < job.count && job.items[q].extents > 1; q++) {
+		struct defrag_item* it = &job.items[q];
+		uint64_t bytes = (uint64_t) it->blocks * f->block_size;
+		if (budget && job.bytes + bytes > budget)
+			continue;
+
+		int64_t ret = defrag_file(&job, it, &s);
+		if (ret < 0)
+			job.errors++;
+		else if (ret == 0)
+			job.skipped++;
+		else {
+			job.moved++;
+			job.bytes += ret;
+			batch += ret;
+			if (batch >= DEFRAG_BATCH) {
+				ext2_sync(f);
+				batch = 0;
+			}
+		}
+	}
+	ext2_sync(f);
+
+	printf("moved %d files, %llu bytes; %d left in place, %d errors\n", job.moved,
+		(unsigned long long) job.bytes, job.skipped, job.errors);
+	defrag_report(&job, "after");
+
+	free(s.old);
+	free(s.ind);
+	free(s.new);
+	free(job.chunk);
+	free(job.items);
+	return (job.errors) ? -1 : 0;
+}
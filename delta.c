@@ -0,0 +1,504 @@
+/*
+delta.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* Block level deltas between two images of the same geometry.
+
+Only blocks marked in use in the new image's block bitmaps are compared, since
+the contents of free blocks don't matter to the filesystem. Changed blocks are
+coalesced into ranges, and each range records a hash of its old and new
+contents so that apply can refuse to patch the wrong base image, and skip
+ranges that are already up to date.
+
+Delta file layout:
+	struct delta_header
+	struct delta_range[ranges]
+	range data, in range order
+*/
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#define DELTA_MAGIC		"E2DELTA1"
+#define DELTA_CHUNK		(1 << 20)	// Largest single read or write
+
+#define RANGE_PENDING	0
+#define RANGE_CURRENT	1			// Target already holds the new data
+
+struct delta_header {
+	char magic[8];
+	uint32_t block_size;
+	uint32_t blocks_count;
+	uint32_t ranges;
+	uint32_t reserved;
+	uint64_t data_blocks;			// Sum of all range counts
+} __attribute__((packed));
+
+struct delta_range {
+	uint32_t start;
+	uint32_t count;
+	uint64_t base_hash;				// Hash of the blocks being replaced
+	uint64_t new_hash;				// Hash of the replacement data
+} __attribute__((packed));
+
+/* Ranges falling inside one block group */
+struct delta_group {
+	struct delta_range* r;
+	int count;
+	int size;
+	uint64_t offset;				// Where this group's data starts in the delta
+	char* state;
+};
+
+struct delta_job {
+	struct ext2_fs* f;
+	int fd;							// Base image for diff, delta file for apply
+	int groups;
+	struct delta_group* g;
+
+	pthread_mutex_t lock;
+	int next;
+	int errors;
+	void (*fn)(struct delta_job* job, int group, char* a, char* b);
+};
+
+
+#define HASH_P1	0x9E3779B97F4A7C15ULL
+#define HASH_P2	0xC2B2AE3D27D4EB4FULL
+#define HASH_P3	0x165667B19E3779F9ULL
+
+static inline uint64_t hash_round(uint64_t h, uint64_t w) {
+	h ^= w * HASH_P2;
+	h = (h << 31) | (h >> 33);
+	return h * HASH_P1;
+}
+
+/* Fast non-cryptographic 64 bit hash. Four independent lanes keep the
+multiplies pipelined over block sized inputs */
+uint64_t ext2_hash(const void* data, size_t len, uint64_t seed) {
+	const uint8_t* p = data;
+	uint64_t h[4] = { seed + HASH_P1, seed + HASH_P2, seed, seed - HASH_P1 };
+	uint64_t w;
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		for (int l = 0; l < 4; l++) {
+			memcpy(&w, p + i + l * 8, 8);
+			h[l] = hash_round(h[l], w);
+		}
+	}
+	uint64_t x = ((h[0] << 1) | (h[0] >> 63)) + ((h[1] << 7) | (h[1] >> 57)) +
+		((h[2] << 12) | (h[2] >> 52)) + ((h[3] << 18) | (h[3] >> 46));
+	x += len;
+
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&w, p + i, 8);
+		x = hash_round(x, w);
+	}
+	for (; i < len; i++)
+		x = hash_round(x, p[i]);
+
+	x ^= x >> 33;
+	x *= HASH_P3;
+	x ^= x >> 29;
+	return x;
+}
+
+/* Fold one block's hash into the running hash of a range */
+static inline uint64_t range_hash(uint64_t h, const char* block, int block_size) {
+	uint64_t b = ext2_hash(block, block_size, 0);
+	return ext2_hash(&b, sizeof(b), h);
+}
+
+static void* delta_worker(void* arg) {
+	struct delta_job* job = arg;
+	char* a = malloc(DELTA_CHUNK);
+	char* b = malloc(DELTA_CHUNK);
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		int g = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (g >= job->groups)
+			break;
+		job->fn(job, g, a, b);
+	}
+	free(a);
+	free(b);
+	return NULL;
+}
+
+/* Run fn over every block group with a pool of workers */
+static void delta_run(struct delta_job* job, void (*fn)(struct delta_job*, int, char*, char*), int workers) {
+	job->fn = fn;
+	job->next = 0;
+	if (workers < 1)
+		workers = 1;
+	if (workers > job->groups)
+		workers = job->groups;
+
+	pthread_t* threads = malloc(workers * sizeof(pthread_t));
+	for (int q = 0; q < workers; q++)
+		pthread_create(&threads[q], NULL, delta_worker, job);
+	for (int q = 0; q < workers; q++)
+		pthread_join(threads[q], NULL);
+	free(threads);
+}
+
+static void delta_error(struct delta_job* job) {
+	pthread_mutex_lock(&job->lock);
+	job->errors++;
+	pthread_mutex_unlock(&job->lock);
+}
+
+static struct delta_range* delta_push(struct delta_group* g, uint32_t start) {
+	if (g->count == g->size) {
+		g->size = (g->size) ? g->size * 2 : 16;
+		g->r = realloc(g->r, g->size * sizeof(struct delta_range));
+	}
+	struct delta_range* r = &g->r[g->count++];
+	memset(r, 0, sizeof(struct delta_range));
+	r->start = start;
+	return r;
+}
+
+/* Compare blocks [start, end) of both images, extending or opening ranges
+for every block that differs */
+static void diff_run(struct delta_job* job, struct delta_group* g, uint32_t start, uint32_t end, char* a, char* b) {
+	struct ext2_fs* f = job->f;
+	int bs = f->block_size;
+	int chunk = DELTA_CHUNK / bs;
+	int open = -1;
+
+	while (start < end) {
+		int n = (end - start < chunk) ? end - start : chunk;
+		if (buffer_read_blocks(f, start, n, a) != n * bs ||
+			pread(job->fd, b, (size_t) n * bs, (off_t) start * bs) != n * bs) {
+			delta_error(job);
+			return;
+		}
+
+		for (int i = 0; i < n; i++) {
+			char* nb = a + i * bs;
+			char* ob = b + i * bs;
+			if (memcmp(nb, ob, bs) == 0) {
+				open = -1;
+				continue;
+			}
+			if (open < 0) {
+				delta_push(g, start + i);
+				open = g->count - 1;
+			}
+			struct delta_range* r = &g->r[open];
+			r->count++;
+			r->new_hash = range_hash(r->new_hash, nb, bs);
+			r->base_hash = range_hash(r->base_hash, ob, bs);
+		}
+		start += n;
+	}
+}
+
+static void diff_group(struct delta_job* job, int group, char* a, char* b) {
+	struct ext2_fs* f = job->f;
+	struct ext2_superblock* s = f->sb;
+	struct delta_group* g = &job->g[group];
+
+	uint32_t first = s->first_data_block + group * s->blocks_per_group;
+	uint32_t last = first + s->blocks_per_group;
+	if (last > s->blocks_count)
+		last = s->blocks_count;
+
+	/* The boot block of 1K block filesystems sits outside every group */
+	if (group == 0 && first)
+		diff_run(job, g, 0, first, a, b);
+
+	buffer* bitmap = buffer_read(f, f->bg[group].block_bitmap);
+	uint8_t* bits = bitmap->data;
+
+	/* Walk runs of allocated blocks */
+	uint32_t q = 0;
+	while (first + q < last) {
+		if (!(bits[q / 8] & (1 << (q % 8)))) {
+			q++;
+			continue;
+		}
+		uint32_t run = q;
+		while (first + run < last && (bits[run / 8] & (1 << (run % 8))))
+			run++;
+		diff_run(job, g, first + q, first + run, a, b);
+		q = run;
+	}
+	buffer_free(bitmap);
+}
+
+static void diff_write_group(struct delta_job* job, int group, char* a, char* b) {
+	struct ext2_fs* f = job->f;
+	struct delta_group* g = &job->g[group];
+	int bs = f->block_size;
+	int chunk = DELTA_CHUNK / bs;
+	uint64_t offset = g->offset;
+
+	for (int q = 0; q < g->count; q++) {
+		uint32_t start = g->r[q].start;
+		uint32_t end = start + g->r[q].count;
+		while (start < end) {
+			int n = (end - start < chunk) ? end - start : chunk;
+			if (buffer_read_blocks(f, start, n, a) != n * bs ||
+				pwrite(job->fd, a, (size_t) n * bs, offset) != n * bs) {
+				delta_error(job);
+				return;
+			}
+			offset += (uint64_t) n * bs;
+			start += n;
+		}
+	}
+}
+
+/* Write a delta that turns base_image into the mounted image */
+int ext2_delta_diff(struct ext2_fs *f, char* base_image, char* delta, int workers) {
+	struct delta_job job;
+	memset(&job, 0, sizeof(job));
+	job.f = f;
+	job.groups = f->num_bg;
+	job.g = calloc(job.groups, sizeof(struct delta_group));
+	pthread_mutex_init(&job.lock, NULL);
+
+	job.fd = open(base_image, O_RDONLY);
+	if (job.fd < 0) {
+		perror(base_image);
+		return -1;
+	}
+
+	/* Images must share geometry for block numbers to line up */
+	struct ext2_superblock base;
+	pread(job.fd, &base, sizeof(base), 1024);
+	if (base.magic != EXT2_MAGIC || base.blocks_count != f->sb->blocks_count ||
+		base.log_block_size != f->sb->log_block_size) {
+		printf("%s: geometry does not match\n", base_image);
+		close(job.fd);
+		return -1;
+	}
+
+	delta_run(&job, diff_group, workers);
+
+	struct delta_header h;
+	memcpy(h.magic, DELTA_MAGIC, sizeof(h.magic));
+	h.block_size = f->block_size;
+	h.blocks_count = f->sb->blocks_count;
+	h.ranges = 0;
+	h.reserved = 0;
+	h.data_blocks = 0;
+	for (int q = 0; q < job.groups; q++) {
+		h.ranges += job.g[q].count;
+		for (int r = 0; r < job.g[q].count; r++)
+			h.data_blocks += job.g[q].r[r].count;
+	}
+
+	int out = open(delta, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		perror(delta);
+		close(job.fd);
+		return -1;
+	}
+
+	/* Header and range table up front, then each group's data at an
+	offset known in advance so the workers can write independently */
+	uint64_t offset = sizeof(h);
+	pwrite(out, &h, sizeof(h), 0);
+	for (int q = 0; q < job.groups; q++) {
+		size_t len = job.g[q].count * sizeof(struct delta_range);
+		pwrite(out, job.g[q].r, len, offset);
+		offset += len;
+	}
+	for (int q = 0; q < job.groups; q++) {
+		job.g[q].offset = offset;
+		for (int r = 0; r < job.g[q].count; r++)
+			offset += (uint64_t) job.g[q].r[r].count * f->block_size;
+	}
+
+	close(job.fd);
+	job.fd = out;
+	delta_run(&job, diff_write_group, workers);
+	close(out);
+
+	printf("delta: %u ranges, %llu blocks, %llu bytes\n", h.ranges,
+		(unsigned long long) h.data_blocks, (unsigned long long) offset);
+
+	for (int q = 0; q < job.groups; q++)
+		free(job.g[q].r);
+	free(job.g);
+	pthread_mutex_destroy(&job.lock);
+	return (job.errors) ? -1 : 0;
+}
+
+/* Hash the blocks a range is about to replace. Ranges whose target already
+matches new_hash are marked current; anything matching neither side means
+the delta was made against a different base */
+static void apply_verify_group(struct delta_job* job, int group, char* a, char* b) {
+	struct ext2_fs* f = job->f;
+	struct delta_group* g = &job->g[group];
+	int bs = f->block_size;
+	int chunk = DELTA_CHUNK / bs;
+
+	for (int q = 0; q < g->count; q++) {
+		struct delta_range* r = &g->r[q];
+		uint64_t h = 0;
+		uint32_t start = r->start;
+		uint32_t end = start + r->count;
+
+		while (start < end) {
+			int n = (end - start < chunk) ? end - start : chunk;
+			if (buffer_read_blocks(f, start, n, a) != n * bs) {
+				delta_error(job);
+				return;
+			}
+			for (int i = 0; i < n; i++)
+				h = range_hash(h, a + i * bs, bs);
+			start += n;
+		}
+
+		if (h == r->new_hash)
+			g->state[q] = RANGE_CURRENT;
+		else if (h != r->base_hash) {
+			printf("blocks %u-%u do not match the delta base\n", r->start, end - 1);
+			delta_error(job);
+		}
+	}
+}
+
+static void apply_write_group(struct delta_job* job, int group, char* a, char* b) {
+	struct ext2_fs* f = job->f;
+	struct delta_group* g = &job->g[group];
+	int bs = f->block_size;
+	int chunk = DELTA_CHUNK / bs;
+	uint64_t offset = g->offset;
+
+	for (int q = 0; q < g->count; q++) {
+		uint32_t start = g->r[q].start;
+		uint32_t end = start + g->r[q].count;
+		if (g->state[q] == RANGE_CURRENT) {
+			offset += (uint64_t) g->r[q].count * bs;
+			continue;
+		}
+		while (start < end) {
+			int n = (end - start < chunk) ? end - start : chunk;
+			if (pread(job->fd, a, (size_t) n * bs, offset) != n * bs ||
+				buffer_write_blocks(f, start, n, a) != n * bs) {
+				delta_error(job);
+				return;
+			}
+			offset += (uint64_t) n * bs;
+			start += n;
+		}
+	}
+}
+
+/* Apply a delta made by ext2_delta_diff to the mounted image */
+int ext2_delta_apply(struct ext2_fs *f, char* delta, int workers) {
+	struct ext2_superblock* s = f->sb;
+	struct delta_job job;
+	memset(&job, 0, sizeof(job));
+	job.f = f;
+	pthread_mutex_init(&job.lock, NULL);
+
+	job.fd = open(delta, O_RDONLY);
+	if (job.fd < 0) {
+		perror(delta);
+		return -1;
+	}
+
+	struct delta_header h;
+	if (pread(job.fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, DELTA_MAGIC, sizeof(h.magic))) {
+		printf("%s: not a delta file\n", delta);
+		close(job.fd);
+		return -1;
+	}
+	if (h.block_size != f->block_size || h.blocks_count != s->blocks_count) {
+		printf("%s: geometry does not match\n", delta);
+		close(job.fd);
+		return -1;
+	}
+
+	struct delta_range* table = malloc(h.ranges * sizeof(struct delta_range) + 1);
+	char* state = calloc(h.ranges + 1, 1);
+	pread(job.fd, table, h.ranges * sizeof(struct delta_range), sizeof(h));
+
+	/* Ranges are stored in group order; slice the table per group */
+	job.groups = f->num_bg;
+	job.g = calloc(job.groups, sizeof(struct delta_group));
+	uint64_t offset = sizeof(h) + h.ranges * sizeof(struct delta_range);
+	for (uint32_t q = 0; q < h.ranges; q++) {
+		uint32_t start = table[q].start;
+		int group = (start < s->first_data_block) ? 0 : (start - s->first_data_block) / s->blocks_per_group;
+		struct delta_group* g = &job.g[group];
+		if (!g->r) {
+			g->r = &table[q];
+			g->state = &state[q];
+			g->offset = offset;
+		}
+		g->count++;
+		offset += (uint64_t) table[q].count * f->block_size;
+	}
+
+	delta_run(&job, apply_verify_group, workers);
+	if (job.errors) {
+		printf("%s: delta does not apply, image left untouched\n", delta);
+	} else {
+		delta_run(&job, apply_write_group, workers);
+
+		int current = 0;
+		uint64_t blocks = 0;
+		for (uint32_t q = 0; q < h.ranges; q++) {
+			if (state[q] == RANGE_CURRENT)
+				current++;
+			else
+				blocks += table[q].count;
+		}
+		printf("applied %u ranges (%llu blocks), %d already current\n", h.ranges - current,
+			(unsigned long long) blocks, current);
+
+		/* Superblock, descriptors, bitmaps and directories may have been
+		replaced underneath us */
+		ext2_superblock_read(f);
+		ext2_blockdesc_read(f);
+		ext2_space_load(f);
+		ext2_dir_forget(f, 0);
+	}
+
+	close(job.fd);
+	free(table);
+	free(state);
+	free(job.g);
+	pthread_mutex_destroy(&job.lock);
+	return (job.errors) ? -1 : 0;
+}
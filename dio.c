@@ -0,0 +1,347 @@
+/*
+dio.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* Direct I/O and the aligned buffer pool.
+
+An image opened with O_DIRECT bypasses the host page cache, so a bulk
+import or extraction of many GB does not push everything else out of it.
+The kernel then wants buffers, offsets and lengths aligned to DIO_ALIGN,
+which the driver's own I/O mostly is not: 1K blocks, the superblock at byte
+1024, caller buffers from malloc. Everything is therefore funnelled through
+here when the image is open for direct I/O:
+
+	reads that are aligned go straight to the image; others are read into an
+	aligned bounce buffer covering them and copied out
+
+	writes are gathered in a few aligned staging chunks. A write that lands
+	on or next to what a chunk already holds joins it, so file data streams
+	into large writes while bitmaps and inode table blocks written over and
+	over are written once. A chunk goes down in one write when it is needed
+	for something else, a read overlaps it, or the image is synced; pages it
+	only partly covers are completed from the image at that point, so sub-
+	page metadata updates keep their neighbours
+
+No byte is ever held by two chunks, so the order they reach the image in
+does not matter. The pool of page-aligned block buffers backs buffer_read
+in either mode, so buffers are reused rather than allocated per read. */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define DIO_ALIGN		4096		// Alignment O_DIRECT transfers keep to
+#define DIO_STAGE		(1 << 20)	// Largest gathered write
+#define DIO_STAGES		8			// Writes gathered at once
+#define DIO_POOL_MAX	64			// Block buffers kept for reuse
+
+#define DIO_DOWN(x)		((x) & ~(uint64_t) (DIO_ALIGN - 1))
+#define DIO_UP(x)		DIO_DOWN((x) + DIO_ALIGN - 1)
+#define DIO_ALIGNED(p)	(((uintptr_t) (p) & (DIO_ALIGN - 1)) == 0)
+
+struct dio_stage {
+	uint8_t* buf;				// DIO_STAGE bytes, buf[0] is image offset base
+	uint64_t base;
+	uint64_t start;				// Bytes held are [start, end), none if equal
+	uint64_t end;
+	uint64_t used;				// For picking the one to write out
+};
+
+struct dio {
+	pthread_mutex_t lock;		// Everything below
+	void** pool;				// Free block buffers
+	int pooled;
+
+	struct dio_stage stage[DIO_STAGES];
+	uint8_t* page;				// One aligned page for read-modify-write
+	uint64_t clock;
+
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t bounced;			// Unaligned reads and oversized unaligned writes
+	uint64_t rmw;				// Pages read to complete a partial write
+	uint64_t flushes;
+	uint64_t flushed_bytes;
+};
+
+static void* dio_alloc(size_t len) {
+	void* p;
+	return (posix_memalign(&p, DIO_ALIGN, len)) ? NULL : p;
+}
+
+/* Open path for direct I/O, for handing to ext2_mount */
+int ext2_dio_open(char* path, int flags) {
+	return open(path, flags | O_DIRECT);
+}
+
+/* Set up the pool, and direct I/O if the image was opened with O_DIRECT.
+Called before anything but a packed image's header and index is read. An
+overlay reads the base image on its own terms, and a packed image is read a
+compressed chunk at a time, so with either the image goes back to buffered
+I/O */
+void ext2_dio_init(struct ext2_fs *f) {
+	struct dio* d = calloc(1, sizeof(struct dio));
+	pthread_mutex_init(&d->lock, NULL);
+	d->pool = malloc(DIO_POOL_MAX * sizeof(void*));
+	f->dio = d;
+
+	int flags = fcntl(f->dev, F_GETFL);
+	f->direct = (flags >= 0 && (flags & O_DIRECT));
+	if (f->direct && (f->overlay || f->pack)) {
+		fcntl(f->dev, F_SETFL, flags & ~O_DIRECT);
+		f->direct = 0;
+	}
+	if (f->direct) {
+		for (int q = 0; q < DIO_STAGES; q++)
+			d->stage[q].buf = dio_alloc(DIO_STAGE);
+		d->page = dio_alloc(DIO_ALIGN);
+	}
+}
+
+void ext2_dio_release(struct ext2_fs *f) {
+	struct dio* d = f->dio;
+	if (!d)
+		return;
+	ext2_dio_flush(f);
+	for (int q = 0; q < d->pooled; q++)
+		free(d->pool[q]);
+	pthread_mutex_destroy(&d->lock);
+	free(d->pool);
+	for (int q = 0; q < DIO_STAGES; q++)
+		free(d->stage[q].buf);
+	free(d->page);
+	free(d);
+	f->dio = NULL;
+}
+
+/* A page-aligned buffer of one block */
+void* ext2_pool_get(struct ext2_fs *f) {
+	struct dio* d = f->dio;
+	void* p = NULL;
+	pthread_mutex_lock(&d->lock);
+	if (d->pooled)
+		p = d->pool[--d->pooled];
+	pthread_mutex_unlock(&d->lock);
+	return (p) ? p : dio_alloc(f->block_size);
+}
+
+void ext2_pool_put(struct ext2_fs *f, void* p) {
+	struct dio* d = f->dio;
+	pthread_mutex_lock(&d->lock);
+	if (d->pooled < DIO_POOL_MAX) {
+		d->pool[d->pooled++] = p;
+		p = NULL;
+	}
+	pthread_mutex_unlock(&d->lock);
+	free(p);
+}
+
+/* Read the page at aligned offset off into d->page; past the end of the
+image it reads as zeroes */
+static int dio_read_page(struct ext2_fs *f, struct dio* d, uint64_t off) {
+	d->rmw++;
+	ssize_t n = pread(f->dev, d->page, DIO_ALIGN, off);
+	if (n < 0)
+		return -1;
+	memset(d->page + n, 0, DIO_ALIGN - n);
+	return 0;
+}
+
+/* Write len bytes at off that don't fit a stage, through an aligned copy
+completed from the image at either end. Lock held */
+static ssize_t dio_write_bounced(struct ext2_fs *f, struct dio* d, const void* buf, size_t len, uint64_t off) {
+	if (DIO_ALIGNED(buf) && off % DIO_ALIGN == 0 && len % DIO_ALIGN == 0)
+		return pwrite(f->dev, buf, len, off);
+
+	uint64_t lo = DIO_DOWN(off), hi = DIO_UP(off + len);
+	uint8_t* tmp = dio_alloc(hi - lo);
+	d->bounced++;
+	if (lo != off) {
+		if (dio_read_page(f, d, lo))
+			goto fail;
+		memcpy(tmp, d->page, DIO_ALIGN);
+	}
+	if (hi != off + len) {
+		if (dio_read_page(f, d, hi - DIO_ALIGN))
+			goto fail;
+		memcpy(tmp + (hi - lo) - DIO_ALIGN, d->page, DIO_ALIGN);
+	}
+	memcpy(tmp + (off - lo), buf, len);
+	ssize_t n = pwrite(f->dev, tmp, hi - lo, lo);
+	free(tmp);
+	return (n == hi - lo) ? len : -1;
+fail:
+	free(tmp);
+	return -1;
+}
+
+/* Write out one stage, completing its first and last page from the image.
+Lock held */
+static int dio_flush_stage(struct ext2_fs *f, struct dio* d, struct dio_stage* st) {
+	if (st->start == st->end)
+		return 0;
+	uint64_t lo = DIO_DOWN(st->start), hi = DIO_UP(st->end);
+	int ret = 0;
+
+	if (lo != st->start) {
+		ret |= dio_read_page(f, d, lo);
+		memcpy(st->buf + (lo - st->base), d->page, st->start - lo);
+	}
+	if (hi != st->end) {
+		ret |= dio_read_page(f, d, hi - DIO_ALIGN);
+		memcpy(st->buf + (st->end - st->base), d->page + st->end % DIO_ALIGN, hi - st->end);
+	}
+	if (!ret && pwrite(f->dev, st->buf + (lo - st->base), hi - lo, lo) != hi - lo)
+		ret = -1;
+	d->flushes++;
+	d->flushed_bytes += hi - lo;
+	st->start = st->end = 0;
+	return ret;
+}
+
+/* Write out every stage holding bytes of [off, off + len), except skip.
+Lock held */
+static int dio_flush_range(struct ext2_fs *f, struct dio* d, uint64_t off, size_t len, struct dio_stage* skip) {
+	int ret = 0;
+	for (int q = 0; q < DIO_STAGES; q++) {
+		struct dio_stage* st = &d->stage[q];
+		if (st != skip && st->start < off + len && off < st->end)
+			ret |= dio_flush_stage(f, d, st);
+	}
+	return ret;
+}
+
+int ext2_dio_flush(struct ext2_fs *f) {
+	struct dio* d = f->dio;
+	if (!f->direct || !d)
+		return 0;
+	pthread_mutex_lock(&d->lock);
+	int ret = dio_flush_range(f, d, 0, SIZE_MAX, NULL);
+	pthread_mutex_unlock(&d->lock);
+	return ret;
+}
+
+ssize_t ext2_dio_read(struct ext2_fs *f, void* buf, size_t len, uint64_t off) {
+	struct dio* d = f->dio;
+	int aligned = DIO_ALIGNED(buf) && off % DIO_ALIGN == 0 && len % DIO_ALIGN == 0;
+
+	/* Staged writes this read overlaps must reach the image first */
+	pthread_mutex_lock(&d->lock);
+	d->reads++;
+	d->bounced += !aligned;
+	int ret = dio_flush_range(f, d, off, len, NULL);
+	pthread_mutex_unlock(&d->lock);
+	if (ret)
+		return -1;
+
+	if (aligned)
+		return pread(f->dev, buf, len, off);
+
+	uint64_t lo = DIO_DOWN(off), hi = DIO_UP(off + len);
+	uint8_t* tmp = dio_alloc(hi - lo);
+	ssize_t n = pread(f->dev, tmp, hi - lo, lo);
+	if (n >= 0) {
+		n = (n > off - lo) ? n - (off - lo) : 0;
+		if (n > len)
+			n = len;
+		memcpy(buf, tmp + (off - lo), n);
+	}
+	free(tmp);
+	return n;
+}
+
+ssize_t ext2_dio_write(struct ext2_fs *f, const void* buf, size_t len, uint64_t off) {
+	struct dio* d = f->dio;
+	pthread_mutex_lock(&d->lock);
+	d->writes++;
+
+	/* A stage this write touches and fits in */
+	struct dio_stage* st = NULL;
+	for (int q = 0; q < DIO_STAGES && !st; q++) {
+		struct dio_stage* s = &d->stage[q];
+		if (s->start != s->end && off >= s->base && off + len <= s->base + DIO_STAGE &&
+			off <= s->end && off + len >= s->start)
+			st = s;
+	}
+
+	if (!st) {
+		if (off - DIO_DOWN(off) + len > DIO_STAGE) {
+			ssize_t ret = -1;
+			if (!dio_flush_range(f, d, off, len, NULL))
+				ret = dio_write_bounced(f, d, buf, len, off);
+			pthread_mutex_unlock(&d->lock);
+			return ret;
+		}
+		/* Take an empty stage, or write out the least recently used */
+		st = &d->stage[0];
+		for (int q = 0; q < DIO_STAGES; q++) {
+			struct dio_stage* s = &d->stage[q];
+			if (s->start == s->end) {
+				st = s;
+				break;
+			}
+			if (s->used < st->used)
+				st = s;
+		}
+		if (dio_flush_stage(f, d, st)) {
+			pthread_mutex_unlock(&d->lock);
+			return -1;
+		}
+		st->base = DIO_DOWN(off);
+		st->start = st->end = off;
+	}
+
+	/* Keep each byte in one stage only */
+	if (dio_flush_range(f, d, off, len, st)) {
+		pthread_mutex_unlock(&d->lock);
+		return -1;
+	}
+	memcpy(st->buf + (off - st->base), buf, len);
+	if (off < st->start)
+		st->start = off;
+	if (off + len > st->end)
+		st->end = off + len;
+	st->used = ++d->clock;
+	pthread_mutex_unlock(&d->lock);
+	return len;
+}
+
+void ext2_dio_stats(struct ext2_fs *f) {
+	struct dio* d = f->dio;
+	if (!f->direct || !d)
+		return;
+	pthread_mutex_lock(&d->lock);
+	printf("direct i/o: %llu reads, %llu writes gathered into %llu flushes (%llu KiB), %llu bounced, %llu pages read for partial writes\n",
+		(unsigned long long) d->reads, (unsigned long long) d->writes, (unsigned long long) d->flushes,
+		(unsigned long long) d->flushed_bytes / 1024, (unsigned long long) d->bounced, (unsigned long long) d->rmw);
+	pthread_mutex_unlock(&d->lock);
+}
@@ -30,132 +30,568 @@ SOFTWARE.
 
 
 
-/* Add an inode into parent_inode */
-int ext2_add_child(struct ext2_fs *f, int parent_inode, int i_no, char* name, int type) {
+/* Directory index.
+
+The first lookup or insert in a directory reads it once and builds an index
+kept with the mounted image: the physical block behind each directory block,
+a hash table of the names, and for every block the largest entry that still
+fits in it ("room"). Blocks are kept on one list per room size, in 4 byte
+steps, with a bitmap of the non-empty lists. An insert therefore costs a name
+probe, a bitmap search bounded by the block size and one block read and
+write, however large the directory is. Growing the directory maps just the
+new block through ext2_map_range, so indirect blocks are fine.
+
+All directory changes go through the index under f->dir_lock. Anything that
+rewrites a directory behind its back calls ext2_dir_forget */
+
+#define DIR_CACHE_MAX	256		// Directories indexed at once, per image
+#define DIR_TOMB		((char*) 1)
+
+struct dir_name {
+	uint64_t hash;
+	uint32_t inode;
+	uint32_t block;		// Directory block holding the entry
+	char* name;			// NULL when empty, DIR_TOMB when deleted
+};
+
+struct dir_index {
+	int inode;
+	uint32_t nblocks;
+	uint32_t cap;
+	uint32_t* map;		// Physical block of each directory block
+	uint16_t* room;		// Largest entry that fits in each block
+	int* next;			// Room list links, per block
+	int* prev;
+	int* head;			// First block of each room list, -1 when empty
+	uint64_t* used;		// Bitmap of non-empty room lists
+	int classes;
+
+	struct dir_name* names;
+	uint32_t size;		// Power of two
+	uint32_t count;		// Live names
+	uint32_t tombs;
+
+	struct dir_index* lru;	// Next less recently used
+};
+
+/* Length an entry with a name of len bytes takes up */
+#define DIRENT_LEN(len)	((sizeof(struct ext2_dirent) + (len) + 4) & ~0x3)
+
+static void dir_room_unlink(struct dir_index* di, int q) {
+	int c = di->room[q] / 4;
+	if (di->prev[q] >= 0)
+		di->next[di->prev[q]] = di->next[q];
+	else {
+		di->head[c] = di->next[q];
+		if (di->head[c] < 0)
+			di->used[c / 64] &= ~(1ULL << (c % 64));
+	}
+	if (di->next[q] >= 0)
+		di->prev[di->next[q]] = di->prev[q];
+}
 
-	struct ext2_inode* rootdir = ext2_read_inode(f, parent_inode);
-	assert(rootdir->blocks);
-	assert(rootdir->block[0]);
+static void dir_room_link(struct dir_index* di, int q, int room) {
+	int c = room / 4;
+	di->room[q] = room;
+	di->prev[q] = -1;
+	di->next[q] = di->head[c];
+	if (di->head[c] >= 0)
+		di->prev[di->head[c]] = q;
+	di->head[c] = q;
+	di->used[c / 64] |= 1ULL << (c % 64);
+}
 
-	buffer* rootdir_buf = buffer_read(f, rootdir->block[0]);
-	struct ext2_dirent* d = (struct ext2_dirent*) rootdir_buf->data;
+/* Move block q to the list for its new room */
+static void dir_room_set(struct dir_index* di, int q, int room) {
+	dir_room_unlink(di, q);
+	dir_room_link(di, q, room);
+}
 
-	int sum = 0;
-	int calc = 0;
-	int new_entry_len = (sizeof(struct ext2_dirent) + strlen(name) + 4) & ~0x3;
-	do {
-		// Calculate the 4byte aligned size of each entry
-		calc = (sizeof(struct ext2_dirent) + d->name_len + 4) & ~0x3;
-		sum += d->rec_len;
+/* A block with room for an entry of need bytes, or -1 */
+static int dir_room_find(struct dir_index* di, int need) {
+	int c = (need + 3) / 4;
+	for (int w = c / 64; w * 64 < di->classes; w++) {
+		uint64_t bits = di->used[w];
+		if (w == c / 64)
+			bits &= ~0ULL << (c % 64);
+		if (bits)
+			return di->head[w * 64 + __builtin_ctzll(bits)];
+	}
+	return -1;
+}
 
-		/* Child already exists here */
-		if (d->inode == i_no)
-			return -1;
+/* Append a directory block with the given room */
+static int dir_block_add(struct dir_index* di, uint32_t block, int room) {
+	if (di->nblocks == di->cap) {
+		di->cap = (di->cap) ? di->cap * 2 : 16;
+		di->map = realloc(di->map, di->cap * sizeof(uint32_t));
+		di->room = realloc(di->room, di->cap * sizeof(uint16_t));
+		di->next = realloc(di->next, di->cap * sizeof(int));
+		di->prev = realloc(di->prev, di->cap * sizeof(int));
+	}
+	int q = di->nblocks++;
+	di->map[q] = block;
+	dir_room_link(di, q, room);
+	return q;
+}
 
-		// if (strcmp(d->name, name) == 0)
-		// 	return -1;
-
-		if (d->rec_len != calc && sum == f->block_size) {
-			/* if the calculated value doesn't match the given value,
-			then we've reached the final entry on the block */
-			sum -= d->rec_len;
-			if (sum + new_entry_len > f->block_size) {
-				/* we need to allocate another block for the parent
-				directory*/
-				printf("PANIC! out of room");
-				return NULL;
-			}
-			d->rec_len = calc; 		// Resize this entry to it's real size
-			d = (struct ext2_dirent*)((char*) d + d->rec_len);
-			break;
+static struct dir_name* dir_name_find(struct dir_index* di, const char* name, int len, uint64_t hash) {
+	for (uint32_t q = hash & (di->size - 1); di->names[q].name; q = (q + 1) & (di->size - 1)) {
+		struct dir_name* e = &di->names[q];
+		if (e->name != DIR_TOMB && e->hash == hash && strlen(e->name) == len && memcmp(e->name, name, len) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static void dir_name_add(struct dir_index* di, const char* name, int len, uint32_t inode, uint32_t block);
+
+static void dir_name_grow(struct dir_index* di) {
+	struct dir_name* old = di->names;
+	uint32_t old_size = di->size;
+
+	if ((di->count + 1) * 2 > di->size)
+		di->size *= 2;
+	di->names = calloc(di->size, sizeof(struct dir_name));
+	di->count = di->tombs = 0;
+	for (uint32_t q = 0; q < old_size; q++)
+		if (old[q].name && old[q].name != DIR_TOMB) {
+			dir_name_add(di, old[q].name, strlen(old[q].name), old[q].inode, old[q].block);
+			free(old[q].name);
 		}
-		//printf("name %s\n",d->name);
-		d = (struct ext2_dirent*)((char*) d + d->rec_len);
+	free(old);
+}
+
+static void dir_name_add(struct dir_index* di, const char* name, int len, uint32_t inode, uint32_t block) {
+	if ((di->count + di->tombs + 1) * 2 > di->size)
+		dir_name_grow(di);
+
+	uint64_t hash = ext2_hash(name, len, 0);
+	uint32_t q = hash & (di->size - 1);
+	while (di->names[q].name && di->names[q].name != DIR_TOMB)
+		q = (q + 1) & (di->size - 1);
+	if (di->names[q].name == DIR_TOMB)
+		di->tombs--;
+	di->names[q].hash = hash;
+	di->names[q].inode = inode;
+	di->names[q].block = block;
+	di->names[q].name = strndup(name, len);
+	di->count++;
+}
 
+static void dir_name_del(struct dir_index* di, struct dir_name* e) {
+	free(e->name);
+	e->name = DIR_TOMB;
+	di->count--;
+	di->tombs++;
+}
+
+/* Largest entry that fits in a directory block, by splitting the slack off
+the end of an entry or reusing an unused one */
+static int dir_block_room(struct ext2_fs *f, uint8_t* data) {
+	int room = 0;
+	for (int off = 0; off < f->block_size; ) {
+		struct ext2_dirent* d = (struct ext2_dirent*) (data + off);
 		if (d->rec_len == 0)
 			break;
-	} while(sum < f->block_size);
+		int slack = d->rec_len - ((d->inode) ? DIRENT_LEN(d->name_len) : 0);
+		if (slack > room)
+			room = slack;
+		off += d->rec_len;
+	}
+	return room;
+}
+
+static void dir_index_free(struct dir_index* di) {
+	for (uint32_t q = 0; q < di->size; q++)
+		if (di->names[q].name != DIR_TOMB)
+			free(di->names[q].name);
+	free(di->names);
+	free(di->map);
+	free(di->room);
+	free(di->next);
+	free(di->prev);
+	free(di->head);
+	free(di->used);
+	free(di);
+}
 
-	/* d is now pointing at a blank entry, right after the resized last entry */
-	d->rec_len 		= f->block_size - ((char*)d - (char*)rootdir_buf->data);
-	d->inode 		= i_no;
-	d->file_type 	= 1;
-	d->name_len 	= strlen(name);
+/* Read dir_inode once and index it. NULL if it is not a directory */
+static struct dir_index* dir_index_build(struct ext2_fs *f, int dir_inode) {
+	struct ext2_inode* in = ext2_read_inode(f, dir_inode);
+	if ((in->mode & 0xF000) != EXT2_IFDIR) {
+		free(in);
+		return NULL;
+	}
+
+	struct dir_index* di = calloc(1, sizeof(struct dir_index));
+	di->inode = dir_inode;
+	di->classes = f->block_size / 4 + 1;
+	di->head = malloc(di->classes * sizeof(int));
+	memset(di->head, 0xFF, di->classes * sizeof(int));
+	di->used = calloc((di->classes + 63) / 64, sizeof(uint64_t));
+	di->size = 64;
+	di->names = calloc(di->size, sizeof(struct dir_name));
+
+	uint32_t n;
+	uint32_t* map = ext2_block_map(f, in, &n);
+	free(in);
+	uint8_t* data = malloc(f->block_size);
+
+	for (uint32_t q = 0; q < n; q++) {
+		if (!map[q]) {
+			dir_block_add(di, 0, 0);	// A hole never takes entries
+			continue;
+		}
+		buffer_read_blocks(f, map[q], 1, data);
+		dir_block_add(di, map[q], dir_block_room(f, data));
+		for (int off = 0; off < f->block_size; ) {
+			struct ext2_dirent* d = (struct ext2_dirent*) (data + off);
+			if (d->rec_len == 0)
+				break;
+			if (d->inode)
+				dir_name_add(di, d->name, d->name_len, d->inode, q);
+			off += d->rec_len;
+		}
+	}
+	free(data);
+	free(map);
+	return di;
+}
+
+/* The index for dir_inode, building it if needed. Caller holds dir_lock */
+static struct dir_index* dir_index_get(struct ext2_fs *f, int dir_inode) {
+	struct dir_index** pp = &f->dirs;
+	int depth = 0;
+	for (; *pp; pp = &(*pp)->lru, depth++) {
+		if ((*pp)->inode != dir_inode)
+			continue;
+		/* Move to the front */
+		struct dir_index* di = *pp;
+		*pp = di->lru;
+		di->lru = f->dirs;
+		f->dirs = di;
+		return di;
+	}
+
+	struct dir_index* di = dir_index_build(f, dir_inode);
+	if (!di)
+		return NULL;
+	di->lru = f->dirs;
+	f->dirs = di;
+
+	/* Drop the least recently used index beyond the limit */
+	if (depth >= DIR_CACHE_MAX) {
+		for (pp = &f->dirs; (*pp)->lru; pp = &(*pp)->lru)
+			;
+		dir_index_free(*pp);
+		*pp = NULL;
+	}
+	return di;
+}
 
-	for (int q = 0; q < strlen(name); q++) 
-		d->name[q] = name[q];
+/* Drop the index of dir_inode, or of every directory when it is 0, after
+the directory has been changed other than through this file */
+void ext2_dir_forget(struct ext2_fs *f, int dir_inode) {
+	pthread_mutex_lock(&f->dir_lock);
+	for (struct dir_index** pp = &f->dirs; *pp; ) {
+		struct dir_index* di = *pp;
+		if (dir_inode && di->inode != dir_inode) {
+			pp = &di->lru;
+			continue;
+		}
+		*pp = di->lru;
+		dir_index_free(di);
+	}
+	pthread_mutex_unlock(&f->dir_lock);
+}
+
+/* Add an inode into parent_inode. The free-space index picks a block with
+room, and the directory grows by a block when none has any. Returns -1 if
+the name is already taken */
+int ext2_add_child(struct ext2_fs *f, int parent_inode, int i_no, char* name, int type) {
+	int name_len = strlen(name);
+	int new_entry_len = DIRENT_LEN(name_len);
+
+	pthread_mutex_lock(&f->dir_lock);
+	struct dir_index* di = dir_index_get(f, parent_inode);
+	if (!di || dir_name_find(di, name, name_len, ext2_hash(name, name_len, 0))) {
+		pthread_mutex_unlock(&f->dir_lock);
+		return -1;
+	}
+
+	buffer* b;
+	int q = dir_room_find(di, new_entry_len);
+	if (q < 0) {
+		/* we need to allocate another block for the parent directory */
+		struct ext2_inode* dir = ext2_read_inode(f, parent_inode);
+		int group = (parent_inode - 1) / f->sb->inodes_per_group;
+		uint32_t goal = (di->nblocks && di->map[di->nblocks - 1]) ? di->map[di->nblocks - 1] + 1 : ext2_group_data_start(f, group);
+		uint32_t block = 0;
+		char fresh = 0;
+		if (ext2_map_range(f, dir, parent_inode, di->nblocks, 1, &block, &fresh, 1, goal)) {
+			printf("%s: directory out of space\n", name);
+			ext2_write_inode(f, parent_inode, dir);
+			free(dir);
+			pthread_mutex_unlock(&f->dir_lock);
+			return -1;
+		}
+		dir->size = (di->nblocks + 1) * f->block_size;
+		ext2_write_inode(f, parent_inode, dir);
+		free(dir);
+
+		b = buffer_read(f, block);
+		memset(b->data, 0, f->block_size);
+		((struct ext2_dirent*) b->data)->rec_len = f->block_size;
+		q = dir_block_add(di, block, f->block_size);
+	} else
+		b = buffer_read(f, di->map[q]);
+
+	/* First fit within the block */
+	struct ext2_dirent* slot = NULL;
+	for (int off = 0; off < f->block_size; ) {
+		struct ext2_dirent* d = (struct ext2_dirent*) (b->data + off);
+		if (d->rec_len == 0)
+			break;
+		int calc = (d->inode) ? DIRENT_LEN(d->name_len) : 0;
+		if (d->rec_len - calc >= new_entry_len) {
+			slot = d;
+			break;
+		}
+		off += d->rec_len;
+	}
+	assert(slot);
+
+	if (slot->inode) {
+		/* Resize the entry to it's real size, and take the rest */
+		int calc = DIRENT_LEN(slot->name_len);
+		struct ext2_dirent* d = (struct ext2_dirent*)((char*) slot + calc);
+		d->rec_len = slot->rec_len - calc;
+		slot->rec_len = calc;
+		slot = d;
+	}
+
+	/* slot is now a blank entry, spanning the free space */
+	slot->inode 	= i_no;
+	slot->file_type = type;
+	slot->name_len 	= name_len;
+	memcpy(slot->name, name, name_len);
 
 	/* Write the buffer to the disk */
-	buffer_write(f, rootdir_buf);
+	buffer_write(f, b);
+	dir_room_set(di, q, dir_block_room(f, b->data));
+	dir_name_add(di, name, name_len, i_no, q);
+	buffer_free(b);
+	pthread_mutex_unlock(&f->dir_lock);
 
 	return 1;
 }
 
+/* Read every block of a directory into one contiguous buffer. Entries never
+span blocks, so callers can walk the result one block at a time */
+char* ext2_read_dir(struct ext2_fs *f, struct ext2_inode* in, int* len) {
+	uint32_t n;
+	uint32_t* map = ext2_block_map(f, in, &n);
+	char* buf = malloc(n * f->block_size + 1);
+
+	for (uint32_t q = 0; q < n; q++) {
+		if (map[q])
+			buffer_read_blocks(f, map[q], 1, buf + (q * f->block_size));
+		else
+			memset(buf + (q * f->block_size), 0, f->block_size);
+	}
+	free(map);
+	*len = n * f->block_size;
+	return buf;
+}
+
 /* Finds an inode by name in dir_inode */
 int ext2_find_child(struct ext2_fs *f, const char* name, int dir_inode) {
-	if (!dir_inode)
+	if (dir_inode <= 0)
 		return -1;
-	struct ext2_inode* i = ext2_read_inode(f, dir_inode);			// Root directory
-	int num_blocks = i->blocks / (f->block_size / SECTOR_SIZE);
-	char* buf = malloc(f->block_size*num_blocks);
-	memset(buf, 0, f->block_size*num_blocks);
-
-	for (int q = 0; q < i->blocks / 2; q++) {
-		buffer* b = buffer_read(f, i->block[q]);
-		memcpy((char*)buf+(q * f->block_size), b->data, f->block_size);
-	}
-
-	struct ext2_dirent* d = (struct ext2_dirent*) buf;
-	
-	int sum = 0;
-	int calc = 0;
-	do {
-		// Calculate the 4byte aligned size of each entry
-		calc = (sizeof(struct ext2_dirent) + d->name_len + 4) & ~0x3;
-		sum += d->rec_len;
-		//printf("%2d  %10s\t%2d %3d\n", (int)d->inode, d->name, d->name_len, d->rec_len);
-		if (strncmp(d->name, name, d->name_len)== 0) {
-			
-			free(buf);
-			return d->inode;
-		}
-		d = (struct ext2_dirent*)((uint32_t) d + d->rec_len);
-
-	} while(sum < (1024 * num_blocks));
-	free(buf);
-	return -1;
+	int name_len = strlen(name);
+	int found = -1;
+
+	pthread_mutex_lock(&f->dir_lock);
+	struct dir_index* di = dir_index_get(f, dir_inode);
+	struct dir_name* e = (di) ? dir_name_find(di, name, name_len, ext2_hash(name, name_len, 0)) : NULL;
+	if (e)
+		found = e->inode;
+	pthread_mutex_unlock(&f->dir_lock);
+	return found;
 }
 
 
-/* Create a new directory
-Need to handle cases where this entry causes an overflow of the parent directory,
-i.e. force allocation of a new block */
-struct ext2_dirent* ext2_create_dir(struct ext2_fs *f, char* name, int parent_inode) {
+/* Create a new directory holding "." and "..", and link it into
+parent_inode. Returns the new inode number, or -1 */
+int ext2_create_dir(struct ext2_fs *f, char* name, int parent_inode) {
 	int mode = EXT2_IFDIR | EXT2_IRUSR | EXT2_IWUSR | EXT2_IXUSR;
-	int i_no = ext2_alloc_inode(f);
-	//int block_group = (i_no - 1) / s->inodes_per_group; // block group #
-
-	struct ext2_inode* in = malloc(INODE_SIZE); 
-	in->blocks = 2;
-	puts("DEBUG1");
-	in->block[0] = ext2_alloc_block(f, 1);
-	puts("DEBUG2");
+	if (ext2_find_child(f, name, parent_inode) > 0)
+		return -1;
+
+	int i_no = ext2_alloc_inode(f, parent_inode, mode);
+	if (!i_no)
+		return -1;
+	int block_group = (i_no - 1) / f->sb->inodes_per_group; // block group #
+
+	struct ext2_inode* in = calloc(1, INODE_SIZE); 
+	in->block[0] = ext2_alloc_block(f, block_group);
+	if (!in->block[0]) {
+		ext2_free_inode(f, i_no);
+		free(in);
+		return -1;
+	}
+	in->blocks = f->block_size / SECTOR_SIZE;
 	in->mode = mode;	
-	in->size = 0;
+	in->size = f->block_size;
 	in->atime = time(NULL);
 	in->ctime = time(NULL);
 	in->mtime = time(NULL);
 	in->dtime = 0;
-	in->links_count = 1;		/* Setting this to 0 = BIG NO NO */
-
-
+	in->links_count = 2;		/* Parent's entry, and our own "." */
+
+	buffer* b = buffer_read(f, in->block[0]);
+	memset(b->data, 0, f->block_size);
+	struct ext2_dirent* d = (struct ext2_dirent*) b->data;
+	d->inode = i_no;
+	d->rec_len = 12;
+	d->name_len = 1;
+	d->file_type = EXT2_FT_DIR;
+	d->name[0] = '.';
+	d = (struct ext2_dirent*) (b->data + 12);
+	d->inode = parent_inode;
+	d->rec_len = f->block_size - 12;
+	d->name_len = 2;
+	d->file_type = EXT2_FT_DIR;
+	d->name[0] = '.';
+	d->name[1] = '.';
+	buffer_write(f, b);
+	buffer_free(b);
+
+	ext2_barrier(f);
 	ext2_write_inode(f, i_no, in);
-	assert(ext2_add_child(f, parent_inode, i_no, name, EXT2_FT_DIR));
+	if (ext2_add_child(f, parent_inode, i_no, name, EXT2_FT_DIR) <= 0) {
+		/* Never linked: give back the block and the inode */
+		in->links_count = 0;
+		in->dtime = time(NULL);
+		ext2_write_inode(f, i_no, in);
+		ext2_free_blocks(f, in->block, 1);
+		ext2_free_inode(f, i_no);
+		free(in);
+		return -1;
+	}
+	free(in);
+	ext2_add_link(f, parent_inode);		/* Our ".." */
+	ext2_acquire_fs(f);
+	f->bg[block_group].used_dirs_count++;
+	f->ndirs++;
+	ext2_bg_dirty(f, block_group);
+	ext2_release_fs(f);
 
 	return i_no;
 }
 
-char* gen_file_perm_string(uint16_t x) {
+/* Remove the entry called name from dir_inode. Its space is merged into the
+previous entry of the same block; the first entry of a block is instead
+marked unused. Returns the inode the entry pointed at, or -1 */
+int ext2_remove_child(struct ext2_fs *f, int dir_inode, char* name) {
+	int name_len = strlen(name);
+	int found = -1;
+
+	pthread_mutex_lock(&f->dir_lock);
+	struct dir_index* di = dir_index_get(f, dir_inode);
+	struct dir_name* e = (di) ? dir_name_find(di, name, name_len, ext2_hash(name, name_len, 0)) : NULL;
+	if (!e) {
+		pthread_mutex_unlock(&f->dir_lock);
+		return -1;
+	}
+
+	/* Only the one block holding the entry is touched */
+	buffer* b = buffer_read(f, di->map[e->block]);
+	struct ext2_dirent* prev = NULL;
+	for (int off = 0; off < f->block_size; ) {
+		struct ext2_dirent* d = (struct ext2_dirent*) (b->data + off);
+		if (d->rec_len == 0)
+			break;
+		if (d->inode && d->name_len == name_len && strncmp(d->name, name, name_len) == 0) {
+			found = d->inode;
+			if (prev)
+				prev->rec_len += d->rec_len;
+			else
+				d->inode = 0;
+			buffer_write(f, b);
+			break;
+		}
+		prev = d;
+		off += d->rec_len;
+	}
+	dir_room_set(di, e->block, dir_block_room(f, b->data));
+	dir_name_del(di, e);
+	buffer_free(b);
+	pthread_mutex_unlock(&f->dir_lock);
+	return found;
+}
+
+/* Remove the empty directory at path */
+int ext2_rmdir(struct ext2_fs *f, char* path) {
+	char* name;
+	int parent = ext2_pathize_parent(f, path, &name);
+	int i_no = (parent > 0) ? ext2_find_child(f, name, parent) : -1;
+	if (i_no <= 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		printf("%s: not found in image\n", name);
+		return -1;
+	}
+
+	struct ext2_inode* in = ext2_read_inode(f, i_no);
+	if ((in->mode & 0xF000) != EXT2_IFDIR) {
+		printf("%s: not a directory\n", name);
+		free(in);
+		return -1;
+	}
+
+	int len;
+	char* buf = ext2_read_dir(f, in, &len);
+	free(in);
+	for (int off = 0; off < len; ) {
+		struct ext2_dirent* d = (struct ext2_dirent*) (buf + off);
+		if (d->rec_len == 0)
+			break;
+		off += d->rec_len;
+		if (!d->inode || (d->name[0] == '.' && (d->name_len == 1 || (d->name_len == 2 && d->name[1] == '.'))))
+			continue;
+		printf("%s: directory not empty\n", name);
+		free(buf);
+		return -1;
+	}
+	free(buf);
+
+	ext2_remove_child(f, parent, name);
+	ext2_truncate(f, i_no, 0);
+
+	in = ext2_read_inode(f, i_no);
+	in->links_count = 0;
+	in->dtime = time(NULL);
+	ext2_write_inode(f, i_no, in);
+	free(in);
+	ext2_free_inode(f, i_no);
+
+	/* The parent loses the link from our ".." */
+	in = ext2_read_inode(f, parent);
+	in->links_count--;
+	ext2_write_inode(f, parent, in);
+	free(in);
+	int g = (i_no - 1) / f->sb->inodes_per_group;
+	ext2_acquire_fs(f);
+	f->bg[g].used_dirs_count--;
+	f->ndirs--;
+	ext2_bg_dirty(f, g);
+	ext2_release_fs(f);
+
+	ext2_sync(f);
+	return 0;
+}
+
+static char* gen_file_perm_string(uint16_t x) {
 	char *perm = malloc(10);
 	strcpy(perm, "---------");
 
@@ -172,42 +608,26 @@ char* gen_file_perm_string(uint16_t x) {
 	return perm;
 }
 
-void ls(struct ext2_fs *f, int inode_num) {
-	struct ext2_inode* i = ext2_read_inode(f, inode_num);			// Root directory
-	int num_blocks = i->blocks / (f->block_size / SECTOR_SIZE);
-	int sz = f->block_size*num_blocks;
-	char* buf = malloc(sz);
-	memset(buf, 0, sz);
-
-	for (int q = 0; q < num_blocks; q++) {
-		printf("%d\n", i->block[q]);
-		buffer* b = buffer_read(f, i->block[q]);
-		memcpy((char*)buf + (q*f->block_size), b->data, f->block_size);
-		buffer_free(b);
-	}
-
-	struct ext2_dirent* d = (struct ext2_dirent*) buf;
-	
-	int sum = 0;
-	int calc = 0;
-	printf("inode permission %20s\tsize\n", "name");	
-	do {
-		
-		// Calculate the 4byte aligned size of each entry
-		sum += d->rec_len;
+void ext2_ls(struct ext2_fs *f, int inode_num) {
+	struct ext2_inode* i = ext2_read_inode(f, inode_num);
+	int len;
+	char* buf = ext2_read_dir(f, i, &len);
+	free(i);
+
+	printf("inode permission %20s\tsize\n", "name");
+	for (int off = 0; off < len; ) {
+		struct ext2_dirent* d = (struct ext2_dirent*) (buf + off);
 		if (d->rec_len == 0)
 			break;
-		
+		off += d->rec_len;
+		if (!d->inode)
+			continue;
+
 		struct ext2_inode* di = ext2_read_inode(f, d->inode);
 		char* perm = gen_file_perm_string(di->mode);
-		printf("%5d %s %20s\t%d\n", d->inode, perm, d->name, di->size);
+		printf("%5d %s %20.*s\t%d\n", d->inode, perm, d->name_len, d->name, di->size);
 		free(perm);
-
-		d = (struct ext2_dirent*)((char*)d + d->rec_len);
-	} while(sum < (f->block_size * num_blocks));
-
+		free(di);
+	}
 	free(buf);
-	return NULL;
 }
-
-
@@ -1,5 +1,5 @@
 /*
-ext2util.c
+ext2.c - ext2util
 ===============================================================================
 MIT License
 Copyright (c) 2007-2016 Michael Lazear
@@ -23,10 +23,11 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 ===============================================================================
 
-ext2util is a command-line interface for reading/writing data from ext2
-disk images. ext2 driver code is directly ported from my own code used in a
-hobby operating system. buffer_read and buffer_write are "glue" functions
-allowing the ramdisk to emulate a hard disk
+Core of the ext2 driver: the buffer layer, superblock and group descriptor
+I/O, and block allocation. Code here is ported from my own hobby operating
+system, where buffer_read and buffer_write sit on the disk driver; here they
+are "glue" functions that read and write the image through its struct ext2_fs,
+so any number of images can be open at once
 */
 
 #include "ext2.h"
@@ -43,30 +44,85 @@ allowing the ramdisk to emulate a hard disk
 #include <sys/stat.h>
 
 #define NULL ((void*) 0)
-static int fp = NULL;
 
 //#define DEBUG
 
+/* All image I/O funnels through these two, so that a copy-on-write overlay
+or direct I/O can sit between the buffer layer and the image */
+static ssize_t dev_read(struct ext2_fs *f, void* buf, size_t len, off_t off) {
+	if (f->pack)
+		return ext2_pack_read(f, buf, len, off);
+	if (f->direct)
+		return ext2_dio_read(f, buf, len, off);
+	if (f->overlay)
+		return overlay_read(f->overlay, buf, len, off);
+	return pread(f->dev, buf, len, off);
+}
+
+static ssize_t dev_write(struct ext2_fs *f, const void* buf, size_t len, off_t off) {
+	ext2_cache_write(f, buf, len, off);
+	f->unflushed = 1;
+	if (f->pack)
+		return ext2_pack_write(f, buf, len, off);
+	if (f->direct)
+		return ext2_dio_write(f, buf, len, off);
+	if (f->overlay)
+		return overlay_write(f->overlay, buf, len, off);
+	return pwrite(f->dev, buf, len, off);
+}
+
+/* Get everything written so far onto stable storage, wherever the writes
+went. The mark is cleared first, so a write racing with the flush is flushed
+next time */
+int ext2_flush(struct ext2_fs *f) {
+	int ret;
+	f->unflushed = 0;
+	if (f->pack)
+		ret = ext2_pack_flush(f);
+	else if (ext2_dio_flush(f))
+		ret = -1;
+	else
+		ret = (f->overlay) ? overlay_sync(f->overlay) : fdatasync(f->dev);
+	__atomic_add_fetch(&f->flushes, 1, __ATOMIC_RELAXED);
+	if (ret)
+		perror("flush");
+	return ret;
+}
+
+/* In ordered and per-operation mode, get the data written so far out ahead
+of the inode or directory entry about to make it reachable. Does nothing when
+there is nothing unflushed */
+int ext2_barrier(struct ext2_fs *f) {
+	if (f->durability == EXT2_DURABLE_NONE || !f->unflushed)
+		return 0;
+	return ext2_flush(f);
+}
+
 /* Buffer_read and write are used as glue functions for code compatibility 
-with hard disk ext2 driver, which has buffer caching functions. Those will
-not be included here.  */
-buffer* buffer_read(struct ext2_fs *f, int block) {
+with hard disk ext2 driver. Reads go through the block cache once the image
+is mounted; the buffer itself is always the caller's own copy */
+buffer* buffer_read(struct ext2_fs *f, uint32_t block) {
 	buffer* b = malloc(sizeof(buffer));
 	b->block = block;
-	b->data = malloc(f->block_size);
-	pread(fp, b->data, f->block_size, block*f->block_size);
+	b->flags = 0;
+	b->data = ext2_pool_get(f);
+	b->fs = f;
+	if (f->cache)
+		ext2_cache_read(f, block, b->data);
+	else
+		dev_read(f, b->data, f->block_size, (off_t) block * f->block_size);
 	#ifdef DEBUG
 	printf("Read %d bytes from block %d to buffer %x\n", f->block_size, block, b->data);
 	#endif
 	return b;
 }
 
-/* Free the buffer block, since we're not caching */
+/* Write the buffer straight through; the cache is patched on the way */
 uint32_t buffer_write(struct ext2_fs *f, buffer* b) {
 	assert(b->block);
 	b->flags |= B_DIRTY;	// Dirty
 
-	pwrite(fp, b->data, f->block_size, b->block * f->block_size);
+	dev_write(f, b->data, f->block_size, (off_t) b->block * f->block_size);
 	// IDE handler should clear the flags
 	b->flags &= ~B_DIRTY;
 	#ifdef DEBUG
@@ -79,14 +135,16 @@ from the beginning of the disk, regardless of logical block size */
 buffer* buffer_read_superblock(struct ext2_fs* f) {
 	buffer* b = malloc(sizeof(buffer));
 	b->block = (f->block_size == 1024) ? 1 : 0;
+	b->flags = 0;
 	b->data = malloc(f->block_size);
-	pread(fp, b->data, sizeof(struct ext2_superblock), 1024);
+	b->fs = NULL;
+	dev_read(f, b->data, sizeof(struct ext2_superblock), 1024);
 	return b;
 }
 
 uint32_t buffer_write_superblock(struct ext2_fs *f, buffer* b) {
 	b->flags |= B_DIRTY;	// Dirty
-	pwrite(fp, b->data, sizeof(struct ext2_superblock), 1024);
+	dev_write(f, b->data, sizeof(struct ext2_superblock), 1024);
 	// IDE handler should clear the flags
 	b->flags &= ~B_DIRTY;
 }
@@ -98,11 +156,30 @@ int buffer_free(buffer* b) {
 	#ifdef DEBUG
 	printf("Freeing\n");
 	#endif
-	//free(b->data);
-
+	if (b->fs)
+		ext2_pool_put(b->fs, b->data);
+	else
+		free(b->data);
+	free(b);
 	return 0;
 }
 
+/* Read count consecutive blocks starting at block straight into dst, so
+callers streaming file data can issue one large read per physical run */
+int buffer_read_blocks(struct ext2_fs *f, uint32_t block, int count, void* dst) {
+	#ifdef DEBUG
+	printf("Read %d blocks from block %d\n", count, block);
+	#endif
+	return dev_read(f, dst, (size_t) count * f->block_size, (off_t) block * f->block_size);
+}
+
+int buffer_write_blocks(struct ext2_fs *f, uint32_t block, int count, void* src) {
+	#ifdef DEBUG
+	printf("Wrote %d blocks to block %d\n", count, block);
+	#endif
+	return dev_write(f, src, (size_t) count * f->block_size, (off_t) block * f->block_size);
+}
+
 
 /* 	Read superblock from device dev, and check the magic flag.
 	Updates the filesystem pointer */
@@ -119,10 +196,10 @@ int ext2_superblock_read(struct ext2_fs *f) {
 	#ifdef DEBUG
 	printf("Reading superblock\n");
 	#endif
-	assert(f->sb->magic == EXT2_MAGIC);
-	if (f->sb->magic != EXT2_MAGIC) {
+	if (f->sb->magic != EXT2_MAGIC || f->sb->log_block_size > 6 ||
+		!f->sb->blocks_per_group || !f->sb->inodes_per_group || f->sb->first_data_block >= f->sb->blocks_count) {
 		printf("ABORT: INVALID SUPERBLOCK\n");
-		return NULL;
+		return -1;
 	}
 	f->block_size = (1024 << f->sb->log_block_size);
 	return 0;
@@ -147,49 +224,70 @@ int ext2_superblock_write(struct ext2_fs *f) {
 	return 0;
 }
 
+/* Blocks taken by the descriptor table, and where it starts: right after
+the superblock's block */
+static uint32_t ext2_blockdesc_blocks(struct ext2_fs *f) {
+	return ((uint64_t) f->num_bg * sizeof(struct ext2_block_group_descriptor) + f->block_size - 1) / f->block_size;
+}
+
+static uint32_t ext2_blockdesc_start(struct ext2_fs *f) {
+	return EXT2_SUPER + ((f->block_size == 1024) ? 1 : 0);
+}
+
+/* Read the whole descriptor table in one go. The group count is rounded up,
+since the last group may be short, and worked out in 64 bits so that a
+filesystem of 2^32 blocks doesn't wrap */
 int ext2_blockdesc_read(struct ext2_fs *f) {
 	if (!f) return -1;
 
-	int num_block_groups = (f->sb->blocks_count / f->sb->blocks_per_group);
-	int num_to_read = (num_block_groups * sizeof(struct ext2_block_group_descriptor)) / f->block_size;
-	f->num_bg = num_block_groups;
-	num_to_read++;	// round up
+	struct ext2_superblock* s = f->sb;
+	f->num_bg = ((uint64_t) s->blocks_count - s->first_data_block + s->blocks_per_group - 1) / s->blocks_per_group;
+	uint32_t n = ext2_blockdesc_blocks(f);
 
 	#ifdef DEBUG
-	printf("Number of block groups: %d (%d blocks)\n", f->num_bg, num_to_read);
+	printf("Number of block groups: %d (%d blocks)\n", f->num_bg, n);
 	#endif
 
-	if (!f->bg) {
-		f->bg = malloc(num_block_groups* sizeof(struct ext2_block_group_descriptor));
-	}
+	free(f->bg);
+	free(f->bg_dirty);
+	f->bg = malloc((size_t) n * f->block_size);
+	f->bg_dirty = calloc((n + 7) / 8, 1);
+	if (buffer_read_blocks(f, ext2_blockdesc_start(f), n, f->bg) != (size_t) n * f->block_size)
+		return -1;
 
-	/* Above a certain block size to disk size ratio, we need more than one block */
-	for (int i = 0; i < num_to_read; i++) {
-		int n = EXT2_SUPER + i + ((f->block_size == 1024) ? 1 : 0); 	
-		buffer* b = buffer_read(f, n);
-		memcpy(((char*) f->bg) + (i*f->block_size), b->data, f->block_size);
-		buffer_free(b);
-	}
+	f->ndirs = 0;
+	for (int g = 0; g < f->num_bg; g++)
+		f->ndirs += f->bg[g].used_dirs_count;
 	return 0;
 }
 
+/* Note that group g's descriptor changed. Lock held */
+void ext2_bg_dirty(struct ext2_fs *f, int g) {
+	uint32_t b = (uint64_t) g * sizeof(struct ext2_block_group_descriptor) / f->block_size;
+	f->bg_dirty[b / 8] |= 1 << (b % 8);
+}
+
+/* Write back the descriptor blocks changed since the last time, a run of
+neighbours at a time, so syncing costs the same however many groups
+there are */
 int ext2_blockdesc_write(struct ext2_fs *f) {
 	if (!f) return -1;
 
-	int num_block_groups = (f->sb->blocks_count / f->sb->blocks_per_group);
-	int num_to_read = (num_block_groups * sizeof(struct ext2_block_group_descriptor)) / f->block_size;
-	/* Above a certain block size to disk size ratio, we need more than one block */
-	num_to_read++;	// round up
-	for (int i = 0; i < num_to_read; i++) {
-		int n = EXT2_SUPER + i + ((f->block_size == 1024) ? 1 : 0); 	
-		buffer* b = buffer_read(f, n);
-		memcpy(b->data, (char*) f->bg + (i*f->block_size), f->block_size);
+	uint32_t n = ext2_blockdesc_blocks(f);
+	for (uint32_t q = 0; q < n; ) {
+		if (!(f->bg_dirty[q / 8] & (1 << (q % 8)))) {
+			q++;
+			continue;
+		}
+		uint32_t run = 0;
+		for (; q + run < n && (f->bg_dirty[(q + run) / 8] & (1 << ((q + run) % 8))); run++)
+			f->bg_dirty[(q + run) / 8] &= ~(1 << ((q + run) % 8));
 
 		#ifdef DEBUG
-		printf("Writing to block group desc (block %d)\n", n);
+		printf("Writing to block group desc (blocks %d-%d)\n", q, q + run - 1);
 		#endif
-		buffer_write(f, b);
-		buffer_free(b);
+		buffer_write_blocks(f, ext2_blockdesc_start(f) + q, run, (char*) f->bg + (size_t) q * f->block_size);
+		q += run;
 	}
 	return 0;
 }
@@ -205,63 +303,219 @@ int ext2_first_free(uint32_t* b, int sz) {
 	return -1;
 }
 
-/* 
-Finds a free block from the block descriptor group, and sets it as used
-*/
-uint32_t ext2_alloc_block(struct ext2_fs *f, int block_group) {
-	struct ext2_block_group_descriptor* bg = f->bg;
-	struct ext2_superblock* s = f->sb;
+/* Index of the first clear bit in [start, end) of a bitmap, or -1. Whole
+64-bit words of used bits are skipped at once */
+int ext2_next_free(uint8_t* bitmap, int start, int end) {
+	int q = start;
+	for (; q < end && (q % 64); q++)
+		if (!(bitmap[q / 8] & (1 << (q % 8))))
+			return q;
+	for (; q + 64 <= end; q += 64) {
+		uint64_t w;
+		memcpy(&w, bitmap + q / 8, sizeof(w));
+		if (~w)
+			return q + __builtin_ctzll(~w);
+	}
+	for (; q < end; q++)
+		if (!(bitmap[q / 8] & (1 << (q % 8))))
+			return q;
+	return -1;
+}
 
-	bg += block_group;
-	// Read the block and inode bitmaps from the block descriptor group
-	buffer* bitmap_buf;
-	uint32_t* bitmap = malloc(f->block_size);
-	uint32_t num = 0;
-	do {
+/* Blocks in group g; only the last group can be short */
+uint32_t ext2_group_bits(struct ext2_fs *f, int g) {
+	struct ext2_superblock* s = f->sb;
+	uint32_t bits = s->blocks_count - s->first_data_block - g * s->blocks_per_group;
+	return (bits > s->blocks_per_group) ? s->blocks_per_group : bits;
+}
 
-		bitmap_buf = buffer_read(f, bg->block_bitmap);
-		memcpy(bitmap, bitmap_buf->data, f->block_size);
-		// Find the first free bit in both bitmaps
-		bg++;
-		block_group++;
-	} while( (num = ext2_first_free(bitmap, f->block_size)) == -1);	
+/* First block of group g past its bitmaps and inode table, where data in
+the group starts */
+uint32_t ext2_group_data_start(struct ext2_fs *f, int g) {
+	return f->bg[g].inode_table + (f->sb->inodes_per_group * INODE_SIZE + f->block_size - 1) / f->block_size;
+}
 
-	// Should use a macro, not "32"
-	bitmap[num / 32] |= (1<<(num % 32));
+/* Preallocation windows.
+
+An inode that is being grown through an open handle can hold a window: a
+range of blocks set aside for it in memory only. Its new blocks are taken
+from the window in order, and every other allocation steps around it, so
+files that grow at the same time each stay contiguous instead of
+interleaving. Nothing about a window reaches the disk; dropping one just
+makes its unused blocks available again */
+
+#define EXT2_RSV_BYTES	(1 << 20)	// Window size
+
+struct ext2_rsv {
+	int inode;
+	uint32_t start;		// Window is [start, end)
+	uint32_t end;
+	uint32_t next;		// Next block to try inside the window
+	struct ext2_rsv* link;
+};
+
+/* The window of another inode than owner that holds block, if any */
+static struct ext2_rsv* ext2_rsv_find(struct ext2_fs *f, uint32_t block, int owner) {
+	for (struct ext2_rsv* r = f->rsv; r; r = r->link)
+		if (r->inode != owner && block >= r->start && block < r->end)
+			return r;
+	return NULL;
+}
 
-	// Update bitmaps and write to disk
-	memcpy(bitmap_buf->data, bitmap, f->block_size);	
-	buffer_write(f, bitmap_buf);		
+/* Core of block allocation, called with the lock held. Takes the first free
+block in [lo, hi) of group g that is outside other inodes' windows */
+static uint32_t ext2_take_block(struct ext2_fs *f, int g, int lo, int hi, int owner) {
+	struct ext2_superblock* s = f->sb;
+	struct ext2_block_group_descriptor* bg = f->bg + g;
+	uint32_t base = g * s->blocks_per_group + s->first_data_block;
+	if (!bg->free_blocks_count || lo >= hi)
+		return 0;
+
+	uint8_t* bitmap = ext2_space_bitmap(f, f->bmap, g);
+	int num = ext2_next_free(bitmap, lo, hi);
+	struct ext2_rsv* r;
+	while (num >= 0 && (r = ext2_rsv_find(f, base + num, owner)))
+		num = (r->end - base < hi) ? ext2_next_free(bitmap, r->end - base, hi) : -1;
+	if (num < 0)
+		return 0;
+
+	ext2_space_mark(f, f->bmap, g, num, 1);
+	s->free_blocks_count--;
+	bg->free_blocks_count--;
+	ext2_bg_dirty(f, g);
+	return base + num;
+}
 
-	// Free our bitmaps
-	free(bitmap);			
+/* Search for a block from goal onwards: the rest of goal's group first,
+then the following groups with free space in turn, wrapping around. Lock
+held */
+static uint32_t ext2_take_block_near(struct ext2_fs *f, uint32_t goal, int owner) {
+	struct ext2_superblock* s = f->sb;
+	if (goal < s->first_data_block || goal >= s->blocks_count)
+		goal = s->first_data_block;
+	int first = (goal - s->first_data_block) / s->blocks_per_group;
+	int bit = (goal - s->first_data_block) % s->blocks_per_group;
+
+	/* The goal group comes round twice: from the goal on, and at the end
+	for whatever lies before the goal. Groups in between without a free
+	block are skipped by the space summary */
+	uint32_t block = ext2_take_block(f, first, bit, ext2_group_bits(f, first), owner);
+	for (int d = 0; !block; ) {
+		int g = ext2_space_find(f, f->bmap, (first + d + 1) % f->num_bg, 1);
+		int next = (g - first + f->num_bg) % f->num_bg;
+		if (g < 0 || next <= d)
+			break;
+		d = next;
+		block = ext2_take_block(f, g, 0, ext2_group_bits(f, g), owner);
+	}
+	if (!block)
+		block = ext2_take_block(f, first, 0, bit, owner);
+	return block;
+}
 
-	s->free_inodes_count--;
-	bg->free_inodes_count--;
-	buffer_free(bitmap_buf);
-	return num + ((block_group - 1) * s->blocks_per_group) + 1;	// 1 indexed				
+/* 
+Finds a free block as close after goal as possible, and sets it as used.
+Returns 0 when the filesystem is full
+*/
+uint32_t ext2_alloc_block_near(struct ext2_fs *f, uint32_t goal) {
+	ext2_acquire_fs(f);
+	uint32_t block = ext2_take_block_near(f, goal, 0);
+	ext2_release_fs(f);
+	return block;
 }
 
+/* Allocate a block for inode_num near goal. An inode holding a window takes
+the next free block of its window, and opens a new window at the block it
+gets when the old one is used up */
+uint32_t ext2_alloc_block_for(struct ext2_fs *f, int inode_num, uint32_t goal) {
+	struct ext2_superblock* s = f->sb;
+	ext2_acquire_fs(f);
+
+	struct ext2_rsv* r = f->rsv;
+	while (r && r->inode != inode_num)
+		r = r->link;
+	if (!r) {
+		uint32_t block = ext2_take_block_near(f, goal, 0);
+		ext2_release_fs(f);
+		return block;
+	}
+
+	if (r->next < r->end) {
+		int g = (r->next - s->first_data_block) / s->blocks_per_group;
+		uint32_t base = g * s->blocks_per_group + s->first_data_block;
+		uint32_t block = ext2_take_block(f, g, r->next - base, r->end - base, inode_num);
+		if (block) {
+			r->next = block + 1;
+			ext2_release_fs(f);
+			return block;
+		}
+	}
+
+	/* Open a new window at the block found, up to the group's end or the
+	next window, whichever is nearer */
+	uint32_t block = ext2_take_block_near(f, goal, inode_num);
+	if (block) {
+		int g = (block - s->first_data_block) / s->blocks_per_group;
+		uint32_t end = (g + 1) * s->blocks_per_group + s->first_data_block;
+		if (end > s->blocks_count)
+			end = s->blocks_count;
+		if (end - block > EXT2_RSV_BYTES / f->block_size)
+			end = block + EXT2_RSV_BYTES / f->block_size;
+		for (struct ext2_rsv* o = f->rsv; o; o = o->link)
+			if (o != r && o->start > block && o->start < end)
+				end = o->start;
+		r->start = block;
+		r->next = block + 1;
+		r->end = end;
+	}
+	ext2_release_fs(f);
+	return block;
+}
 
+/* Give inode_num a window, opened at its next allocation */
+void ext2_reserve(struct ext2_fs *f, int inode_num) {
+	ext2_acquire_fs(f);
+	struct ext2_rsv* r = f->rsv;
+	while (r && r->inode != inode_num)
+		r = r->link;
+	if (!r) {
+		r = calloc(1, sizeof(struct ext2_rsv));
+		r->inode = inode_num;
+		r->link = f->rsv;
+		f->rsv = r;
+	}
+	ext2_release_fs(f);
+}
 
+/* Drop the window of inode_num, or every window when it is 0. The blocks
+it did not use simply become available to everyone again */
+void ext2_unreserve(struct ext2_fs *f, int inode_num) {
+	ext2_acquire_fs(f);
+	for (struct ext2_rsv** pp = &f->rsv; *pp; ) {
+		struct ext2_rsv* r = *pp;
+		if (inode_num && r->inode != inode_num) {
+			pp = &r->link;
+			continue;
+		}
+		*pp = r->link;
+		free(r);
+	}
+	ext2_release_fs(f);
+}
 
-// Converts to same endian-ness as sublime for hex viewing
-uint32_t byte_order(uint32_t i) {
-	uint32_t x;
-	uint8_t* bytes = (uint8_t*) &x;
-	bytes[0] = i >> 24 & 0xFF;
-	bytes[1] = i >> 16 & 0xFF;
-	bytes[2] = i >> 8 & 0xFF;
-	bytes[3] = i & 0xFF;
-	return x;
+/* A free block in block_group, or in the groups after it */
+uint32_t ext2_alloc_block(struct ext2_fs *f, int block_group) {
+	return ext2_alloc_block_near(f, ext2_group_data_start(f, block_group));
 }
 
+
 int ext2_write_indirect(struct ext2_fs *f, uint32_t indirect, uint32_t link, size_t block_num) {
 	if (block_num >= (f->block_size / 4))
 		return -1;
 	buffer* b = buffer_read(f, indirect);
-	*(uint32_t*) ((uint32_t) b->data + block_num*4)  = link;
-	return buffer_write(f, b);
+	((uint32_t*) b->data)[block_num] = link;
+	buffer_write(f, b);
+	return buffer_free(b);
 
 }
 
@@ -269,145 +523,7 @@ uint32_t ext2_read_indirect(struct ext2_fs *f, uint32_t indirect, size_t block_n
 	if (block_num >= (f->block_size / 4))
 		return NULL;
 	buffer* b = buffer_read(f, indirect);
-	return *(uint32_t*) ((uint32_t) b->data + block_num*4);
-}
-
-
-
-/* Adds a file to root directory */
-int add_to_disk(struct ext2_fs *f, char* file_name, int i) {
-	int fp_add = open(file_name, O_RDWR, 0444);
-	assert(fp_add);
-
-	int sz = lseek(fp_add, 0, SEEK_END);		// seek to end of file
-	lseek(fp_add, 0, SEEK_SET);		// back to beginning
-
-	char* buffer = malloc(sz);	// File buffer
-	int ret = pread(fp_add, buffer, sz, 0);
-
-
-	if (i) {
-		ext2_write_file(f, i, EXT2_ROOTDIR, file_name, buffer, 0x1C0 | EXT2_IFREG, sz);
-	} else {
-		ext2_touch_file(f, 2, file_name, buffer, 0x1C0, sz);
-	}
-	printf("%s %d\n", file_name, sz);
-	free(buffer);
-}
-
-
-#define F_INODE 	0x20
-#define F_WRITE		0x01 
-#define F_READ 		0x02 
-#define F_DUMP 		0x04 
-#define F_FILE 		0x40
-#define F_LS 		0x80
-
-int main(int argc, char* argv[]) {
-	static char usage[] = "usage: ext2util -x disk.img [-l] [-wrd] [-i inode | -f fname]";
-	extern char *optarg;
-	extern int optind;
-	int c, err = 0;
-	uint32_t flags = 0;
-
-	int inode_num = -1;
-	char* file_name = "default_file_name";
-	char* image = "default";
-
-	while ( (c = getopt(argc, argv, "lwrdi:f:x:")) != -1) 
-		switch(c) {
-			case 'x':
-				image = optarg;
-				flags |= 0x1000;
-				break;
-			case 'w':
-				flags |= 0x1;
-				break;
-			case 'r':
-				flags |= 0x2;
-				break;
-			case 'd':
-				flags |= 0x4;
-				break;
-			case 'i':
-				flags |= 0x20;
-				inode_num = atoi(optarg);
-				break;
-			case 'f':
-				flags |= 0x40;
-				file_name = optarg;
-				break;
-			case '?':
-				err = 1;
-				break;
-			case 'l':
-				flags |= 0x80;
-				break;
-		}
-
-	if (err || (flags & 0x1000) == 0) {
-		printf("%s\n", usage);
-		return;
-	}
-	if ((flags & 0x3) == 0x3) {
-		printf("%s\n", usage);
-		printf("Cannot read and write during same run\n");
-		return;
-	}
-
-	fp = open(image, O_RDWR, 0444);
-	assert(fp);
-	fs_dev_init();
-
-	gfsp = ext2_mount(1);
-	gfsp->sb->mtime = time(NULL);	// Update mount time
-
-	sb_dump(gfsp->sb);
-
-
-
-	if (flags & 0x1) {			/* Write */
-		if ((flags & 0x60) == 0) {
-			printf("%s\n", usage);
-			printf("Specify an inode or file name\n");
-			return;
-		}
-
-			struct stat s;
-		stat(file_name, &s);
-		printf("%s, %d bytes\n", file_name, s.st_size);
-
-		if ((flags & 0x60) == 0x60) {	
-			// Inode & File
-			add_to_disk(gfsp, file_name, inode_num);
-		} else if (flags & 0x40) {	
-			// Touch a new inode
-			add_to_disk(gfsp, file_name, NULL);
-		}
-	} else if (flags & 0x2)	{	/* Read */
-		//ext2_remove_link(inode_num);
-		if (flags & 0x40) {
-			struct ext2_inode* in = ext2_read_inode(gfsp, pathize(gfsp, file_name));
-			char* buf = malloc(in->size);
-			ext2_read_file(gfsp, in, buf);
-			puts(buf);
-		}
-		else {
-			struct ext2_inode* in = ext2_read_inode(gfsp, inode_num);
-			char* buf = malloc(in->size);
-			ext2_read_file(gfsp, in, buf);
-			puts(buf);
-		}
-	} 
-	if (flags & 0x4) {
-		if (flags & 0x20)
-			inode_dump(gfsp, ext2_read_inode(gfsp, inode_num));
-	}
-
-	if (flags & 0x80) 
-		ls(gfsp, (flags & F_INODE) ? inode_num : 2);
-
-	return 0;
-	//ext2_gen_dirent("New_entry", 5, 1);
-
+	uint32_t link = ((uint32_t*) b->data)[block_num];
+	buffer_free(b);
+	return link;
 }
@@ -37,6 +37,8 @@ Each block group has a backup superblock as it's first block
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#include <sys/types.h>
+#include <pthread.h>
 
 #ifndef __baremetal_ext2__
 #define __baremetal_ext2__
@@ -46,8 +48,11 @@ Each block group has a backup superblock as it's first block
 #define EXT2_BOOT		0			// Block 0 is bootblock
 #define EXT2_SUPER		1			// Block 1 is superblock
 #define EXT2_ROOTDIR	2
+#define EXT2_LINK_MAX	32000		// Most names one inode may have
 #define EXT2_MAGIC		0x0000EF53
 #define EXT2_IND_BLOCK 	12
+#define EXT2_DIND_BLOCK	13
+#define EXT2_TIND_BLOCK	14
 
 
 
@@ -179,19 +184,41 @@ typedef struct ide_buffer {
 	uint32_t block;				// block number
 	int flags;
 	uint8_t* data;	// 1 disk sector of data
+	struct ext2_fs* fs;			// Pool data goes back to, if any
 } buffer;
 
 
+/* One mounted image. Everything the driver needs lives here, so images are
+independent of each other and may be used from different threads */
 struct ext2_fs {
-	int dev;
+	int dev;					// Image file descriptor
 	int block_size;
 	int num_bg;
-	int mutex;
+	pthread_mutex_t mutex;		// Held by ext2_acquire_fs: bitmaps, free counts, inode tables
 	struct ext2_superblock* sb;
 	struct ext2_block_group_descriptor* bg;
+	uint8_t* bg_dirty;			// Descriptor blocks changed since the last sync, a bit each
+	uint32_t ndirs;				// Directories over all groups
+	struct overlay* overlay;	// When set, all I/O goes through it
+	pthread_mutex_t dir_lock;	// Directory changes and the indexes below
+	struct dir_index* dirs;		// Indexed directories, most recently used first
+	struct ext2_rsv* rsv;		// Preallocation windows, under mutex
+	struct space_map* bmap;		// Resident block bitmaps and free runs, under mutex
+	struct space_map* imap;		// The same for inode bitmaps
+	struct block_cache* cache;	// Block cache and readahead state
+	int direct;					// Image is open with O_DIRECT
+	struct dio* dio;			// Aligned buffer pool and direct I/O staging
+	struct pack* pack;			// Set when the image is a packed (chunk-compressed) one
+	int durability;				// EXT2_DURABLE_*, how hard ext2_sync() flushes
+	int unflushed;				// Something was written since the last flush
+	uint64_t flushes;
 };
 
-struct ext2_fs* gfsp;
+/* Durability modes. Data, inodes and directories are written as they change;
+bitmaps, the superblock and the group descriptors are written by ext2_sync() */
+#define EXT2_DURABLE_NONE		0	// Never flush; the host writes back when it likes
+#define EXT2_DURABLE_ORDERED	1	// Flush before a new inode, a dirent or the superblock points at data
+#define EXT2_DURABLE_OP			2	// And after, so every ext2_sync() is durable on return
 
 #define B_BUSY	0x1		// buffer is locked by a process
 #define B_VALID	0x2		// buffer has been read from disk
@@ -200,68 +227,198 @@ struct ext2_fs* gfsp;
 /* Function definitions */
 
 /* Replace when on real hardware */
-extern buffer* buffer_read(struct ext2_fs *f, int block);
+extern buffer* buffer_read(struct ext2_fs *f, uint32_t block);
 extern uint32_t buffer_write(struct ext2_fs *f, buffer* b);
 extern buffer* buffer_read_superblock(struct ext2_fs* f);
 extern uint32_t buffer_write_superblock(struct ext2_fs *f, buffer* b);
 extern int buffer_free(buffer* b);
+extern int buffer_read_blocks(struct ext2_fs *f, uint32_t block, int count, void* dst);
+extern int buffer_write_blocks(struct ext2_fs *f, uint32_t block, int count, void* src);
+extern int ext2_flush(struct ext2_fs *f);
+extern int ext2_barrier(struct ext2_fs *f);
 
 /* ext2.c */
 extern int ext2_superblock_read(struct ext2_fs *f);
 extern int ext2_superblock_write(struct ext2_fs *f);
 extern int ext2_blockdesc_read(struct ext2_fs *f);
+extern void ext2_bg_dirty(struct ext2_fs *f, int g);
 extern int ext2_blockdesc_write(struct ext2_fs *f);
 extern int ext2_first_free(uint32_t* b, int sz);
+extern int ext2_next_free(uint8_t* bitmap, int start, int end);
+extern uint32_t ext2_group_bits(struct ext2_fs *f, int g);
+extern uint32_t ext2_group_data_start(struct ext2_fs *f, int g);
+extern uint32_t ext2_alloc_block_near(struct ext2_fs *f, uint32_t goal);
+extern uint32_t ext2_alloc_block_for(struct ext2_fs *f, int inode_num, uint32_t goal);
+extern void ext2_reserve(struct ext2_fs *f, int inode_num);
+extern void ext2_unreserve(struct ext2_fs *f, int inode_num);
 extern uint32_t ext2_alloc_block(struct ext2_fs *f, int block_group);
 extern int ext2_write_indirect(struct ext2_fs *f, uint32_t indirect, uint32_t link, size_t block_num);
 extern uint32_t ext2_read_indirect(struct ext2_fs *f, uint32_t indirect, size_t block_num);
 
 /* file.c */
+struct file;
+extern struct file* ext2_open(struct ext2_fs *f, char* path, int mode);
+extern int ext2_close(struct file* file);
+extern ssize_t ext2_pread(struct file* file, char* buf, size_t cnt, uint64_t off);
+extern ssize_t ext2_pwrite(struct file* file, char* buf, size_t cnt, uint64_t off);
 extern int ext2_add_link(struct ext2_fs *f, int inode_num);
+extern int ext2_remove_link(struct ext2_fs *f, int inode_num);
+extern int ext2_free_blocks(struct ext2_fs *f, uint32_t* blocks, uint32_t n);
+extern int ext2_truncate(struct ext2_fs *f, int inode_num, uint32_t size);
+extern int ext2_unlink(struct ext2_fs *f, char* path);
 extern size_t ext2_write_file(struct ext2_fs *f, int inode_num, int parent_dir, char* name, char* data, int mode, uint32_t n);
 extern size_t ext2_read_file(struct ext2_fs *f, struct ext2_inode* in, char* buf);
 extern size_t ext2_touch_file(struct ext2_fs *f, int parent, char* name, char* data, int mode, size_t n);
+extern size_t ext2_import_file(struct ext2_fs *f, int parent, char* name, char* data, int mode, size_t n);
+extern uint32_t ext2_symlink(struct ext2_fs *f, int parent, char* name, char* target, uint32_t len);
+extern uint32_t* ext2_block_map(struct ext2_fs *f, struct ext2_inode* in, uint32_t* count);
+extern int ext2_write_block_map(struct ext2_fs *f, struct ext2_inode* in, uint32_t* map, uint32_t n, int group);
+extern int ext2_map_range(struct ext2_fs *f, struct ext2_inode* in, int inode_num, uint64_t first, uint32_t n, uint32_t* out, char* fresh, int alloc, uint32_t goal);
+extern int64_t ext2_write_at(struct ext2_fs *f, int inode_num, char* data, uint32_t n, uint64_t off);
 
 /* dir.c */
 extern int ext2_add_child(struct ext2_fs *f, int parent_inode, int i_no, char* name, int type);
 extern int ext2_find_child(struct ext2_fs *f, const char* name, int dir_inode);
-extern struct ext2_dirent* ext2_create_dir(struct ext2_fs *f, char* name, int parent_inode);
+extern int ext2_create_dir(struct ext2_fs *f, char* name, int parent_inode);
+extern char* ext2_read_dir(struct ext2_fs *f, struct ext2_inode* in, int* len);
+extern int ext2_remove_child(struct ext2_fs *f, int dir_inode, char* name);
+extern int ext2_rmdir(struct ext2_fs *f, char* path);
+extern void ext2_dir_forget(struct ext2_fs *f, int dir_inode);
 
-extern char* gen_file_perm_string(uint16_t x);
-extern void ls(struct ext2_fs *f, int inode_num);
+extern void ext2_ls(struct ext2_fs *f, int inode_num);
 
 /* inode.c */
 extern struct ext2_inode* ext2_read_inode(struct ext2_fs *f, int i);
 extern void ext2_write_inode(struct ext2_fs *f, int inode_num, struct ext2_inode* i);
-extern uint32_t ext2_alloc_inode(struct ext2_fs *f);
+extern uint32_t ext2_alloc_inode(struct ext2_fs *f, int parent, int mode);
 extern uint32_t ext2_free_inode(struct ext2_fs *f, int i_no);
 
-/* sync.c */
-extern void trav_device_list();
-extern struct filesystem* fs_dev_from_mount(char* mount);
-extern void fs_dev_init();
-extern int fs_dev_register(int dev, struct filesystem* f) ;
-extern struct ext2_fs* ext2_mount(int dev);
-extern void sync(struct ext2_fs *f);
-extern void release_fs(struct ext2_fs *f);
-extern void acquire_fs(struct ext2_fs *f);
-extern int pathize(struct ext2_fs* f, char* path);
-/* Core virtual filesystem abstraction layer */
-
-#define MAX_DEVICES 0x10
-#define ROOT_NAME	"root"
-
-struct filesystem {
-	enum {
-		EXT2,
-	} type;
-
-	union {
-		struct ext2_fs* fs;
-	} data;
-
-	int dev;
-	char mount[255];
+/* space.c */
+struct space_map;
+extern int ext2_space_load(struct ext2_fs *f);
+extern void ext2_space_release(struct ext2_fs *f);
+extern uint8_t* ext2_space_bitmap(struct ext2_fs *f, struct space_map* m, int g);
+extern int ext2_space_find(struct ext2_fs *f, struct space_map* m, int g, uint32_t len);
+extern uint32_t ext2_space_run(struct space_map* m, int g, uint32_t* start);
+extern uint32_t ext2_space_goal(struct ext2_fs *f, int g, uint32_t count);
+extern void ext2_space_mark(struct ext2_fs *f, struct space_map* m, int g, uint32_t bit, int used);
+extern void ext2_space_sync_group(struct ext2_fs *f, struct space_map* m, int g);
+extern void ext2_space_flush(struct ext2_fs *f);
+
+/* cache.c */
+struct block_cache;
+extern struct block_cache* ext2_cache_init(struct ext2_fs *f);
+extern void ext2_cache_release(struct ext2_fs *f);
+extern int ext2_cache_read(struct ext2_fs *f, uint32_t block, void* dst);
+extern void ext2_cache_write(struct ext2_fs *f, const void* buf, size_t len, uint64_t off);
+extern void ext2_cache_stats(struct ext2_fs *f);
+
+/* dio.c */
+struct dio;
+extern int ext2_dio_open(char* path, int flags);
+extern void ext2_dio_init(struct ext2_fs *f);
+extern void ext2_dio_release(struct ext2_fs *f);
+extern void* ext2_pool_get(struct ext2_fs *f);
+extern void ext2_pool_put(struct ext2_fs *f, void* p);
+extern ssize_t ext2_dio_read(struct ext2_fs *f, void* buf, size_t len, uint64_t off);
+extern ssize_t ext2_dio_write(struct ext2_fs *f, const void* buf, size_t len, uint64_t off);
+extern int ext2_dio_flush(struct ext2_fs *f);
+extern void ext2_dio_stats(struct ext2_fs *f);
+
+/* extract.c */
+extern int ext2_extract(struct ext2_fs *f, char* path, char* dest, int workers);
+
+/* delta.c */
+extern uint64_t ext2_hash(const void* data, size_t len, uint64_t seed);
+extern int ext2_delta_diff(struct ext2_fs *f, char* base_image, char* delta, int workers);
+extern int ext2_delta_apply(struct ext2_fs *f, char* delta, int workers);
+
+/* clone.c */
+extern int ext2_clone(struct ext2_fs *f, char* path, int workers);
+
+/* defrag.c */
+extern int ext2_defrag(struct ext2_fs *f, char* path, uint64_t budget);
+
+/* walk.c */
+struct walk_entry {
+	uint32_t inode;
+	struct ext2_inode* in;
+	char* path;			// Full path in the image, only valid during the callback
+	int depth;			// 0 for the starting point
+	int dir;			// Number of this directory within the walk, -1 for anything else
+	int parent;			// Number of the containing directory, -1 for the starting point
+};
+typedef void (*walk_fn)(struct walk_entry* e, void* arg);
+
+struct find_filter {
+	char* name;			// Glob on the last path component, or NULL
+	int type;			// EXT2_IFREG, EXT2_IFDIR, EXT2_IFLNK or 0 for any
+	int size_set;
+	int size_cmp;		// 1 for more than, -1 for less than, 0 for exactly
+	uint64_t size;
+	int mtime_set;
+	int mtime_cmp;		// The same, on whole days since the last modification
+	uint64_t mtime_days;
+	uint64_t matches;
 };
 
+extern int ext2_walk(struct ext2_fs *f, char* path, walk_fn fn, void* arg);
+extern int ext2_find(struct ext2_fs *f, char* path, struct find_filter* ff);
+extern int ext2_du(struct ext2_fs *f, char* path, int max_depth);
+
+/* catalog.c */
+extern int ext2_catalog_export(struct ext2_fs *f, char* out);
+extern int ext2_catalog_query(char* catalog, char* query, char* arg, uint32_t wtime);
+
+/* import.c */
+extern int ext2_import(struct ext2_fs *f, char* host_dir, char* path, char* manifest);
+
+/* tar.c */
+extern int ext2_import_tar(struct ext2_fs *f, int fd, char* path);
+
+/* verify.c */
+struct manifest;
+extern uint32_t ext2_crc32c(uint32_t crc, const void* data, size_t len);
+extern struct manifest* ext2_manifest_create(char* path, char* root, uint32_t block_size);
+extern void ext2_manifest_add(struct manifest* m, const char* name, const char* data, uint64_t size);
+extern int ext2_manifest_close(struct manifest* m);
+extern int ext2_manifest(struct ext2_fs *f, char* path, char* out, int workers);
+extern int ext2_verify(struct ext2_fs *f, char* manifest, int workers);
+
+/* fanout.c */
+extern int ext2_fanout(struct ext2_fs** targets, int n, char* host_dir, char* path);
+
+/* pack.c */
+struct pack;
+extern int ext2_pack_init(struct ext2_fs *f);
+extern void ext2_pack_release(struct ext2_fs *f);
+extern ssize_t ext2_pack_read(struct ext2_fs *f, void* buf, size_t len, uint64_t off);
+extern ssize_t ext2_pack_write(struct ext2_fs *f, const void* buf, size_t len, uint64_t off);
+extern int ext2_pack_flush(struct ext2_fs *f);
+extern int ext2_pack_convert(struct ext2_fs *f, char* path, int packed, int workers);
+extern void ext2_pack_stats(struct ext2_fs *f);
+
+/* overlay.c */
+struct overlay;
+extern struct overlay* overlay_open(int base, char* path);
+extern void overlay_close(struct overlay* ov);
+extern ssize_t overlay_read(struct overlay* ov, void* buf, size_t len, off_t off);
+extern ssize_t overlay_write(struct overlay* ov, const void* buf, size_t len, off_t off);
+extern int overlay_commit(struct overlay* ov, int base);
+extern int overlay_sync(struct overlay* ov);
+
+/* debug.c */
+extern void ext2_bg_dump(struct ext2_fs* f);
+extern void ext2_inode_dump(struct ext2_fs* f, struct ext2_inode* in);
+extern void ext2_sb_dump(struct ext2_superblock* sb);
+
+/* sync.c */
+extern struct ext2_fs* ext2_mount(int dev, struct overlay* ov);
+extern void ext2_umount(struct ext2_fs *f);
+extern void ext2_sync(struct ext2_fs *f);
+extern void ext2_release_fs(struct ext2_fs *f);
+extern void ext2_acquire_fs(struct ext2_fs *f);
+extern int ext2_pathize(struct ext2_fs* f, char* path);
+extern int ext2_pathize_parent(struct ext2_fs* f, char* path, char** name);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,557 @@
+/*
+ext2util.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+
+ext2util is a command-line interface for reading/writing data from ext2
+disk images. ext2 driver code is directly ported from my own code used in a
+hobby operating system. This file is only the command line front end; the
+driver itself builds into libext2util
+*/
+
+#include "ext2.h"
+#include "fs.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <sys/stat.h>
+
+/* Adds a file to root directory */
+int add_to_disk(struct ext2_fs *f, char* file_name, int i) {
+	int fp_add = open(file_name, O_RDWR, 0444);
+	assert(fp_add);
+
+	int sz = lseek(fp_add, 0, SEEK_END);		// seek to end of file
+	lseek(fp_add, 0, SEEK_SET);		// back to beginning
+
+	char* buffer = malloc(sz);	// File buffer
+	int ret = pread(fp_add, buffer, sz, 0);
+
+
+	if (i) {
+		ext2_write_file(f, i, EXT2_ROOTDIR, file_name, buffer, 0x1C0 | EXT2_IFREG, sz);
+	} else {
+		ext2_touch_file(f, 2, file_name, buffer, 0x1C0, sz);
+	}
+	printf("%s %d\n", file_name, sz);
+	free(buffer);
+}
+
+
+/* Subcommands follow the options: ext2util -x disk.img [-j n] cmd args... */
+static int workers = 1;
+
+static int cmd_extract(struct ext2_fs *f, int argc, char** argv) {
+	return ext2_extract(f, argv[1], argv[2], workers);
+}
+
+static int cmd_import(struct ext2_fs *f, int argc, char** argv) {
+	return ext2_import(f, argv[1], argv[2], (argc > 3) ? argv[3] : NULL);
+}
+
+static int cmd_import_tar(struct ext2_fs *f, int argc, char** argv) {
+	return ext2_import_tar(f, STDIN_FILENO, argv[1]);
+}
+
+/* The -x image is target 0; every further argument is another image */
+static int cmd_fanout(struct ext2_fs *f, int argc, char** argv) {
+	int n = argc - 2;
+	struct ext2_fs** targets = malloc(n * sizeof(struct ext2_fs*));
+	int ret = 0;
+
+	targets[0] = f;
+	for (int q = 1; q < n; q++) {
+		int fd = open(argv[q + 2], O_RDWR);
+		if (fd < 0)
+			perror(argv[q + 2]);
+		if (fd < 0 || !(targets[q] = ext2_mount(fd, NULL))) {
+			if (fd >= 0)
+				close(fd);
+			n = q;
+			ret = -1;
+			break;
+		}
+	}
+	if (!ret)
+		ret = ext2_fanout(targets, n, argv[1], argv[2]);
+
+	/* Unmounting still writes (pack index, bitmaps), so close after */
+	for (int q = 1; q < n; q++) {
+		int fd = targets[q]->dev;
+		ext2_umount(targets[q]);
+		close(fd);
+	}
+	free(targets);
+	return ret;
+}
+
+static int cmd_rm(struct ext2_fs *f, int argc, char** argv) {
+	return ext2_unlink(f, argv[1]);
+}
+
+static int cmd_rmdir(struct ext2_fs *f, int argc, char** argv) {
+	return ext2_rmdir(f, argv[1]);
+}
+
+static int cmd_truncate(struct ext2_fs *f, int argc, char** argv) {
+	int i_no = ext2_pathize(f, argv[1]);
+	if (i_no <= 0) {
+		printf("%s: not found in image\n", argv[1]);
+		return -1;
+	}
+	ext2_truncate(f, i_no, strtoul(argv[2], NULL, 0));
+	ext2_sync(f);
+	return 0;
+}
+
+#define COPY_CHUNK	(1 << 20)
+
+/* Stream host_file into the image file at path, starting at off, or at the
+end of the file when off is -1 */
+static int copy_in(struct ext2_fs *f, char* path, char* host_file, int64_t off) {
+	struct file* file = ext2_open(f, path, FMODE_READ | FMODE_WRITE);
+	if (!file) {
+		printf("%s: not a regular file in image\n", path);
+		return -1;
+	}
+	if (off < 0)
+		off = file->f_inode->i_size;
+
+	int fd = open(host_file, O_RDONLY);
+	if (fd < 0) {
+		perror(host_file);
+		ext2_close(file);
+		return -1;
+	}
+	char* chunk = malloc(COPY_CHUNK);
+	uint64_t total = 0;
+	ssize_t n;
+	int ret = 0;
+	while ((n = read(fd, chunk, COPY_CHUNK)) > 0) {
+		if (ext2_pwrite(file, chunk, n, off + total) != n) {
+			ret = -1;
+			break;
+		}
+		total += n;
+	}
+	if (n < 0) {
+		perror(host_file);
+		ret = -1;
+	}
+	free(chunk);
+	close(fd);
+	ext2_close(file);
+	ext2_sync(f);
+	printf("%s: wrote %llu bytes at %lld\n", path, (unsigned long long) total, (long long) off);
+	return ret;
+}
+
+/* Copy length bytes at offset out of the image file at path */
+static int copy_out(struct ext2_fs *f, char* path, uint64_t off, uint64_t length, char* host_file) {
+	struct file* file = ext2_open(f, path, FMODE_READ);
+	if (!file) {
+		printf("%s: not a regular file in image\n", path);
+		return -1;
+	}
+	int fd = open(host_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(host_file);
+		ext2_close(file);
+		return -1;
+	}
+
+	char* chunk = malloc(COPY_CHUNK);
+	uint64_t total = 0;
+	ssize_t n;
+	int ret = 0;
+	while (total < length) {
+		size_t len = (length - total < COPY_CHUNK) ? length - total : COPY_CHUNK;
+		if ((n = ext2_pread(file, chunk, len, off + total)) <= 0)
+			break;
+		if (write(fd, chunk, n) != n) {
+			perror(host_file);
+			ret = -1;
+			break;
+		}
+		total += n;
+	}
+	free(chunk);
+	close(fd);
+	ext2_close(file);
+	printf("%s: read %llu bytes at %llu\n", path, (unsigned long long) total, (unsigned long long) off);
+	return ret;
+}
+
+static int cmd_read(struct ext2_fs *f, int argc, char** argv) {
+	return copy_out(f, argv[1], strtoull(argv[2], NULL, 0), strtoull(argv[3], NULL, 0), argv[4]);
+}
+
+static int cmd_append(struct ext2_fs *f, int argc, char** argv) {
+	return copy_in(f, argv[1], argv[2], -1);
+}
+
+static int cmd_overwrite(struct ext2_fs *f, int argc, char** argv) {
+	return copy_in(f, argv[1], argv[2], (argc > 3) ? strtoll(argv[3], NULL, 0) : 0);
+}
+
+static int cmd_diff(struct ext2_fs *f, int argc, char** argv) {
+	return ext2_delta_diff(f, argv[1], argv[2], workers);
+}
+
+static int cmd_apply(struct ext2_fs *f, int argc, char** argv) {
+	return ext2_delta_apply(f, argv[1], workers);
+}
+
+static int cmd_commit(struct ext2_fs *f, int argc, char** argv) {
+	if (!f->overlay) {
+		printf("commit needs an overlay (-o overlay)\n");
+		return -1;
+	}
+	return overlay_commit(f->overlay, f->dev);
+}
+
+static int cmd_convert_in(struct ext2_fs *f, int argc, char** argv) {
+	return ext2_pack_convert(f, argv[1], 1, workers);
+}
+
+static int cmd_convert_out(struct ext2_fs *f, int argc, char** argv) {
+	return ext2_pack_convert(f, argv[1], 0, workers);
+}
+
+static int cmd_clone(struct ext2_fs *f, int argc, char** argv) {
+	return ext2_clone(f, argv[1], workers);
+}
+
+static int cmd_manifest(struct ext2_fs *f, int argc, char** argv) {
+	return ext2_manifest(f, argv[1], argv[2], workers);
+}
+
+static int cmd_verify(struct ext2_fs *f, int argc, char** argv) {
+	return ext2_verify(f, argv[1], workers);
+}
+
+/* The budget is in MiB */
+static int cmd_defrag(struct ext2_fs *f, int argc, char** argv) {
+	uint64_t budget = (argc > 2) ? strtoull(argv[2], NULL, 0) << 20 : 0;
+	return ext2_defrag(f, argv[1], budget);
+}
+
+/* A [+-]N argument of find: more than, less than or exactly N, with an
+optional k, M or G suffix for sizes */
+static int parse_cmp(char* arg, int* cmp, uint64_t* value) {
+	*cmp = (*arg == '+') ? 1 : (*arg == '-') ? -1 : 0;
+	if (*cmp)
+		arg++;
+	char* end;
+	*value = strtoull(arg, &end, 0);
+	switch (*end) {
+		case 'k': *value <<= 10; end++; break;
+		case 'M': *value <<= 20; end++; break;
+		case 'G': *value <<= 30; end++; break;
+	}
+	return (end == arg || *end) ? -1 : 0;
+}
+
+static int cmd_find(struct ext2_fs *f, int argc, char** argv) {
+	struct find_filter ff;
+	memset(&ff, 0, sizeof(ff));
+	for (int q = 2; q < argc; q += 2) {
+		char* arg = (q + 1 < argc) ? argv[q + 1] : NULL;
+		int bad = 0;
+		if (!arg)
+			bad = 1;
+		else if (strcmp(argv[q], "-name") == 0)
+			ff.name = arg;
+		else if (strcmp(argv[q], "-type") == 0) {
+			ff.type = (*arg == 'f') ? EXT2_IFREG : (*arg == 'd') ? EXT2_IFDIR : (*arg == 'l') ? EXT2_IFLNK : 0;
+			bad = !ff.type || arg[1];
+		} else if (strcmp(argv[q], "-size") == 0) {
+			ff.size_set = 1;
+			bad = parse_cmp(arg, &ff.size_cmp, &ff.size);
+		} else if (strcmp(argv[q], "-mtime") == 0) {
+			ff.mtime_set = 1;
+			bad = parse_cmp(arg, &ff.mtime_cmp, &ff.mtime_days);
+		} else
+			bad = 1;
+		if (bad) {
+			printf("find: bad test %s\n", argv[q]);
+			return -1;
+		}
+	}
+	return ext2_find(f, argv[1], &ff);
+}
+
+static int cmd_du(struct ext2_fs *f, int argc, char** argv) {
+	return ext2_du(f, argv[1], (argc > 2) ? atoi(argv[2]) : -1);
+}
+
+static int cmd_catalog(struct ext2_fs *f, int argc, char** argv) {
+	return ext2_catalog_export(f, argv[1]);
+}
+
+/* Runs without mounting; the image, if given, is only read for its write
+time, to tell whether the catalog is stale */
+static int cmd_query(int argc, char** argv, char* image) {
+	if (argc < 3) {
+		printf("usage: ext2util [-x disk.img] query catalog /path | '/prefix*' | -b block\n");
+		return -1;
+	}
+	uint32_t wtime = 0;
+	if (image) {
+		struct ext2_superblock sb;
+		int fd = open(image, O_RDONLY);
+		if (fd >= 0 && pread(fd, &sb, sizeof(sb), 1024) == sizeof(sb) && sb.magic == EXT2_MAGIC)
+			wtime = sb.wtime;
+		else
+			printf("%s: can't read the superblock, not checking the catalog against it\n", image);
+		if (fd >= 0)
+			close(fd);
+	}
+	return ext2_catalog_query(argv[1], argv[2], (argc > 3) ? argv[3] : NULL, wtime);
+}
+
+struct command {
+	char* name;
+	int argc;			// Including the command name
+	char* usage;
+	int (*fn)(struct ext2_fs *f, int argc, char** argv);
+};
+
+static struct command commands[] = {
+	{ "extract", 3, "extract /path/in/image host_dir", cmd_extract },
+	{ "import", 3, "import host_dir /path/in/image [out.crc]", cmd_import },
+	{ "import-tar", 2, "import-tar /path/in/image < archive.tar", cmd_import_tar },
+	{ "fanout", 3, "fanout host_dir /path/in/image [other.img ...]", cmd_fanout },
+	{ "rm", 2, "rm /path/in/image", cmd_rm },
+	{ "rmdir", 2, "rmdir /path/in/image", cmd_rmdir },
+	{ "truncate", 3, "truncate /path/in/image size", cmd_truncate },
+	{ "read", 5, "read /path/in/image offset length host_file", cmd_read },
+	{ "append", 3, "append /path/in/image host_file", cmd_append },
+	{ "overwrite", 3, "overwrite /path/in/image host_file [offset]", cmd_overwrite },
+	{ "diff", 3, "diff base.img out.delta", cmd_diff },
+	{ "apply", 2, "apply in.delta", cmd_apply },
+	{ "commit", 1, "commit", cmd_commit },
+	{ "manifest", 3, "manifest /path/in/image out.crc", cmd_manifest },
+	{ "verify", 2, "verify in.crc", cmd_verify },
+	{ "clone", 2, "clone out.img", cmd_clone },
+	{ "find", 2, "find /path/in/image [-name glob] [-type f|d|l] [-size [+-]N[kMG]] [-mtime [+-]days]", cmd_find },
+	{ "du", 2, "du /path/in/image [max_depth]", cmd_du },
+	{ "catalog", 2, "catalog out.e2c", cmd_catalog },
+	{ "defrag", 2, "defrag /path/in/image [max_mib]", cmd_defrag },
+	{ "convert-in", 2, "convert-in out.pack", cmd_convert_in },
+	{ "convert-out", 2, "convert-out out.img", cmd_convert_out },
+};
+
+static int run_command(struct ext2_fs *f, int argc, char** argv) {
+	for (int i = 0; i < sizeof(commands) / sizeof(struct command); i++) {
+		if (strcmp(argv[0], commands[i].name))
+			continue;
+		if (argc < commands[i].argc) {
+			printf("usage: ext2util -x disk.img [-j workers] %s\n", commands[i].usage);
+			return -1;
+		}
+		return commands[i].fn(f, argc, argv);
+	}
+	printf("unknown command %s\n", argv[0]);
+	return -1;
+}
+
+
+#define F_INODE 	0x20
+#define F_WRITE		0x01 
+#define F_READ 		0x02 
+#define F_DUMP 		0x04 
+#define F_FILE 		0x40
+#define F_LS 		0x80
+
+/* Indexed by EXT2_DURABLE_* */
+static char* durability_names[] = { "none", "ordered", "op" };
+
+int main(int argc, char* argv[]) {
+	static char usage[] = "usage: ext2util -x disk.img [-l] [-wrd] [-s] [-D] [-S none|ordered|op] [-i inode | -f fname] [-o overlay] [-j workers] [command args...]";
+	extern char *optarg;
+	extern int optind;
+	int c, err = 0;
+	uint32_t flags = 0;
+
+	int inode_num = -1;
+	char* file_name = "default_file_name";
+	char* image = "default";
+	char* overlay = NULL;
+	int stats = 0;
+	int direct = 0;
+	int durability = EXT2_DURABLE_NONE;
+
+	workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ( (c = getopt(argc, argv, "+lwrdsDi:f:x:j:o:S:")) != -1) 
+		switch(c) {
+			case 'x':
+				image = optarg;
+				flags |= 0x1000;
+				break;
+			case 'w':
+				flags |= 0x1;
+				break;
+			case 'r':
+				flags |= 0x2;
+				break;
+			case 'd':
+				flags |= 0x4;
+				break;
+			case 'i':
+				flags |= 0x20;
+				inode_num = atoi(optarg);
+				break;
+			case 'f':
+				flags |= 0x40;
+				file_name = optarg;
+				break;
+			case '?':
+				err = 1;
+				break;
+			case 'l':
+				flags |= 0x80;
+				break;
+			case 'j':
+				workers = atoi(optarg);
+				break;
+			case 'o':
+				overlay = optarg;
+				break;
+			case 's':
+				stats = 1;
+				break;
+			case 'D':
+				direct = 1;
+				break;
+			case 'S':
+				for (durability = 0; durability < 3 && strcmp(optarg, durability_names[durability]); durability++)
+					;
+				if (durability == 3)
+					err = 1;
+				break;
+		}
+
+	if (!err && optind < argc && strcmp(argv[optind], "query") == 0)
+		return cmd_query(argc - optind, argv + optind, (flags & 0x1000) ? image : NULL);
+
+	if (err || (flags & 0x1000) == 0) {
+		printf("%s\n", usage);
+		return;
+	}
+	if ((flags & 0x3) == 0x3) {
+		printf("%s\n", usage);
+		printf("Cannot read and write during same run\n");
+		return;
+	}
+
+	/* With an overlay the base is only ever read, except to fold the
+	overlay back in */
+	int mode = O_RDWR;
+	if (overlay && !(optind < argc && strcmp(argv[optind], "commit") == 0))
+		mode = O_RDONLY;
+
+	int fp = (direct) ? ext2_dio_open(image, mode) : open(image, mode, 0444);
+	if (fp < 0) {
+		perror(image);
+		return -1;
+	}
+	struct overlay* ov = NULL;
+	if (overlay && !(ov = overlay_open(fp, overlay)))
+		return -1;
+
+	struct ext2_fs* gfsp = ext2_mount(fp, ov);
+	if (!gfsp)
+		return -1;
+	gfsp->sb->mtime = time(NULL);	// Update mount time
+	gfsp->durability = durability;
+
+	ext2_bg_dump(gfsp);
+	ext2_sb_dump(gfsp->sb);
+
+	if (optind < argc) {
+		int ret = run_command(gfsp, argc - optind, argv + optind);
+		if (stats) {
+			ext2_cache_stats(gfsp);
+			ext2_dio_stats(gfsp);
+			ext2_pack_stats(gfsp);
+			printf("durability %s: %llu flushes\n", durability_names[durability],
+				(unsigned long long) gfsp->flushes);
+		}
+		ext2_umount(gfsp);
+		return ret;
+	}
+
+	if (flags & 0x1) {			/* Write */
+		if ((flags & 0x60) == 0) {
+			printf("%s\n", usage);
+			printf("Specify an inode or file name\n");
+			return;
+		}
+
+			struct stat s;
+		stat(file_name, &s);
+		printf("%s, %d bytes\n", file_name, s.st_size);
+
+		if ((flags & 0x60) == 0x60) {	
+			// Inode & File
+			add_to_disk(gfsp, file_name, inode_num);
+		} else if (flags & 0x40) {	
+			// Touch a new inode
+			add_to_disk(gfsp, file_name, NULL);
+		}
+	} else if (flags & 0x2)	{	/* Read */
+		//ext2_remove_link(inode_num);
+		if (flags & 0x40) {
+			struct ext2_inode* in = ext2_read_inode(gfsp, ext2_pathize(gfsp, file_name));
+			char* buf = malloc(in->size);
+			ext2_read_file(gfsp, in, buf);
+			puts(buf);
+		}
+		else {
+			struct ext2_inode* in = ext2_read_inode(gfsp, inode_num);
+			char* buf = malloc(in->size);
+			ext2_read_file(gfsp, in, buf);
+			puts(buf);
+		}
+	} 
+	if (flags & 0x4) {
+		if (flags & 0x20)
+			ext2_inode_dump(gfsp, ext2_read_inode(gfsp, inode_num));
+	}
+
+	if (flags & 0x80) 
+		ext2_ls(gfsp, (flags & F_INODE) ? inode_num : 2);
+
+	ext2_umount(gfsp);
+	return 0;
+	//ext2_gen_dirent("New_entry", 5, 1);
+
+}
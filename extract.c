@@ -0,0 +1,301 @@
+/*
+extract.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* Recursive extraction of an image subtree to a host directory.
+
+The tree is walked once up front: directories and symlinks are created on the
+host as they are found, and every regular file becomes a work item tagged with
+its first physical block. Items are sorted by that block and handed out in
+order to a pool of workers, so the image is read in close to sequential order
+while many host files are written at once. */
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+
+#define EXTRACT_RUN_BYTES	(1 << 20)	// Largest single read from the image
+
+struct extract_item {
+	uint32_t inode;
+	uint32_t first_block;
+	char* path;			// Destination on the host
+};
+
+struct extract_job {
+	struct ext2_fs* f;
+	struct extract_item* items;
+	int count;
+	int size;
+
+	pthread_mutex_t lock;
+	int next;			// Next item to hand to a worker
+	int files;
+	int errors;
+	uint64_t bytes;
+};
+
+static char* join_path(const char* dir, const char* name, int name_len) {
+	int len = strlen(dir);
+	char* p = malloc(len + name_len + 2);
+	memcpy(p, dir, len);
+	p[len] = '/';
+	memcpy(p + len + 1, name, name_len);
+	p[len + name_len + 1] = '\0';
+	return p;
+}
+
+static void extract_queue(struct extract_job* job, uint32_t inode, struct ext2_inode* in, char* path) {
+	if (job->count == job->size) {
+		job->size = (job->size) ? job->size * 2 : 64;
+		job->items = realloc(job->items, job->size * sizeof(struct extract_item));
+	}
+	struct extract_item* it = &job->items[job->count++];
+	it->inode = inode;
+	it->first_block = (in->size) ? in->block[0] : 0;
+	it->path = path;
+}
+
+static int extract_symlink(struct ext2_fs* f, struct ext2_inode* in, char* path) {
+	if (in->size >= f->block_size)
+		return -1;
+	char* target = malloc(f->block_size + 1);
+
+	/* Fast symlinks keep the target in the block pointers themselves */
+	if (in->blocks == 0)
+		memcpy(target, in->block, in->size);
+	else
+		buffer_read_blocks(f, in->block[0], 1, target);
+	target[in->size] = '\0';
+
+	int ret = symlink(target, path);
+	if (ret)
+		perror(path);
+	free(target);
+	return ret;
+}
+
+/* Depth-first walk of dir_inode, mirroring directories onto the host and
+queueing regular files for the workers */
+static void extract_walk(struct extract_job* job, int dir_inode, char* host_dir) {
+	struct ext2_fs* f = job->f;
+	struct ext2_inode* dir = ext2_read_inode(f, dir_inode);
+
+	if (mkdir(host_dir, dir->mode & 0777) && errno != EEXIST) {
+		perror(host_dir);
+		job->errors++;
+		free(dir);
+		return;
+	}
+
+	int len;
+	char* buf = ext2_read_dir(f, dir, &len);
+	free(dir);
+
+	for (int off = 0; off < len; ) {
+		struct ext2_dirent* d = (struct ext2_dirent*) (buf + off);
+		if (d->rec_len == 0)
+			break;
+		off += d->rec_len;
+
+		if (!d->inode)
+			continue;
+		if (d->name[0] == '.' && (d->name_len == 1 || (d->name_len == 2 && d->name[1] == '.')))
+			continue;
+
+		char* path = join_path(host_dir, (char*) d->name, d->name_len);
+		struct ext2_inode* in = ext2_read_inode(f, d->inode);
+
+		switch (in->mode & 0xF000) {
+			case EXT2_IFDIR:
+				extract_walk(job, d->inode, path);
+				free(path);
+				break;
+			case EXT2_IFREG:
+				extract_queue(job, d->inode, in, path);
+				break;
+			case EXT2_IFLNK:
+				if (extract_symlink(f, in, path))
+					job->errors++;
+				free(path);
+				break;
+			default:
+				printf("skipping special file %s\n", path);
+				free(path);
+				break;
+		}
+		free(in);
+	}
+	free(buf);
+}
+
+/* Copy one file out of the image, coalescing physically contiguous blocks
+into a single read. Holes are left unwritten so the host file stays sparse.
+Returns the file size, or -1 on error */
+static int64_t extract_file(struct ext2_fs* f, struct extract_item* it, char* chunk) {
+	struct ext2_inode* in = ext2_read_inode(f, it->inode);
+	int fd = open(it->path, O_WRONLY | O_CREAT | O_TRUNC, in->mode & 0777);
+	if (fd < 0) {
+		perror(it->path);
+		free(in);
+		return -1;
+	}
+
+	int run_max = EXTRACT_RUN_BYTES / f->block_size;
+	uint32_t n;
+	uint32_t* map = ext2_block_map(f, in, &n);
+	int64_t ret = in->size;
+
+	for (uint32_t q = 0; q < n; ) {
+		if (!map[q]) {
+			q++;
+			continue;
+		}
+		uint32_t run = 1;
+		while (q + run < n && run < run_max && map[q + run] == map[q] + run)
+			run++;
+
+		off_t pos = (off_t) q * f->block_size;
+		size_t len = (size_t) run * f->block_size;
+		if (pos + len > in->size)
+			len = in->size - pos;
+
+		if (buffer_read_blocks(f, map[q], run, chunk) < 0 || pwrite(fd, chunk, len, pos) != len) {
+			perror(it->path);
+			ret = -1;
+			break;
+		}
+		q += run;
+	}
+
+	ftruncate(fd, in->size);
+	struct timespec ts[2] = { { in->atime, 0 }, { in->mtime, 0 } };
+	futimens(fd, ts);
+	close(fd);
+
+	free(map);
+	free(in);
+	return ret;
+}
+
+static void* extract_worker(void* arg) {
+	struct extract_job* job = arg;
+	char* chunk;
+	posix_memalign((void**) &chunk, 4096, EXTRACT_RUN_BYTES);
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		int idx = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (idx >= job->count)
+			break;
+
+		int64_t ret = extract_file(job->f, &job->items[idx], chunk);
+
+		pthread_mutex_lock(&job->lock);
+		if (ret < 0)
+			job->errors++;
+		else {
+			job->files++;
+			job->bytes += ret;
+		}
+		pthread_mutex_unlock(&job->lock);
+	}
+	free(chunk);
+	return NULL;
+}
+
+static int extract_item_cmp(const void* a, const void* b) {
+	const struct extract_item* x = a;
+	const struct extract_item* y = b;
+	return (x->first_block > y->first_block) - (x->first_block < y->first_block);
+}
+
+/* Extract path (a directory or a single file) from the image into dest,
+using workers threads to copy file data */
+int ext2_extract(struct ext2_fs *f, char* path, char* dest, int workers) {
+	char* p = strdup(path);
+	int i_no = ext2_pathize(f, p);
+	free(p);
+	if (i_no <= 0) {
+		printf("%s: not found in image\n", path);
+		return -1;
+	}
+
+	struct extract_job job;
+	memset(&job, 0, sizeof(job));
+	job.f = f;
+	pthread_mutex_init(&job.lock, NULL);
+
+	struct ext2_inode* in = ext2_read_inode(f, i_no);
+	switch (in->mode & 0xF000) {
+		case EXT2_IFDIR:
+			extract_walk(&job, i_no, dest);
+			break;
+		case EXT2_IFREG:
+			extract_queue(&job, i_no, in, strdup(dest));
+			break;
+		case EXT2_IFLNK:
+			if (extract_symlink(f, in, dest))
+				job.errors++;
+			break;
+		default:
+			printf("%s: unsupported file type\n", path);
+			job.errors++;
+	}
+	free(in);
+
+	qsort(job.items, job.count, sizeof(struct extract_item), extract_item_cmp);
+
+	if (workers < 1)
+		workers = 1;
+	if (workers > job.count)
+		workers = (job.count) ? job.count : 1;
+
+	pthread_t* threads = malloc(workers * sizeof(pthread_t));
+	for (int q = 0; q < workers; q++)
+		pthread_create(&threads[q], NULL, extract_worker, &job);
+	for (int q = 0; q < workers; q++)
+		pthread_join(threads[q], NULL);
+	free(threads);
+
+	printf("extracted %d files, %llu bytes (%d workers, %d errors)\n",
+		job.files, (unsigned long long) job.bytes, workers, job.errors);
+
+	for (int q = 0; q < job.count; q++)
+		free(job.items[q].path);
+	free(job.items);
+	pthread_mutex_destroy(&job.lock);
+	return (job.errors) ? -1 : 0;
+}
@@ -0,0 +1,381 @@
+/*
+fanout.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+
+/* Fan-out write of one host tree into many images.
+
+A single reader walks the host tree once, in name order, and turns it into a
+stream of items: directories, symlinks, and files cut into chunks of at most
+FANOUT_CHUNK bytes. Every target image gets a worker that replays the stream
+against its own image, doing its own allocation and I/O. Items sit in a ring
+shared by all the workers and are released once the slowest one is past them,
+so each source byte is read once and held once no matter how many images are
+written, and the reader only stalls when FANOUT_BYTES are in flight. */
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+
+#define FANOUT_CHUNK	(1 << 20)	// Largest piece of a file in one item
+#define FANOUT_SLOTS	4096		// Items in flight
+#define FANOUT_BYTES	(64 << 20)	// Data in flight
+
+enum { ITEM_DIR, ITEM_FILE, ITEM_DATA, ITEM_SYMLINK, ITEM_END };
+
+struct fanout_item {
+	int type;
+	int dir;			// Parent directory, as an index into each worker's dirs
+	int self;			// ITEM_DIR: index of this directory
+	char* name;
+	uint16_t mode;
+	char* data;			// File contents or symlink target
+	uint32_t len;
+	uint64_t off;		// ITEM_DATA: offset into the file
+	int refs;			// Workers that have yet to replay this item
+};
+
+struct fanout_job {
+	struct fanout_item* ring;
+	int n;				// Target images
+	int dirs;			// Directories seen so far; 0 is the destination
+	int errors;			// Source side
+	uint64_t bytes;
+
+	pthread_mutex_t lock;
+	pthread_cond_t more;	// head advanced
+	pthread_cond_t room;	// tail advanced
+	uint64_t head;		// Items produced
+	uint64_t tail;		// Items every worker is done with
+	uint64_t held;		// Data bytes between tail and head
+};
+
+struct fanout_target {
+	struct fanout_job* job;
+	struct ext2_fs* f;
+	int* dirs;			// Directory index to inode in this image
+	int dirs_size;
+	uint32_t file;		// Inode the next ITEM_DATA belongs to
+
+	int files;
+	int errors;
+	uint64_t bytes;
+};
+
+/* Add an item to the stream, waiting for room. name and data now belong to
+the stream */
+static void fanout_push(struct fanout_job* job, int type, int dir, char* name, uint16_t mode, char* data, uint32_t len, uint64_t off) {
+	pthread_mutex_lock(&job->lock);
+	while (job->head - job->tail >= FANOUT_SLOTS || (job->held + len > FANOUT_BYTES && job->head > job->tail))
+		pthread_cond_wait(&job->room, &job->lock);
+
+	struct fanout_item* it = &job->ring[job->head % FANOUT_SLOTS];
+	it->type = type;
+	it->dir = dir;
+	it->self = (type == ITEM_DIR) ? job->dirs++ : -1;
+	it->name = name;
+	it->mode = mode;
+	it->data = data;
+	it->len = len;
+	it->off = off;
+	it->refs = job->n;
+	job->held += len;
+	job->head++;
+	pthread_cond_broadcast(&job->more);
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void fanout_file(struct fanout_job* job, char* path, char* name, struct stat* st, int dir) {
+	if (st->st_size > UINT32_MAX) {
+		printf("%s: too large for ext2\n", path);
+		job->errors++;
+		return;
+	}
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		job->errors++;
+		return;
+	}
+
+	/* The first chunk creates the file, the rest are written at their offset.
+	Buffers are sized to what is left, so small files stay small */
+	uint64_t off = 0;
+	do {
+		uint32_t want = (st->st_size - off < FANOUT_CHUNK) ? st->st_size - off : FANOUT_CHUNK;
+		char* data = malloc(want + 1);
+		ssize_t len = 0, n = 0;
+		while (len < want && (n = read(fd, data + len, want - len)) > 0)
+			len += n;
+		if (len < want) {
+			if (n < 0)
+				perror(path);
+			else
+				printf("%s: changed while reading\n", path);
+			job->errors++;
+		}
+		if (!off)
+			fanout_push(job, ITEM_FILE, dir, strdup(name), st->st_mode & 0777, data, len, 0);
+		else
+			fanout_push(job, ITEM_DATA, dir, NULL, 0, data, len, off);
+		off += len;
+		job->bytes += len;
+		if (len < want)
+			break;
+	} while (off < st->st_size);
+	close(fd);
+}
+
+static int name_cmp(const void* a, const void* b) {
+	return strcmp(*(char**) a, *(char**) b);
+}
+
+static void fanout_walk(struct fanout_job* job, char* host_dir, int dir) {
+	DIR* d = opendir(host_dir);
+	if (!d) {
+		perror(host_dir);
+		job->errors++;
+		return;
+	}
+
+	char** names = NULL;
+	int count = 0;
+	int size = 0;
+	struct dirent* e;
+	while ((e = readdir(d))) {
+		if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+			continue;
+		if (count == size) {
+			size = (size) ? size * 2 : 32;
+			names = realloc(names, size * sizeof(char*));
+		}
+		names[count++] = strdup(e->d_name);
+	}
+	closedir(d);
+	qsort(names, count, sizeof(char*), name_cmp);
+
+	for (int q = 0; q < count; q++) {
+		char* name = names[q];
+		char* path = malloc(strlen(host_dir) + strlen(name) + 2);
+		sprintf(path, "%s/%s", host_dir, name);
+
+		struct stat st;
+		if (lstat(path, &st)) {
+			perror(path);
+			job->errors++;
+		} else if (strlen(name) > 255) {
+			printf("%s: name too long\n", path);
+			job->errors++;
+		} else if (S_ISDIR(st.st_mode)) {
+			int self = job->dirs;
+			fanout_push(job, ITEM_DIR, dir, strdup(name), st.st_mode & 0777, NULL, 0, 0);
+			fanout_walk(job, path, self);
+		} else if (S_ISREG(st.st_mode)) {
+			fanout_file(job, path, name, &st, dir);
+		} else if (S_ISLNK(st.st_mode)) {
+			char* target = malloc(st.st_size + 1);
+			ssize_t len = readlink(path, target, st.st_size + 1);
+			if (len < 0 || len > st.st_size) {
+				perror(path);
+				job->errors++;
+				free(target);
+			} else
+				fanout_push(job, ITEM_SYMLINK, dir, strdup(name), 0777, target, len, 0);
+		} else
+			printf("skipping special file %s\n", path);
+
+		free(path);
+		free(name);
+	}
+	free(names);
+}
+
+/* Replay one item against a target image */
+static void fanout_apply(struct fanout_target* t, struct fanout_item* it) {
+	struct ext2_fs* f = t->f;
+	int parent = (it->type == ITEM_DATA) ? 0 : t->dirs[it->dir];
+
+	if (it->type != ITEM_DATA && parent <= 0) {
+		t->errors++;		// Parent could not be created in this image
+		if (it->type == ITEM_DIR)
+			t->dirs[it->self] = -1;
+		t->file = 0;
+		return;
+	}
+
+	switch (it->type) {
+		case ITEM_DIR: {
+			int child = ext2_find_child(f, it->name, parent);
+			if (child <= 0 && (child = ext2_create_dir(f, it->name, parent)) > 0) {
+				struct ext2_inode* in = ext2_read_inode(f, child);
+				in->mode = EXT2_IFDIR | it->mode;
+				ext2_write_inode(f, child, in);
+				free(in);
+			}
+			if (child <= 0)
+				t->errors++;
+			t->dirs[it->self] = child;
+			break;
+		}
+		case ITEM_FILE:
+			t->file = 0;
+			if (ext2_find_child(f, it->name, parent) > 0) {
+				printf("%s: already exists\n", it->name);
+				t->errors++;
+				break;
+			}
+			t->file = ext2_import_file(f, parent, it->name, it->data, it->mode, it->len);
+			if (t->file) {
+				t->files++;
+				t->bytes += it->len;
+			} else
+				t->errors++;
+			break;
+		case ITEM_DATA:
+			if (!t->file)
+				break;
+			if (ext2_write_at(f, t->file, it->data, it->len, it->off) != it->len) {
+				t->errors++;
+				t->file = 0;
+			} else
+				t->bytes += it->len;
+			break;
+		case ITEM_SYMLINK:
+			if (!ext2_symlink(f, parent, it->name, it->data, it->len))
+				t->errors++;
+			break;
+	}
+}
+
+static void* fanout_worker(void* arg) {
+	struct fanout_target* t = arg;
+	struct fanout_job* job = t->job;
+
+	for (uint64_t seq = 0; ; seq++) {
+		pthread_mutex_lock(&job->lock);
+		while (seq >= job->head)
+			pthread_cond_wait(&job->more, &job->lock);
+		struct fanout_item* it = &job->ring[seq % FANOUT_SLOTS];
+		int dirs = job->dirs;
+		pthread_mutex_unlock(&job->lock);
+
+		if (it->type == ITEM_END)
+			break;
+		if (dirs > t->dirs_size) {
+			t->dirs = realloc(t->dirs, dirs * 2 * sizeof(int));
+			t->dirs_size = dirs * 2;
+		}
+
+		/* The item can't be reused until this worker releases it, so it is
+		read without the lock */
+		fanout_apply(t, it);
+
+		pthread_mutex_lock(&job->lock);
+		if (--it->refs == 0) {
+			/* Workers release items in order, so the last one out of this
+			item is also done with everything before it */
+			job->held -= it->len;
+			free(it->name);
+			free(it->data);
+			job->tail++;
+			pthread_cond_broadcast(&job->room);
+		}
+		pthread_mutex_unlock(&job->lock);
+	}
+	ext2_sync(t->f);
+	return NULL;
+}
+
+/* Copy the contents of host_dir into the directory at path in each of the n
+target images at once, reading the source a single time */
+int ext2_fanout(struct ext2_fs** targets, int n, char* host_dir, char* path) {
+	struct fanout_job job;
+	memset(&job, 0, sizeof(job));
+	job.ring = calloc(FANOUT_SLOTS, sizeof(struct fanout_item));
+	job.n = n;
+	job.dirs = 1;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.more, NULL);
+	pthread_cond_init(&job.room, NULL);
+
+	struct fanout_target* t = calloc(n, sizeof(struct fanout_target));
+	pthread_t* threads = malloc(n * sizeof(pthread_t));
+	int ret = 0;
+
+	for (int q = 0; q < n; q++) {
+		char* p = strdup(path);
+		t[q].job = &job;
+		t[q].f = targets[q];
+		t[q].dirs_size = 64;
+		t[q].dirs = malloc(t[q].dirs_size * sizeof(int));
+		t[q].dirs[0] = ext2_pathize(targets[q], p);
+		free(p);
+		if (t[q].dirs[0] <= 0) {
+			printf("target %d: %s not found in image\n", q, path);
+			ret = -1;
+		}
+	}
+
+	if (!ret) {
+		for (int q = 0; q < n; q++)
+			pthread_create(&threads[q], NULL, fanout_worker, &t[q]);
+		fanout_walk(&job, host_dir, 0);
+		fanout_push(&job, ITEM_END, 0, NULL, 0, NULL, 0, 0);
+		for (int q = 0; q < n; q++)
+			pthread_join(threads[q], NULL);
+
+		printf("read %llu bytes once for %d images\n", (unsigned long long) job.bytes, n);
+		if (job.errors) {
+			printf("%d errors reading %s\n", job.errors, host_dir);
+			ret = -1;
+		}
+		for (int q = 0; q < n; q++) {
+			printf("target %d: %d files, %llu bytes, %d errors\n",
+				q, t[q].files, (unsigned long long) t[q].bytes, t[q].errors);
+			if (t[q].errors)
+				ret = -1;
+		}
+	}
+
+	for (int q = 0; q < n; q++)
+		free(t[q].dirs);
+	free(t);
+	free(threads);
+	free(job.ring);
+	pthread_cond_destroy(&job.more);
+	pthread_cond_destroy(&job.room);
+	pthread_mutex_destroy(&job.lock);
+	return ret;
+}
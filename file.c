@@ -25,6 +25,7 @@ SOFTWARE.
 */
 
 #include "ext2.h"
+#include "fs.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -35,86 +36,235 @@ SOFTWARE.
 #include <assert.h>
 
 
-/* Increment the link count of an inode */
+/* Increment the link count of an inode. Callers keep it under EXT2_LINK_MAX */
 int ext2_add_link(struct ext2_fs *f, int inode_num) {
 	struct ext2_inode* in = ext2_read_inode(f, inode_num);
-	in->links_count++;
+	int links = ++in->links_count;
 	ext2_write_inode(f, inode_num, in);
-	return in->links_count;
+	free(in);
+	return links;
+}
+
+/* A batch of blocks waiting to be freed */
+struct block_list {
+	uint32_t* b;
+	uint32_t count;
+	uint32_t size;
+};
+
+static void block_list_push(struct block_list* l, uint32_t block) {
+	if (l->count == l->size) {
+		l->size = (l->size) ? l->size * 2 : 64;
+		l->b = realloc(l->b, l->size * sizeof(uint32_t));
+	}
+	l->b[l->count++] = block;
+}
+
+static int block_cmp(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*) a;
+	uint32_t y = *(const uint32_t*) b;
+	return (x > y) - (x < y);
+}
+
+/* Release a batch of blocks. The batch is sorted so that each group's bitmap
+is written once and its free count adjusted once, however many of its
+blocks are freed. Descriptors reach the disk with the next ext2_sync() */
+int ext2_free_blocks(struct ext2_fs *f, uint32_t* blocks, uint32_t n) {
+	struct ext2_superblock* s = f->sb;
+	qsort(blocks, n, sizeof(uint32_t), block_cmp);
+
+	ext2_acquire_fs(f);
+	for (uint32_t i = 0; i < n; ) {
+		int g = (blocks[i] - s->first_data_block) / s->blocks_per_group;
+		struct ext2_block_group_descriptor* bg = f->bg + g;
+		uint8_t* bitmap = ext2_space_bitmap(f, f->bmap, g);
+		uint32_t freed = 0;
+
+		for (; i < n && (blocks[i] - s->first_data_block) / s->blocks_per_group == g; i++) {
+			uint32_t bit = (blocks[i] - s->first_data_block) % s->blocks_per_group;
+			if (bitmap[bit / 8] & (1 << (bit % 8))) {
+				bitmap[bit / 8] &= ~(1 << (bit % 8));
+				freed++;
+			}
+		}
+
+		if (freed)
+			ext2_space_sync_group(f, f->bmap, g);
+		bg->free_blocks_count += freed;
+		s->free_blocks_count += freed;
+		if (freed)
+			ext2_bg_dirty(f, g);
+	}
+	ext2_release_fs(f);
+	return 0;
+}
+
+/* Queue every block under an indirect block whose logical blocks lie at or
+past keep. start is the first logical block this indirect block maps.
+Returns 1 when nothing below it survives, so the caller frees it too */
+static int ext2_trunc_indirect(struct ext2_fs *f, uint32_t indirect, int depth, uint64_t start, uint64_t keep, struct block_list* l) {
+	uint32_t per = f->block_size / sizeof(uint32_t);
+	uint64_t span = 1;
+	for (int d = 1; d < depth; d++)
+		span *= per;
+
+	buffer* b = buffer_read(f, indirect);
+	uint32_t* ptr = (uint32_t*) b->data;
+	int changed = 0;
+
+	for (uint32_t q = 0; q < per; q++) {
+		uint64_t first = start + q * span;
+		if (!ptr[q] || first + span <= keep)
+			continue;
+		if (depth == 1 || ext2_trunc_indirect(f, ptr[q], depth - 1, first, keep, l)) {
+			block_list_push(l, ptr[q]);
+			ptr[q] = 0;
+			changed = 1;
+		}
+	}
+
+	int empty = (start >= keep);
+	if (changed && !empty)
+		buffer_write(f, b);
+	buffer_free(b);
+	return empty;
+}
+
+/* Cut (or extend, sparsely) the inode to size bytes. Blocks past the new end
+are gathered across every indirect level first and released as one batch */
+int ext2_truncate(struct ext2_fs *f, int inode_num, uint32_t size) {
+	struct ext2_inode* in = ext2_read_inode(f, inode_num);
+
+	/* Fast symlinks keep their target in the block pointers */
+	if ((in->mode & 0xF000) == EXT2_IFLNK && in->blocks == 0) {
+		free(in);
+		return -1;
+	}
+
+	if ((in->mode & 0xF000) == EXT2_IFDIR)
+		ext2_dir_forget(f, inode_num);
+
+	uint64_t keep = ((uint64_t) size + f->block_size - 1) / f->block_size;
+	uint32_t per = f->block_size / sizeof(uint32_t);
+	struct block_list l = { NULL, 0, 0 };
+
+	for (uint32_t q = keep; q < EXT2_IND_BLOCK; q++) {
+		if (in->block[q])
+			block_list_push(&l, in->block[q]);
+		in->block[q] = 0;
+	}
+
+	uint64_t start = EXT2_IND_BLOCK;
+	uint64_t span = per;
+	for (int depth = 1; depth <= 3; depth++) {
+		uint32_t* ind = &in->block[EXT2_IND_BLOCK + depth - 1];
+		if (*ind && ext2_trunc_indirect(f, *ind, depth, start, keep, &l)) {
+			block_list_push(&l, *ind);
+			*ind = 0;
+		}
+		start += span;
+		span *= per;
+	}
+
+	/* Whatever is left of the new last block past size must read back as
+	zeroes if the file grows again */
+	if (size < in->size && size % f->block_size) {
+		uint32_t n;
+		uint32_t* map = ext2_block_map(f, in, &n);
+		uint32_t last = size / f->block_size;
+		if (last < n && map[last]) {
+			buffer* b = buffer_read(f, map[last]);
+			memset(b->data + size % f->block_size, 0, f->block_size - size % f->block_size);
+			buffer_write(f, b);
+			buffer_free(b);
+		}
+		free(map);
+	}
+
+	in->blocks -= l.count * (f->block_size / SECTOR_SIZE);
+	in->size = size;
+	in->mtime = time(NULL);
+	in->ctime = time(NULL);
+	ext2_write_inode(f, inode_num, in);
+	free(in);
+
+	ext2_free_blocks(f, l.b, l.count);
+	free(l.b);
+	return 0;
+}
+
+/* Give back an inode that never made it into a directory, with whatever
+blocks it was given on the way. in is its in-memory copy, which may map
+blocks the inode table doesn't know about yet */
+static void ext2_discard_inode(struct ext2_fs *f, int inode_num, struct ext2_inode* in) {
+	in->links_count = 0;
+	in->dtime = time(NULL);
+	ext2_write_inode(f, inode_num, in);
+	ext2_truncate(f, inode_num, 0);
+	ext2_free_inode(f, inode_num);
 }
 
 /* Check to see if links == 0. If so, begin the process of file deletion,
 which consists of:
 	* marking the inode and blocks as free 
-	* removing inode from root directory
+	* setting the deletion time
+The caller removes the directory entry
 */
-// void ext2_remove_link(struct ext2_fs *f, int inode_num) {
-// 	struct ext2_inode* in = ext2_read_inode(f, inode_num);
-// 	if (--in->links_count) {
-// 		ext2_write_inode(f, inode_num, in);
-// 		return;
-// 	}
-
-// 	superblock* s = f->sb;
-// 	block_group_descriptor* bg = f->bg;
-
-// 	int block_group = (inode_num - 1) / s->inodes_per_group; // block group #
-// 	bg+= block_group;
-
-// 	int num_blocks 		= in->blocks / 2;
-// 	buffer* bbm = buffer_read(f, bg->block_bitmap);
-// 	buffer* ibm = buffer_read(f, bg->inode_bitmap);
-// 	int indirect = 0;
-// 	int blocknum = 0;
-
-// 	if (num_blocks > 12) {
-// 		indirect = in->block[12];
-// 	}
-
-// 	for (int i = 0; i < num_blocks; i++) {
-// 		if (i < 12) {
-// 			blocknum = in->block[i];
-// 			in->block[i] = 0;
-// 		}
-// 		else
-// 			blocknum = ext2_read_indirect(f, indirect, i-12);
-// 		if (!blocknum)
-// 			break;
-// 		blocknum = blocknum % s->blocks_per_group;
-// 	//	ext2_set_bit(bbm->data, blocknum-1, 0);
-// 		bbm->data[(blocknum-1)/32] &= ~( 1 << (blocknum-1) % 32);
-// 	}
-// 	bbm->data[((inode_num-1) % s->inodes_per_group)/32] &= \
-// 		~( 1 << ((inode_num-1) % s->inodes_per_group) % 32);
-	 
-// 	//ext2_set_bit(ibm->data, ((inode_num-1) % s->inodes_per_group), 0);
-// 	buffer_write(f, ibm);
-// 	buffer_write(f, bbm);
-
-
-
-// 		/* Update superblock information */
-// 	s->free_inodes_count++;
-// 	s->free_blocks_count += num_blocks;
-// 	s->wtime = time(NULL);
-// 	ext2_superblock_rw(1,s);
-
-// 	/* Update block group descriptors */
-// 	bg->free_inodes_count++;
-// 	bg->free_blocks_count += num_blocks;
-// 	ext2_blockdesc_rw(1, bg);
-
-// 	in->block[12] = 0;
-
-// 	ext2_write_inode(1, inode_num, in);
-// }
+int ext2_remove_link(struct ext2_fs *f, int inode_num) {
+	struct ext2_inode* in = ext2_read_inode(f, inode_num);
+	if (in->links_count > 1) {
+		int links = --in->links_count;
+		ext2_write_inode(f, inode_num, in);
+		free(in);
+		return links;
+	}
+	free(in);
+
+	ext2_unreserve(f, inode_num);
+	ext2_truncate(f, inode_num, 0);
+
+	in = ext2_read_inode(f, inode_num);
+	in->links_count = 0;
+	in->dtime = time(NULL);
+	ext2_write_inode(f, inode_num, in);
+	free(in);
+
+	ext2_free_inode(f, inode_num);
+	return 0;
+}
+
+/* Remove the file at path from the image */
+int ext2_unlink(struct ext2_fs *f, char* path) {
+	char* name;
+	int parent = ext2_pathize_parent(f, path, &name);
+	int i_no = (parent > 0) ? ext2_find_child(f, name, parent) : -1;
+	if (i_no <= 0) {
+		printf("%s: not found in image\n", name);
+		return -1;
+	}
+
+	struct ext2_inode* in = ext2_read_inode(f, i_no);
+	int type = in->mode & 0xF000;
+	free(in);
+	if (type == EXT2_IFDIR) {
+		printf("%s: is a directory\n", name);
+		return -1;
+	}
+
+	ext2_remove_child(f, parent, name);
+	ext2_remove_link(f, i_no);
+	ext2_sync(f);
+	return 0;
+}
 
 
 /* 
-Currently writes data to a new inode 
-Need to rewrite this function to handle existing inodes, with overwrite behavior
+Write n bytes of data as the whole contents of inode_num. A fresh inode gets
+its blocks laid out in one go and is linked into parent_dir as name; an
+inode that is already linked is overwritten in place and cut to n bytes.
+Returns the inode, or 0
 */
-size_t ext2_write_file(struct ext2_fs *f, int inode_num, int parent_dir, char* name, char* data, int mode, uint32_t n) {
+static size_t ext2_store_file(struct ext2_fs *f, int inode_num, int parent_dir, char* name, char* data, int mode, uint32_t n, int sync) {
 	/* 
 	Things we need to do:
 		* Find the first free inode # and free blocks needed
@@ -128,21 +278,23 @@ size_t ext2_write_file(struct ext2_fs *f, int inode_num, int parent_dir, char* n
 	struct ext2_superblock* s 				= f->sb;
 	struct ext2_block_group_descriptor* bg 	= f->bg;
 
-	int sz = n;
-	int indirect = 0;
 	int block_group = (inode_num - 1) / s->inodes_per_group; // block group #
 	int index 		= (inode_num - 1) % s->inodes_per_group; // index into block group
-	int block 		= (index * INODE_SIZE) / f->block_size; 
-	int offset 		= (index % (f->block_size/INODE_SIZE))*INODE_SIZE;
 	
 	bg += block_group;
 
 	struct ext2_inode* i = ext2_read_inode(f, inode_num);
 
-	/* We use creation time as a marker for existing inode */
-	if (!i->ctime && !i->blocks) {
-		bg->free_inodes_count--;
-		s->free_inodes_count--;
+	/* An inode that is already linked somewhere is overwritten in place:
+	its blocks are reused, and it is not added to parent_dir again */
+	if (i->links_count && i->mode) {
+		free(i);
+		if (ext2_write_at(f, inode_num, data, n, 0) != n)
+			return 0;
+		ext2_truncate(f, inode_num, n);
+		if (sync)
+			ext2_sync(f);
+		return inode_num;
 	}
 
 	i->mode = mode;		// File
@@ -152,124 +304,592 @@ size_t ext2_write_file(struct ext2_fs *f, int inode_num, int parent_dir, char* n
 	i->mtime = time(NULL);
 	i->dtime = 0;
 	i->links_count = 1;		/* Setting this to 0 = BIG NO NO */
+	i->blocks = 0;
+	memset(i->block, 0, sizeof(i->block));
+
+	/* Data and indirect blocks are laid out in one go, near the inode table
+	or in a free run that fits them */
+	uint32_t count = (n + f->block_size - 1) / f->block_size;
+	uint32_t* map = malloc((count + 1) * sizeof(uint32_t));
+	char* fresh = calloc(count + 1, 1);
+	if (ext2_map_range(f, i, inode_num, 0, count, map, fresh, 1, ext2_space_goal(f, block_group, count))) {
+		printf("%s: out of space\n", name);
+		ext2_discard_inode(f, inode_num, i);
+		free(fresh);
+		free(map);
+		free(i);
+		return 0;
+	}
+	free(fresh);
+
+	/* Go ahead and write the data to disk, one write per physical run. The
+	tail block is padded out with zeroes */
+	uint32_t full = n / f->block_size;
+	for (uint32_t q = 0; q < full; ) {
+		uint32_t run = 1;
+		while (q + run < full && map[q + run] == map[q] + run)
+			run++;
+		buffer_write_blocks(f, map[q], run, data + (size_t) q * f->block_size);
+		q += run;
+	}
+	if (full < count) {
+		buffer* b = buffer_read(f, map[full]);
+		memset(b->data, 0, f->block_size);
+		memcpy(b->data, data + (size_t) full * f->block_size, n % f->block_size);
+		buffer_write(f, b);
+		buffer_free(b);
+	}
 
-	int q = 0;		// Block counter
-	buffer* indb;
-	printf("block size: %d\n", f->block_size);
-
+	free(map);
+	ext2_barrier(f);
 
-	while(sz) {
+	/* Mark inode as used in the inode bitmap, if the caller picked the
+	inode number rather than allocating it */
+	ext2_acquire_fs(f);
+	uint8_t* ibitmap = ext2_space_bitmap(f, f->imap, block_group);
+	if (!(ibitmap[index / 8] & (1 << (index % 8)))) {
+		ext2_space_mark(f, f->imap, block_group, index, 1);
+		bg->free_inodes_count--;
+		s->free_inodes_count--;
+		ext2_bg_dirty(f, block_group);
+	}
+	ext2_release_fs(f);
 
-		uint32_t block_num = 0;
+	/* Write inode structure to disk */
+	ext2_write_inode(f, inode_num, i);
+	/* Add to parent directory */
+	if (ext2_add_child(f, parent_dir, inode_num, name,
+		((mode & 0xF000) == EXT2_IFLNK) ? EXT2_FT_SYMLINK : EXT2_FT_REG_FILE) <= 0) {
+		printf("%s: cannot link into directory\n", name);
+		ext2_discard_inode(f, inode_num, i);
+		free(i);
+		if (sync)
+			ext2_sync(f);
+		return 0;
+	}
+	free(i);
 
-		/* Do we write f->block_size or sz bytes? */
-		int c = (sz >= f->block_size) ? f->block_size : sz;
+	/* Update superblock/blockdesc information on disk*/
+	if (sync)
+		ext2_sync(f);
 
-		if (q < EXT2_IND_BLOCK ) {
-			block_num = ext2_alloc_block(f, block_group);
-			i->block[q] = block_num;
+	return inode_num;
+}
 
-		} else if (q == EXT2_IND_BLOCK ) {
+/* ext2_store_file, with the superblock and descriptors written before it returns */
+size_t ext2_write_file(struct ext2_fs *f, int inode_num, int parent_dir, char* name, char* data, int mode, uint32_t n) {
+	return ext2_store_file(f, inode_num, parent_dir, name, data, mode, n, 1);
+}
 
-			block_num = ext2_alloc_block(f, block_group);
-			indirect = block_num;
+/* Append the data block numbers mapped by an indirect block of the given
+depth (1 = single, 2 = double, 3 = triple) to map. Holes map to 0 */
+static uint32_t ext2_map_indirect(struct ext2_fs *f, uint32_t indirect, int depth, uint32_t* map, uint32_t left) {
+	uint32_t per = f->block_size / sizeof(uint32_t);
+	uint64_t span = per;
+	for (int d = 1; d < depth; d++)
+		span *= per;
+
+	if (!indirect) {
+		uint32_t n = (span < left) ? span : left;
+		memset(map, 0, n * sizeof(uint32_t));
+		return n;
+	}
 
-			indb = buffer_read(f, indirect);
-			memset(indb->data, 0, f->block_size);
-			buffer_write(f, indb);
+	buffer* b = buffer_read(f, indirect);
+	uint32_t* ptr = (uint32_t*) b->data;
+	uint32_t n = 0;
+	for (uint32_t q = 0; q < per && n < left; q++) {
+		if (depth == 1)
+			map[n++] = ptr[q];
+		else
+			n += ext2_map_indirect(f, ptr[q], depth - 1, map + n, left - n);
+	}
+	buffer_free(b);
+	return n;
+}
 
-			i->block[q] = indirect;
+/* Returns a malloc'd array holding the physical block of every logical block
+of the inode, following the single, double and triple indirect blocks once
+each. count is set to the number of entries */
+uint32_t* ext2_block_map(struct ext2_fs *f, struct ext2_inode* in, uint32_t* count) {
+	uint32_t n = (in->size + f->block_size - 1) / f->block_size;
+	uint32_t* map = malloc((n + 1) * sizeof(uint32_t));
+	uint32_t q = 0;
+
+	for (; q < n && q < EXT2_IND_BLOCK; q++)
+		map[q] = in->block[q];
+	for (int depth = 1; q < n && depth <= 3; depth++)
+		q += ext2_map_indirect(f, in->block[EXT2_IND_BLOCK + depth - 1], depth, map + q, n - q);
+
+	*count = q;
+	return map;
+}
 
-			//ext2_write_indirect(indirect, block_num, 0);
-		} else if(q > EXT2_IND_BLOCK && q < ((f->block_size/sizeof(uint32_t)) + EXT2_IND_BLOCK )) {
-			block_num = ext2_alloc_block(f, block_group);
-			ext2_write_indirect(f, indirect, block_num, q-13);
+/* Store map[] as the block pointers of logical blocks 0..n-1 of an indirect
+block of the given depth, allocating the indirect block if it doesn't exist
+yet. Returns the number of entries stored */
+static uint32_t ext2_store_indirect(struct ext2_fs *f, struct ext2_inode* in, uint32_t* indirect, int depth, uint32_t* map, uint32_t left, int group) {
+	uint32_t per = f->block_size / sizeof(uint32_t);
+	buffer* b;
+
+	if (!*indirect) {
+		*indirect = ext2_alloc_block(f, group);
+		if (!*indirect)
+			return 0;
+		in->blocks += (f->block_size / SECTOR_SIZE);
+		b = buffer_read(f, *indirect);
+		memset(b->data, 0, f->block_size);
+	} else
+		b = buffer_read(f, *indirect);
+
+	uint32_t* ptr = (uint32_t*) b->data;
+	uint32_t n = 0;
+	for (uint32_t q = 0; q < per && n < left; q++) {
+		if (depth == 1)
+			ptr[q] = map[n++];
+		else {
+			uint32_t r = ext2_store_indirect(f, in, &ptr[q], depth - 1, map + n, left - n, group);
+			if (!r)
+				break;
+			n += r;
 		}
-		
-		if (q != EXT2_IND_BLOCK ) {
-			/* Go ahead and write the data to disk */
-			buffer* b = buffer_read(f, block_num);
-			memset(b->data, 0, f->block_size);
+	}
+	buffer_write(f, b);
+	buffer_free(b);
+	return n;
+}
 
-			int offset = ((q > EXT2_IND_BLOCK) ? (q-1) : (q) )* f->block_size;
-	
-			memcpy(b->data, data + offset, c);
+/* The inverse of ext2_block_map: make map[] the physical blocks of logical
+blocks 0..n-1 of the inode. Existing indirect blocks are reused, missing ones
+are allocated in group, and each indirect block is written once. The caller
+writes the inode */
+int ext2_write_block_map(struct ext2_fs *f, struct ext2_inode* in, uint32_t* map, uint32_t n, int group) {
+	uint32_t q = 0;
+
+	for (; q < n && q < EXT2_IND_BLOCK; q++)
+		in->block[q] = map[q];
+	for (int depth = 1; q < n && depth <= 3; depth++) {
+		uint32_t r = ext2_store_indirect(f, in, &in->block[EXT2_IND_BLOCK + depth - 1], depth, map + q, n - q, group);
+		if (!r)
+			break;
+		q += r;
+	}
+	return (q == n) ? 0 : -1;
+}
 
-			buffer_write(f, b);
-			buffer_free(b);
-			sz -= c;	// decrease bytes to write
+/* Resolve logical blocks [first, end) that fall under an indirect block of
+the given depth mapping logical blocks from start. out[] is indexed from base.
+With alloc set, holes get fresh blocks (flagged in fresh[]) and missing
+indirect blocks are created. Each indirect block on the way is read once and
+written back only if it changed */
+static int ext2_map_range_ind(struct ext2_fs *f, struct ext2_inode* in, int inode_num, uint32_t* indirect, int depth, uint64_t start,
+		uint64_t first, uint64_t end, uint64_t base, uint32_t* out, char* fresh, int alloc, uint32_t* goal) {
+	uint32_t per = f->block_size / sizeof(uint32_t);
+	uint64_t span = 1;
+	for (int d = 1; d < depth; d++)
+		span *= per;
+
+	uint64_t lo = (first > start) ? first : start;
+	uint64_t hi = (end < start + span * per) ? end : start + span * per;
+	buffer* b;
+	int changed = 0;
+
+	if (!*indirect) {
+		if (!alloc) {
+			memset(out + (lo - base), 0, (hi - lo) * sizeof(uint32_t));
+			return 0;
+		}
+		*indirect = ext2_alloc_block_for(f, inode_num, *goal);
+		if (!*indirect)
+			return -1;
+		*goal = *indirect + 1;
+		in->blocks += (f->block_size / SECTOR_SIZE);
+		b = buffer_read(f, *indirect);
+		memset(b->data, 0, f->block_size);
+		changed = 1;
+	} else
+		b = buffer_read(f, *indirect);
+
+	uint32_t* ptr = (uint32_t*) b->data;
+	int ret = 0;
+	for (uint32_t q = (lo - start) / span; q <= (hi - 1 - start) / span; q++) {
+		uint64_t cs = start + q * span;
+		if (depth == 1) {
+			if (!ptr[q] && alloc) {
+				ptr[q] = ext2_alloc_block_for(f, inode_num, *goal);
+				if (!ptr[q]) {
+					ret = -1;
+					break;
+				}
+				*goal = ptr[q] + 1;
+				in->blocks += (f->block_size / SECTOR_SIZE);
+				fresh[cs - base] = 1;
+				changed = 1;
+			}
+			out[cs - base] = ptr[q];
+		} else {
+			uint32_t old = ptr[q];
+			ret = ext2_map_range_ind(f, in, inode_num, &ptr[q], depth - 1, cs, first, end, base, out, fresh, alloc, goal);
+			changed |= (ptr[q] != old);
+			if (ret)
+				break;
+		}
+	}
+	if (changed)
+		buffer_write(f, b);
+	buffer_free(b);
+	return ret;
+}
+
+/* Physical blocks for logical blocks [first, first + n) of the inode, in
+out[]. See ext2_map_range_ind for alloc and fresh. New blocks, indirect ones
+included, are taken in order from goal onwards, so a range allocated in one
+call is contiguous wherever the disk allows. The caller writes the inode */
+int ext2_map_range(struct ext2_fs *f, struct ext2_inode* in, int inode_num, uint64_t first, uint32_t n, uint32_t* out, char* fresh, int alloc, uint32_t goal) {
+	uint32_t per = f->block_size / sizeof(uint32_t);
+	uint64_t end = first + n;
+
+	for (uint64_t l = first; l < end && l < EXT2_IND_BLOCK; l++) {
+		if (!in->block[l] && alloc) {
+			in->block[l] = ext2_alloc_block_for(f, inode_num, goal);
+			if (!in->block[l])
+				return -1;
+			goal = in->block[l] + 1;
+			in->blocks += (f->block_size / SECTOR_SIZE);
+			fresh[l - first] = 1;
 		}
-		i->blocks += (f->block_size / SECTOR_SIZE);			// 2 sectors per block
-		q++;
+		out[l - first] = in->block[l];
 	}
 
-	if (indirect) {
-		ext2_write_indirect(f, indirect, 0, q-13);
-		i->blocks += (f->block_size / SECTOR_SIZE);
-	}	
+	uint64_t start = EXT2_IND_BLOCK;
+	uint64_t span = per;
+	for (int depth = 1; depth <= 3 && start < end; depth++) {
+		if (first < start + span)
+			if (ext2_map_range_ind(f, in, inode_num, &in->block[EXT2_IND_BLOCK + depth - 1], depth, start,
+					first, end, first, out, fresh, alloc, &goal))
+				return -1;
+		start += span;
+		span *= per;
+	}
+	return (end <= start) ? 0 : -1;
+}
 
-	/* Mark inode as used in the inode bitmap */
-	buffer* b = buffer_read(f, bg->inode_bitmap);
-	b->data[index/32] |= (1 << (index % 32));
-	buffer_write(f, b);	
+/* Where a new block for logical block l should go: just past logical block
+l - 1 if that is mapped, otherwise at the start of the inode's group */
+static uint32_t ext2_block_goal(struct ext2_fs *f, struct ext2_inode* in, int inode_num, uint64_t l) {
+	uint32_t prev = 0;
+	if (l)
+		ext2_map_range(f, in, inode_num, l - 1, 1, &prev, NULL, 0, 0);
+	return (prev) ? prev + 1 : ext2_group_data_start(f, (inode_num - 1) / f->sb->inodes_per_group);
+}
 
+/* Write n bytes at byte offset off of an existing inode. Blocks that are
+already mapped are overwritten in place, so only holes and the new tail are
+allocated, and only the data and indirect blocks covering the range are
+touched. Running out of space part way makes this a short write up to the
+last block that could be mapped. Returns the bytes written, or -1 */
+int64_t ext2_write_at(struct ext2_fs *f, int inode_num, char* data, uint32_t n, uint64_t off) {
+	if (!n)
+		return 0;
+	if (off + n > UINT32_MAX)
+		return -1;
 
-	/* Write inode structure to disk */
-	ext2_write_inode(f, inode_num, i);
-	/* Add to parent directory */
-	ext2_add_child(f, parent_dir, inode_num, name, EXT2_FT_REG_FILE);
+	struct ext2_inode* in = ext2_read_inode(f, inode_num);
+	int bs = f->block_size;
+	uint64_t first = off / bs;
+	uint32_t count = (off + n - 1) / bs - first + 1;
+	uint32_t* map = calloc(count, sizeof(uint32_t));
+	char* fresh = calloc(count, 1);
+	uint32_t old_size = in->size;
+	int short_write = 0;
+
+	if (ext2_map_range(f, in, inode_num, first, count, map, fresh, 1, ext2_block_goal(f, in, inode_num, first))) {
+		printf("inode %d: out of space\n", inode_num);
+		/* Blocks are mapped in order, so keep the prefix that got one */
+		uint32_t mapped = 0;
+		while (mapped < count && map[mapped])
+			mapped++;
+		if (!mapped) {
+			ext2_write_inode(f, inode_num, in);
+			if (off >= old_size)
+				ext2_truncate(f, inode_num, old_size);
+			free(map);
+			free(fresh);
+			free(in);
+			return -1;
+		}
+		count = mapped;
+		n = (first + mapped) * bs - off;
+		short_write = 1;
+	}
 
-	/* Update superblock/blockdesc information on disk*/
-	sync(f);
+	for (uint32_t q = 0; q < count; ) {
+		uint64_t bstart = (first + q) * bs;
+		uint64_t lo = (off > bstart) ? off : bstart;
+		uint64_t hi = (off + n < bstart + bs) ? off + n : bstart + bs;
+
+		/* Partial blocks are read, patched and written back. Fresh ones
+		start out as zeroes rather than whatever was on disk */
+		if (hi - lo < bs) {
+			buffer* b = buffer_read(f, map[q]);
+			if (fresh[q])
+				memset(b->data, 0, bs);
+			memcpy(b->data + (lo - bstart), data + (lo - off), hi - lo);
+			buffer_write(f, b);
+			buffer_free(b);
+			q++;
+			continue;
+		}
 
-	return inode_num;
+		/* Whole blocks go straight from data, one write per physical run */
+		uint32_t run = 1;
+		while (q + run < count && map[q + run] == map[q] + run && (first + q + run + 1) * bs <= off + n)
+			run++;
+		buffer_write_blocks(f, map[q], run, data + (lo - off));
+		q += run;
+	}
+
+	/* New blocks and a new size only go out once the data under them has */
+	if (off + n > in->size || memchr(fresh, 1, count))
+		ext2_barrier(f);
+	if (off + n > in->size)
+		in->size = off + n;
+	in->mtime = time(NULL);
+	ext2_write_inode(f, inode_num, in);
+	/* A short write past the old end may have left an indirect block
+	that maps nothing below the new size */
+	if (short_write && off + n >= old_size)
+		ext2_truncate(f, inode_num, in->size);
+	free(map);
+	free(fresh);
+	free(in);
+	return n;
 }
 
 size_t ext2_touch_file(struct ext2_fs *f, int parent, char* name, char* data, int mode, size_t n) {
-	uint32_t inode_num = ext2_alloc_inode(f);
+	uint32_t inode_num = ext2_alloc_inode(f, parent, mode | EXT2_IFREG);
+	if (!inode_num)
+		return 0;
 	return ext2_write_file(f, inode_num, parent, name, data, mode | EXT2_IFREG, n);
 }
 
+/* ext2_touch_file for bulk importers, which call ext2_sync themselves once
+per batch rather than once per file */
+size_t ext2_import_file(struct ext2_fs *f, int parent, char* name, char* data, int mode, size_t n) {
+	uint32_t inode_num = ext2_alloc_inode(f, parent, mode | EXT2_IFREG);
+	if (!inode_num)
+		return 0;
+	return ext2_store_file(f, inode_num, parent, name, data, mode | EXT2_IFREG, n, 0);
+}
+
+/* Create a symlink called name in parent pointing at target. Targets short
+enough to fit in the block pointers become fast symlinks with no data block.
+The superblock and descriptors are left for the caller's next ext2_sync.
+Returns the new inode, or 0 */
+uint32_t ext2_symlink(struct ext2_fs *f, int parent, char* name, char* target, uint32_t len) {
+	if (len >= f->block_size)
+		return 0;
+	uint32_t i_no = ext2_alloc_inode(f, parent, EXT2_IFLNK);
+	if (!i_no)
+		return 0;
+
+	if (len < sizeof(((struct ext2_inode*) 0)->block)) {
+		struct ext2_inode* in = calloc(1, INODE_SIZE);
+		in->mode = EXT2_IFLNK | 0777;
+		in->size = len;
+		in->atime = in->ctime = in->mtime = time(NULL);
+		in->links_count = 1;
+		memcpy(in->block, target, len);
+		ext2_write_inode(f, i_no, in);
+		if (ext2_add_child(f, parent, i_no, name, EXT2_FT_SYMLINK) <= 0) {
+			printf("%s: cannot link into directory\n", name);
+			in->links_count = 0;
+			in->dtime = time(NULL);
+			ext2_write_inode(f, i_no, in);
+			ext2_free_inode(f, i_no);
+			i_no = 0;
+		}
+		free(in);
+		return i_no;
+	}
+	return ext2_store_file(f, i_no, parent, name, target, EXT2_IFLNK | 0777, len, 0);
+}
+
 
 size_t ext2_read_file(struct ext2_fs *f, struct ext2_inode* in, char* buf) {
 	assert(in);
 	if(!in)
 		return NULL;
 
-	int num_blocks = in->blocks / (f->block_size/SECTOR_SIZE);	
+	assert(buf != NULL);
 
-	assert(num_blocks != 0);
-	if (!num_blocks) 
-		return NULL;
+	uint32_t num_blocks;
+	uint32_t* map = ext2_block_map(f, in, &num_blocks);
+
+	/* buf only needs to hold in->size bytes, so the tail block is copied
+	short */
+	for (uint32_t i = 0; i < num_blocks; i++) {
+		size_t off = (size_t) i * f->block_size;
+		size_t len = (in->size - off < f->block_size) ? in->size - off : f->block_size;
+		if (!map[i]) {
+			memset(buf + off, 0, len);
+			continue;
+		}
+		buffer* b = buffer_read(f, map[i]);
+		memcpy((char*) buf + off, b->data, len);
+		buffer_free(b);
+	}
+	free(map);
+	return in->size;
+}
 
 
-	size_t sz = f->block_size*num_blocks;
+/* Open file handles. f_inode keeps a copy of the on-disk inode, so offset
+reads cost only the blocks they cover; private_data is the image */
+#define FILE_MAP_CHUNK	1024	// Logical blocks resolved per ext2_map_range call
+
+/* Refresh the VFS inode from the on-disk one */
+static void ext2_file_load(struct file* file) {
+	struct inode* i = file->f_inode;
+	free(i->u.ext2_i);
+	struct ext2_inode* in = ext2_read_inode(file->private_data, i->i_ino);
+	i->u.ext2_i = in;
+	i->i_nlinks = in->links_count;
+	i->i_mode = in->mode;
+	i->i_id = in->uid;
+	i->i_gid = in->gid;
+	i->i_size = in->size;
+	i->i_atime = in->atime;
+	i->i_ctime = in->ctime;
+	i->i_mtime = in->mtime;
+}
 
-	assert(buf != NULL);
+/* A handle open for writing holds a preallocation window for the inode
+until it is closed */
+static int ext2_file_open(struct file* file) {
+	ext2_file_load(file);
+	if ((file->f_inode->i_mode & 0xF000) != EXT2_IFREG)
+		return -1;
+	if (file->f_mode & FMODE_WRITE)
+		ext2_reserve(file->private_data, file->f_inode->i_ino);
+	return 0;
+}
 
-	int indirect = 0;
+static int ext2_file_close(struct file* file) {
+	if (file->f_mode & FMODE_WRITE)
+		ext2_unreserve(file->private_data, file->f_inode->i_ino);
+	free(file->f_inode->u.ext2_i);
+	free(file->f_inode);
+	free(file);
+	return 0;
+}
 
-	/* Singly-indirect block pointer */
-	if (num_blocks > 12) {
-		indirect = in->block[12];
+/* Read up to cnt bytes at off. Only the indirect blocks on the path to the
+range and the data blocks inside it are read; holes read as zeroes */
+ssize_t ext2_pread(struct file* file, char* buf, size_t cnt, uint64_t off) {
+	struct ext2_fs* f = file->private_data;
+	struct inode* i = file->f_inode;
+	int bs = f->block_size;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -1;
+	if (off >= i->i_size)
+		return 0;
+	if (cnt > i->i_size - off)
+		cnt = i->i_size - off;
+
+	uint64_t first = off / bs;
+	uint64_t last = (off + cnt - 1) / bs;
+	uint32_t* map = malloc(FILE_MAP_CHUNK * sizeof(uint32_t));
+
+	for (uint64_t l = first; l <= last; ) {
+		uint32_t n = (last - l + 1 < FILE_MAP_CHUNK) ? last - l + 1 : FILE_MAP_CHUNK;
+		ext2_map_range(f, i->u.ext2_i, i->i_ino, l, n, map, NULL, 0, 0);
+
+		for (uint32_t q = 0; q < n; ) {
+			uint64_t bstart = (l + q) * bs;
+			uint64_t lo = (off > bstart) ? off : bstart;
+			uint64_t hi = (off + cnt < bstart + bs) ? off + cnt : bstart + bs;
+
+			if (!map[q]) {
+				memset(buf + (lo - off), 0, hi - lo);
+				q++;
+			} else if (hi - lo < bs) {
+				buffer* b = buffer_read(f, map[q]);
+				memcpy(buf + (lo - off), b->data + (lo - bstart), hi - lo);
+				buffer_free(b);
+				q++;
+			} else {
+				/* Whole blocks are read straight into buf, one read per run */
+				uint32_t run = 1;
+				while (q + run < n && map[q + run] == map[q] + run && (l + q + run + 1) * bs <= off + cnt)
+					run++;
+				buffer_read_blocks(f, map[q], run, buf + (lo - off));
+				q += run;
+			}
+		}
+		l += n;
 	}
+	free(map);
+	return cnt;
+}
 
-	int blocknum = 0;
-	for (int i = 0; i < num_blocks; i++) {
-		if (i < 12) {
-			blocknum = in->block[i];
-			buffer* b = buffer_read(f, blocknum);
-			memcpy((char*) buf + (i * f->block_size), b->data, f->block_size);
-			buffer_free(b);
-		}
-		if (i > 12) {
-			blocknum = ext2_read_indirect(f, indirect, i-13);
-			buffer* b = buffer_read(f, blocknum);
-			memcpy((char*) buf + ((i-1) * f->block_size), b->data, f->block_size);
-			buffer_free(b);
-		}
+/* Write cnt bytes at off, extending the file if needed */
+ssize_t ext2_pwrite(struct file* file, char* buf, size_t cnt, uint64_t off) {
+	if (!(file->f_mode & FMODE_WRITE) || cnt > UINT32_MAX)
+		return -1;
+
+	ssize_t n = ext2_write_at(file->private_data, file->f_inode->i_ino, buf, cnt, off);
+	ext2_file_load(file);
+	return n;
+}
+
+static size_t ext2_file_read(struct file* file, char* buf, size_t cnt) {
+	ssize_t n = ext2_pread(file, buf, cnt, file->f_pos);
+	if (n < 0)
+		return 0;
+	file->f_pos += n;
+	return n;
+}
+
+static size_t ext2_file_write(struct file* file, char* buf, size_t cnt) {
+	ssize_t n = ext2_pwrite(file, buf, cnt, file->f_pos);
+	if (n < 0)
+		return 0;
+	file->f_pos += n;
+	return n;
+}
+
+struct file_operations ext2_file_operations = {
+	.open = ext2_file_open,
+	.close = ext2_file_close,
+	.read = ext2_file_read,
+	.write = ext2_file_write,
+	.pread = ext2_pread,
+	.pwrite = ext2_pwrite,
+};
+
+/* Open the regular file at path for FMODE_READ and/or FMODE_WRITE */
+struct file* ext2_open(struct ext2_fs *f, char* path, int mode) {
+	char* p = strdup(path);
+	int i_no = ext2_pathize(f, p);
+	free(p);
+	if (i_no <= 0)
+		return NULL;
 
-		//printf("%x\n", b->data[i]);
+	struct file* file = calloc(1, sizeof(struct file));
+	file->f_mode = mode;
+	file->f_inode = calloc(1, sizeof(struct inode));
+	file->f_inode->i_ino = i_no;
+	file->private_data = f;
+	file->f_ops = &ext2_file_operations;
+	if (file->f_ops->open(file)) {
+		file->f_ops->close(file);
+		return NULL;
 	}
-	return sz;
+	return file;
+}
+
+int ext2_close(struct file* file) {
+	return file->f_ops->close(file);
 }
@@ -44,17 +44,25 @@ struct file {
 	uint32_t f_flags;
 
 	uint64_t f_pos;		// Current read/write position
+	struct inode* f_inode;
 	void* private_data;
 
 	struct file_operations* f_ops;
 
 };
 
+#define FMODE_READ	0x1
+#define FMODE_WRITE	0x2
+
+/* read and write work at f_pos and advance it; pread and pwrite take an
+explicit offset and leave f_pos alone */
 struct file_operations {
-	int (*open);
-	int (*close);
+	int (*open) (struct file*);
+	int (*close) (struct file*);
 	size_t (*read) (struct file*, char* __user, size_t cnt);
 	size_t (*write) (struct file*, char* __user, size_t cnt);
+	ssize_t (*pread) (struct file*, char* __user, size_t cnt, uint64_t off);
+	ssize_t (*pwrite) (struct file*, char* __user, size_t cnt, uint64_t off);
 };
 
 struct inode_operations {
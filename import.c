@@ -0,0 +1,348 @@
+/*
+import.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* Bulk import of a host directory tree into the image.
+
+Every regular file is hashed as it is read. Files whose size, hash and
+permissions match one already imported are byte-compared against it, and
+identical ones become another directory entry for the existing inode instead
+of new blocks. Once that inode has EXT2_LINK_MAX names, the next copy gets
+an inode of its own, which later copies link to instead.
+Entries are imported in name order, so the same tree always produces the same
+image layout. The superblock and descriptors are written every
+IMPORT_SYNC_BYTES of data and at the end, not once per file. */
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <dirent.h>
+
+#include <sys/stat.h>
+
+#define IMPORT_CMP_CHUNK	(64 * 1024)
+#define IMPORT_SYNC_BYTES	(64 << 20)	// Data imported between superblock writes
+
+/* One imported file, keyed by content hash and permissions */
+struct import_entry {
+	uint64_t hash;
+	uint64_t size;
+	uint16_t mode;		// Permission bits, which every name shares
+	uint16_t links;		// Names the inode has been given so far
+	uint32_t inode;		// 0 marks an empty slot
+	char* path;			// Host copy, for byte comparison on hash match
+};
+
+struct import_job {
+	struct ext2_fs* f;
+	struct import_entry* table;
+	uint32_t size;		// Power of two
+	uint32_t used;
+
+	int files;
+	int dirs;
+	int symlinks;
+	int links;
+	int errors;
+	uint64_t bytes;
+	uint64_t saved;
+	uint64_t unsynced;			// Bytes written since the last ext2_sync
+
+	struct manifest* manifest;	// CRCs of imported files, if wanted
+	size_t root_len;			// Host paths are recorded past this prefix
+};
+
+static void import_insert(struct import_job* job, struct import_entry* e);
+
+static void import_grow(struct import_job* job) {
+	struct import_entry* old = job->table;
+	uint32_t old_size = job->size;
+
+	job->size = (old_size) ? old_size * 2 : 1024;
+	job->table = calloc(job->size, sizeof(struct import_entry));
+	job->used = 0;
+	for (uint32_t q = 0; q < old_size; q++)
+		if (old[q].inode)
+			import_insert(job, &old[q]);
+	free(old);
+}
+
+static void import_insert(struct import_job* job, struct import_entry* e) {
+	if ((job->used + 1) * 2 > job->size)
+		import_grow(job);
+
+	uint32_t q = e->hash & (job->size - 1);
+	while (job->table[q].inode)
+		q = (q + 1) & (job->size - 1);
+	job->table[q] = *e;
+	job->used++;
+}
+
+/* Byte-compare data against the host file at path */
+static int import_same(char* path, char* data, uint64_t size) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	char* buf = malloc(IMPORT_CMP_CHUNK);
+	uint64_t off = 0;
+	int same = 1;
+	while (same && off < size) {
+		size_t len = (size - off < IMPORT_CMP_CHUNK) ? size - off : IMPORT_CMP_CHUNK;
+		if (pread(fd, buf, len, off) != len || memcmp(buf, data + off, len))
+			same = 0;
+		off += len;
+	}
+	free(buf);
+	close(fd);
+	return same;
+}
+
+/* Find an already imported file with exactly this content and mode */
+static struct import_entry* import_lookup(struct import_job* job, uint64_t hash, uint16_t mode, char* data, uint64_t size) {
+	if (!job->size)
+		return NULL;
+	for (uint32_t q = hash & (job->size - 1); job->table[q].inode; q = (q + 1) & (job->size - 1)) {
+		struct import_entry* e = &job->table[q];
+		if (e->hash == hash && e->size == size && e->mode == mode && import_same(e->path, data, size))
+			return e;
+	}
+	return NULL;
+}
+
+static char* read_host_file(char* path, uint64_t size) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	char* data = malloc(size + 1);
+	uint64_t off = 0;
+	while (off < size) {
+		ssize_t n = pread(fd, data + off, size - off, off);
+		if (n <= 0)
+			break;
+		off += n;
+	}
+	close(fd);
+	if (off != size) {
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+static void import_file(struct import_job* job, char* path, char* name, struct stat* st, int dir_inode) {
+	struct ext2_fs* f = job->f;
+	if (st->st_size > UINT32_MAX) {
+		printf("%s: too large for ext2\n", path);
+		job->errors++;
+		return;
+	}
+
+	char* data = read_host_file(path, st->st_size);
+	if (!data) {
+		perror(path);
+		job->errors++;
+		return;
+	}
+
+	uint16_t mode = st->st_mode & 0777;
+	uint64_t hash = ext2_hash(data, st->st_size, 0);
+	struct import_entry* dup = (st->st_size) ? import_lookup(job, hash, mode, data, st->st_size) : NULL;
+	int done = 0;
+
+	if (dup && dup->links < EXT2_LINK_MAX) {
+		if (ext2_add_child(f, dir_inode, dup->inode, name, EXT2_FT_REG_FILE) > 0) {
+			ext2_add_link(f, dup->inode);
+			dup->links++;
+			job->links++;
+			job->saved += st->st_size;
+			done = 1;
+		} else {
+			printf("%s: already exists\n", path);
+			job->errors++;
+		}
+	} else {
+		uint32_t i_no = ext2_import_file(f, dir_inode, name, data, mode, st->st_size);
+		if (i_no) {
+			job->files++;
+			job->bytes += st->st_size;
+			if (dup) {
+				/* The old inode is full of names; copies go to this one now */
+				dup->inode = i_no;
+				dup->links = 1;
+			} else if (st->st_size) {
+				struct import_entry e = { hash, st->st_size, mode, 1, i_no, strdup(path) };
+				import_insert(job, &e);
+			}
+			done = 1;
+		} else
+			job->errors++;
+	}
+	if (done && job->manifest)
+		ext2_manifest_add(job->manifest, path + job->root_len + 1, data, st->st_size);
+	free(data);
+
+	job->unsynced += st->st_size;
+	if (job->unsynced >= IMPORT_SYNC_BYTES) {
+		ext2_sync(f);
+		job->unsynced = 0;
+	}
+}
+
+static void import_symlink(struct import_job* job, char* path, char* name, struct stat* st, int dir_inode) {
+	struct ext2_fs* f = job->f;
+	char* target = malloc(st->st_size + 1);
+	ssize_t len = readlink(path, target, st->st_size + 1);
+	if (len < 0 || len > st->st_size || len >= f->block_size) {
+		perror(path);
+		job->errors++;
+		free(target);
+		return;
+	}
+
+	if (ext2_symlink(f, dir_inode, name, target, len))
+		job->symlinks++;
+	else
+		job->errors++;
+	free(target);
+}
+
+static int name_cmp(const void* a, const void* b) {
+	return strcmp(*(char**) a, *(char**) b);
+}
+
+static void import_walk(struct import_job* job, char* host_dir, int dir_inode) {
+	struct ext2_fs* f = job->f;
+	DIR* dir = opendir(host_dir);
+	if (!dir) {
+		perror(host_dir);
+		job->errors++;
+		return;
+	}
+
+	char** names = NULL;
+	int count = 0;
+	int size = 0;
+	struct dirent* e;
+	while ((e = readdir(dir))) {
+		if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+			continue;
+		if (count == size) {
+			size = (size) ? size * 2 : 32;
+			names = realloc(names, size * sizeof(char*));
+		}
+		names[count++] = strdup(e->d_name);
+	}
+	closedir(dir);
+	qsort(names, count, sizeof(char*), name_cmp);
+
+	for (int q = 0; q < count; q++) {
+		char* name = names[q];
+		char* path = malloc(strlen(host_dir) + strlen(name) + 2);
+		sprintf(path, "%s/%s", host_dir, name);
+
+		struct stat st;
+		if (lstat(path, &st)) {
+			perror(path);
+			job->errors++;
+		} else if (strlen(name) > 255) {
+			printf("%s: name too long\n", path);
+			job->errors++;
+		} else if (S_ISDIR(st.st_mode)) {
+			int child = ext2_find_child(f, name, dir_inode);
+			if (child <= 0) {
+				child = ext2_create_dir(f, name, dir_inode);
+				if (child > 0) {
+					struct ext2_inode* in = ext2_read_inode(f, child);
+					in->mode = EXT2_IFDIR | (st.st_mode & 0777);
+					ext2_write_inode(f, child, in);
+					free(in);
+					job->dirs++;
+				}
+			}
+			if (child > 0)
+				import_walk(job, path, child);
+			else
+				job->errors++;
+		} else if (S_ISREG(st.st_mode)) {
+			import_file(job, path, name, &st, dir_inode);
+		} else if (S_ISLNK(st.st_mode)) {
+			import_symlink(job, path, name, &st, dir_inode);
+		} else
+			printf("skipping special file %s\n", path);
+
+		free(path);
+		free(name);
+	}
+	free(names);
+}
+
+/* Copy the contents of host_dir into the image directory at path. When
+manifest is not NULL, the CRCs of every file imported are written to it */
+int ext2_import(struct ext2_fs *f, char* host_dir, char* path, char* manifest) {
+	char* p = strdup(path);
+	int dir_inode = ext2_pathize(f, p);
+	free(p);
+	if (dir_inode <= 0) {
+		printf("%s: not found in image\n", path);
+		return -1;
+	}
+	struct ext2_inode* in = ext2_read_inode(f, dir_inode);
+	int is_dir = ((in->mode & 0xF000) == EXT2_IFDIR);
+	free(in);
+	if (!is_dir) {
+		printf("%s: not a directory\n", path);
+		return -1;
+	}
+
+	struct import_job job;
+	memset(&job, 0, sizeof(job));
+	job.f = f;
+	job.root_len = strlen(host_dir);
+	if (manifest && !(job.manifest = ext2_manifest_create(manifest, path, f->block_size)))
+		return -1;
+
+	import_walk(&job, host_dir, dir_inode);
+	ext2_sync(f);
+	if (job.manifest && ext2_manifest_close(job.manifest))
+		job.errors++;
+
+	printf("imported %d files, %d directories, %d symlinks, %llu bytes\n",
+		job.files, job.dirs, job.symlinks, (unsigned long long) job.bytes);
+	printf("deduplicated %d files, %llu bytes saved\n", job.links, (unsigned long long) job.saved);
+	if (job.errors)
+		printf("%d errors\n", job.errors);
+
+	for (uint32_t q = 0; q < job.size; q++)
+		free(job.table[q].path);
+	free(job.table);
+	return (job.errors) ? -1 : 0;
+}
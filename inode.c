@@ -32,7 +32,7 @@ SOFTWARE.
 
 
 struct ext2_inode* ext2_read_inode(struct ext2_fs *f, int i) {
-	acquire_fs(f);
+	ext2_acquire_fs(f);
 	struct ext2_superblock* s = f->sb;
 	struct ext2_block_group_descriptor* bgd = f->bg;
 
@@ -46,12 +46,13 @@ struct ext2_inode* ext2_read_inode(struct ext2_fs *f, int i) {
 	struct ext2_inode* in = malloc(INODE_SIZE);
 	/* Switched to memcpy. This may avoid issues for OS level buffer caching. */
 	memcpy(in, ((char*) b->data + (index % (f->block_size/INODE_SIZE))*INODE_SIZE), INODE_SIZE);
-	release_fs(f);
+	buffer_free(b);
+	ext2_release_fs(f);
 	return in;
 }
 
 void ext2_write_inode(struct ext2_fs *f, int inode_num, struct ext2_inode* i) {
-	acquire_fs(f);
+	ext2_acquire_fs(f);
 	struct ext2_superblock* s = f->sb;
 	struct ext2_block_group_descriptor* bgd = f->bg;
 
@@ -67,60 +68,122 @@ void ext2_write_inode(struct ext2_fs *f, int inode_num, struct ext2_inode* i) {
 	buffer* b = buffer_read(f, bgd->inode_table+block);
 	memcpy((char*) b->data + offset, i, INODE_SIZE);
 	buffer_write(f, b);
+	buffer_free(b);
 
-	release_fs(f);
+	ext2_release_fs(f);
 
 }
 
+/* Group for a new directory, after Orlov. Directories directly under the
+root are spread out: each goes to the group with the fewest directories
+among those with at least the average free inodes and blocks. Deeper ones
+stay with their parent unless its group is crowded with directories or
+running short of space, so a subtree keeps to a few groups */
+static int ext2_find_group_dir(struct ext2_fs *f, int parent_group, int top) {
+	struct ext2_superblock* s = f->sb;
+	int ngroups = f->num_bg;
+	uint32_t avefreei = s->free_inodes_count / ngroups;
+	uint32_t avefreeb = s->free_blocks_count / ngroups;
+	uint32_t ndirs = f->ndirs;
+
+	if (top) {
+		int best = -1;
+		for (int n = 0; n < ngroups; n++) {
+			int g = (parent_group + n) % ngroups;
+			struct ext2_block_group_descriptor* bg = f->bg + g;
+			if (bg->free_inodes_count < avefreei || bg->free_blocks_count < avefreeb || !bg->free_inodes_count)
+				continue;
+			if (best < 0 || bg->used_dirs_count < f->bg[best].used_dirs_count)
+				best = g;
+		}
+		if (best >= 0)
+			return best;
+	} else {
+		uint32_t max_dirs = ndirs / ngroups + s->inodes_per_group / 16;
+		int64_t min_inodes = (int64_t) avefreei - s->inodes_per_group / 4;
+		int64_t min_blocks = (int64_t) avefreeb - s->blocks_per_group / 4;
+		for (int n = 0; n < ngroups; n++) {
+			int g = (parent_group + n) % ngroups;
+			struct ext2_block_group_descriptor* bg = f->bg + g;
+			if (bg->used_dirs_count < max_dirs && bg->free_inodes_count && 
+				bg->free_inodes_count >= min_inodes && bg->free_blocks_count >= min_blocks)
+				return g;
+		}
+	}
+
+	/* Fall back to anything with average free inodes, then to anything */
+	for (int n = 0; n < ngroups; n++) {
+		int g = (parent_group + n) % ngroups;
+		if (f->bg[g].free_inodes_count && f->bg[g].free_inodes_count >= avefreei)
+			return g;
+	}
+	return parent_group;
+}
+
+/* Group for a new file: its parent's, or failing that one picked by
+quadratic probing from there, so that files of a full group scatter */
+static int ext2_find_group_other(struct ext2_fs *f, int parent_group) {
+	int ngroups = f->num_bg;
+	struct ext2_block_group_descriptor* bg = f->bg + parent_group;
+	if (bg->free_inodes_count && bg->free_blocks_count)
+		return parent_group;
+
+	int g = parent_group;
+	for (int step = 1; step < ngroups; step <<= 1) {
+		g = (g + step) % ngroups;
+		if (f->bg[g].free_inodes_count && f->bg[g].free_blocks_count)
+			return g;
+	}
+	return parent_group;
+}
+
 /* 
-Finds a free inode from the block descriptor group, and sets it as used
+Finds a free inode for a new inode of the given mode under parent, and sets
+it as used. The group is chosen by ext2_find_group_dir or _other; if that
+turns out full the space summary gives the next group with a free inode.
+Returns 0 when every group is out of inodes
 */
-uint32_t ext2_alloc_inode(struct ext2_fs *f) {
-	// Read the block and inode bitmaps from the block descriptor group
-
-	struct ext2_block_group_descriptor* bg = f->bg;
-	buffer* bitmap_buf;
-	uint32_t* bitmap = malloc(f->block_size);
-	uint32_t num = 0;
-
-	/* While there are no free inodes, go through the block groups */
-	do {
-
-		bitmap_buf = buffer_read(f, bg->inode_bitmap);
-		memcpy(bitmap, bitmap_buf->data, f->block_size);
-		// Find the first free bit in both bitmaps
-		bg++;
-	} while( (num = ext2_first_free(bitmap, f->block_size)) == -1);	
-
-	// Should use a macro, not "32"
-	bitmap[num / 32] |= (1<<(num % 32));
-
-	// Update bitmaps and write to disk
-	memcpy(bitmap_buf->data, bitmap, f->block_size);	
-	buffer_write(f, bitmap_buf);								
-	// Free our bitmaps
-	free(bitmap);	
-	buffer_free(bitmap_buf);			
-	return num + 1;	// 1 indexed				
+uint32_t ext2_alloc_inode(struct ext2_fs *f, int parent, int mode) {
+	struct ext2_superblock* s = f->sb;
+	int parent_group = (parent > 0) ? (parent - 1) / s->inodes_per_group : 0;
+
+	ext2_acquire_fs(f);
+	int first = ((mode & 0xF000) == EXT2_IFDIR)
+		? ext2_find_group_dir(f, parent_group, parent <= EXT2_ROOTDIR)
+		: ext2_find_group_other(f, parent_group);
+
+	int g = ext2_space_find(f, f->imap, first, 1);
+	if (g < 0) {
+		ext2_release_fs(f);
+		return 0;
+	}
+	int num = ext2_next_free(ext2_space_bitmap(f, f->imap, g), 0, s->inodes_per_group);
+	ext2_space_mark(f, f->imap, g, num, 1);
+
+	s->free_inodes_count--;
+	f->bg[g].free_inodes_count--;
+	ext2_bg_dirty(f, g);
+	ext2_release_fs(f);
+	return num + g * s->inodes_per_group + 1;	// 1 indexed
 }
 
 
+/* Clear an inode's bit in its own group's bitmap, and return it to the free
+counts. The caller is responsible for the inode's blocks */
 uint32_t ext2_free_inode(struct ext2_fs *f, int i_no) {
-	struct ext2_block_group_descriptor* bg = f->bg;
-
-	// Read the block and inode bitmaps from the block descriptor group
-	buffer* bitmap_buf = buffer_read(f, bg->inode_bitmap);
-	uint32_t* bitmap = malloc(f->block_size);
-	memcpy(bitmap, bitmap_buf->data, f->block_size);
-
-	i_no -= 1;
-	// Should use a macro, not "32"
-	bitmap[i_no / 32] &= ~(1 << (i_no % 32));
-
-	// Update bitmaps and write to disk
-	memcpy(bitmap_buf->data, bitmap, f->block_size);	
-	buffer_write(f, bitmap_buf);								
-	// Free our bitmaps
-	free(bitmap);				
-	return i_no + 1;
-}
\ No newline at end of file
+	struct ext2_superblock* s = f->sb;
+	int block_group = (i_no - 1) / s->inodes_per_group; // block group #
+	int index 		= (i_no - 1) % s->inodes_per_group; // index into block group
+	struct ext2_block_group_descriptor* bg = f->bg + block_group;
+
+	ext2_acquire_fs(f);
+	uint8_t* bitmap = ext2_space_bitmap(f, f->imap, block_group);
+	if (bitmap[index / 8] & (1 << (index % 8))) {
+		ext2_space_mark(f, f->imap, block_group, index, 0);
+		s->free_inodes_count++;
+		bg->free_inodes_count++;
+		ext2_bg_dirty(f, block_group);
+	}
+	ext2_release_fs(f);
+	return i_no;
+}
@@ -0,0 +1,275 @@
+/*
+overlay.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* Copy-on-write overlay for a read-only base image.
+
+The overlay is a sparse file the size of the image plus a small header and a
+block-index table, one bit per image block. Written blocks land at their own
+offset in the data area and get their bit set; reads of blocks without a bit
+fall through to the base. Creating an overlay only writes the header, so it
+costs the same no matter how large the base is.
+
+Overlay file layout:
+	struct overlay_header		(OVERLAY_HDR bytes)
+	block-index table			(one bit per block, rounded up to OVERLAY_HDR)
+	data area					(block n at data + n * block_size)
+*/
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+
+#define OVERLAY_MAGIC	"E2OVRLY1"
+#define OVERLAY_HDR		4096
+#define OVERLAY_CHUNK	(1 << 20)	// Largest single copy during commit
+
+struct overlay_header {
+	char magic[8];
+	uint32_t block_size;
+	uint32_t blocks_count;
+	uint32_t base_wtime;		// Base superblock write time, for invalidation
+	uint32_t reserved;
+	uint64_t table;				// Offset of the block-index table
+	uint64_t data;				// Offset of block 0 in the data area
+} __attribute__((packed));
+
+struct overlay {
+	int fd;
+	int base;
+	uint32_t block_size;
+	uint32_t blocks_count;
+	uint64_t table;
+	uint64_t data;
+	uint8_t* map;				// In-memory copy of the block-index table
+	pthread_mutex_t lock;		// Serializes updates to map
+};
+
+#define OV_PRESENT(ov, b)	((ov)->map[(b) / 8] & (1 << ((b) % 8)))
+#define OVERLAY_MAP_BYTES(ov)	(((uint64_t) (ov)->blocks_count + 7) / 8)
+
+static int overlay_write_header(struct overlay* ov, uint32_t base_wtime) {
+	struct overlay_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, OVERLAY_MAGIC, sizeof(h.magic));
+	h.block_size = ov->block_size;
+	h.blocks_count = ov->blocks_count;
+	h.base_wtime = base_wtime;
+	h.table = ov->table;
+	h.data = ov->data;
+	return (pwrite(ov->fd, &h, sizeof(h), 0) == sizeof(h)) ? 0 : -1;
+}
+
+/* Open the overlay at path on top of base, creating it if it doesn't exist */
+struct overlay* overlay_open(int base, char* path) {
+	struct ext2_superblock sb;
+	if (pread(base, &sb, sizeof(sb), 1024) != sizeof(sb) || sb.magic != EXT2_MAGIC) {
+		printf("overlay: base is not an ext2 image\n");
+		return NULL;
+	}
+
+	struct overlay* ov = malloc(sizeof(struct overlay));
+	ov->base = base;
+	ov->block_size = 1024 << sb.log_block_size;
+	ov->blocks_count = sb.blocks_count;
+	ov->table = OVERLAY_HDR;
+	ov->data = ov->table + ((OVERLAY_MAP_BYTES(ov) + OVERLAY_HDR - 1) & ~(uint64_t) (OVERLAY_HDR - 1));
+	ov->map = calloc(OVERLAY_MAP_BYTES(ov), 1);
+	pthread_mutex_init(&ov->lock, NULL);
+
+	ov->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (ov->fd < 0) {
+		perror(path);
+		overlay_close(ov);
+		return NULL;
+	}
+
+	struct overlay_header h;
+	if (pread(ov->fd, &h, sizeof(h), 0) != sizeof(h)) {
+		/* New overlay: the table and data area are holes until written */
+		if (overlay_write_header(ov, sb.wtime) ||
+			ftruncate(ov->fd, ov->data + (uint64_t) ov->blocks_count * ov->block_size)) {
+			perror(path);
+			overlay_close(ov);
+			return NULL;
+		}
+		return ov;
+	}
+
+	if (memcmp(h.magic, OVERLAY_MAGIC, sizeof(h.magic)) || h.block_size != ov->block_size ||
+		h.blocks_count != ov->blocks_count || h.table != ov->table || h.data != ov->data) {
+		printf("%s: not an overlay for this image\n", path);
+		overlay_close(ov);
+		return NULL;
+	}
+	if (h.base_wtime != sb.wtime) {
+		printf("%s: base image changed since the overlay was created\n", path);
+		overlay_close(ov);
+		return NULL;
+	}
+	pread(ov->fd, ov->map, OVERLAY_MAP_BYTES(ov), ov->table);
+	return ov;
+}
+
+void overlay_close(struct overlay* ov) {
+	if (!ov)
+		return;
+	if (ov->fd >= 0)
+		close(ov->fd);
+	pthread_mutex_destroy(&ov->lock);
+	free(ov->map);
+	free(ov);
+}
+
+/* Read len bytes at image offset off, taking each block from the overlay if
+it has been written there and from the base otherwise */
+ssize_t overlay_read(struct overlay* ov, void* buf, size_t len, off_t off) {
+	char* p = buf;
+	size_t done = 0;
+
+	while (done < len) {
+		uint64_t pos = off + done;
+		uint32_t block = pos / ov->block_size;
+		int present = (block < ov->blocks_count) && OV_PRESENT(ov, block);
+
+		/* Extend over following blocks with the same source */
+		uint64_t end = (uint64_t) (block + 1) * ov->block_size;
+		while (end < off + len && end / ov->block_size < ov->blocks_count &&
+			!OV_PRESENT(ov, end / ov->block_size) == !present)
+			end += ov->block_size;
+		if (end > off + len)
+			end = off + len;
+
+		ssize_t n = (present) ? pread(ov->fd, p + done, end - pos, ov->data + pos)
+							  : pread(ov->base, p + done, end - pos, pos);
+		if (n <= 0)
+			return (done) ? done : n;
+		done += n;
+	}
+	return done;
+}
+
+/* Copy a block up from the base before a partial write lands on it */
+static int overlay_copy_up(struct overlay* ov, uint32_t block) {
+	char* tmp = malloc(ov->block_size);
+	uint64_t pos = (uint64_t) block * ov->block_size;
+	int ret = 0;
+	if (pread(ov->base, tmp, ov->block_size, pos) != ov->block_size ||
+		pwrite(ov->fd, tmp, ov->block_size, ov->data + pos) != ov->block_size)
+		ret = -1;
+	free(tmp);
+	return ret;
+}
+
+static void overlay_mark(struct overlay* ov, uint32_t block) {
+	pthread_mutex_lock(&ov->lock);
+	if (!OV_PRESENT(ov, block)) {
+		ov->map[block / 8] |= 1 << (block % 8);
+		pwrite(ov->fd, &ov->map[block / 8], 1, ov->table + block / 8);
+	}
+	pthread_mutex_unlock(&ov->lock);
+}
+
+/* Write len bytes at image offset off into the overlay. The base is never
+written. Data goes down before the block's bit is set, so a reader never
+sees a present block that isn't there yet */
+ssize_t overlay_write(struct overlay* ov, const void* buf, size_t len, off_t off) {
+	uint32_t first = off / ov->block_size;
+	uint32_t last = (off + len - 1) / ov->block_size;
+	if (last >= ov->blocks_count)
+		return -1;
+
+	/* Only the edge blocks can be partially covered */
+	if (off % ov->block_size && !OV_PRESENT(ov, first))
+		overlay_copy_up(ov, first);
+	if ((off + len) % ov->block_size && !OV_PRESENT(ov, last) && (last != first || !(off % ov->block_size)))
+		overlay_copy_up(ov, last);
+
+	ssize_t n = pwrite(ov->fd, buf, len, ov->data + off);
+	if (n != len)
+		return -1;
+	for (uint32_t b = first; b <= last; b++)
+		overlay_mark(ov, b);
+	return n;
+}
+
+/* Flush the overlay's data and block-index table to stable storage */
+int overlay_sync(struct overlay* ov) {
+	return fdatasync(ov->fd);
+}
+
+/* Fold every overlaid block back into the base, which must be open for
+writing, then empty the overlay */
+int overlay_commit(struct overlay* ov, int base) {
+	char* buf = malloc(OVERLAY_CHUNK);
+	uint32_t chunk = OVERLAY_CHUNK / ov->block_size;
+	uint32_t blocks = 0;
+	int ret = 0;
+
+	for (uint32_t b = 0; b < ov->blocks_count && !ret; ) {
+		if (!OV_PRESENT(ov, b)) {
+			b++;
+			continue;
+		}
+		uint32_t n = 1;
+		while (b + n < ov->blocks_count && n < chunk && OV_PRESENT(ov, b + n))
+			n++;
+
+		uint64_t pos = (uint64_t) b * ov->block_size;
+		size_t len = (size_t) n * ov->block_size;
+		if (pread(ov->fd, buf, len, ov->data + pos) != len || pwrite(base, buf, len, pos) != len)
+			ret = -1;
+		blocks += n;
+		b += n;
+	}
+	free(buf);
+
+	if (ret || fsync(base)) {
+		perror("overlay commit");
+		return -1;
+	}
+
+	/* The base now carries a new write time; rebind the empty overlay to it */
+	struct ext2_superblock sb;
+	pread(base, &sb, sizeof(sb), 1024);
+	memset(ov->map, 0, OVERLAY_MAP_BYTES(ov));
+	uint64_t size = ov->data + (uint64_t) ov->blocks_count * ov->block_size;
+	if (ftruncate(ov->fd, ov->table) || ftruncate(ov->fd, size) || overlay_write_header(ov, sb.wtime)) {
+		perror("overlay reset");
+		return -1;
+	}
+
+	printf("committed %u blocks\n", blocks);
+	return 0;
+}
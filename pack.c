@@ -0,0 +1,545 @@
+/*
+pack.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* Chunk-compressed image container.
+
+A packed image is the image cut into fixed-size chunks, each stored on its
+own: all-zero chunks not at all, others deflated with zlib, or as they are
+when deflating doesn't make them smaller. An index gives every chunk's
+offset and length in the file, so any block can be read by inflating only
+the chunk that holds it. ext2_mount recognises a packed image by its header
+and sends all I/O through here.
+
+Inflated chunks are kept in a small cache. Writes land in the cached chunk,
+which is deflated again and appended to the end of the file, the rewritten-
+chunk log, when it is evicted or the image is flushed; the copy it replaces
+is left where it was. The index is appended after the log on flush, and only
+then is the header pointed at it, so a packed image that is not flushed opens
+as it was before. Packing it again drops the superseded chunks.
+
+Packed file layout:
+	struct pack_header			(PACK_HDR bytes)
+	chunk data					(chunks in image order, then rewritten chunks)
+	chunk index					(struct pack_entry per chunk, at a PACK_HDR boundary)
+
+The header and index sit on page boundaries so they can be read while the
+image is still open with O_DIRECT; ext2_dio_init drops it afterwards.
+*/
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include <sys/stat.h>
+
+#define PACK_MAGIC	"E2PACK01"
+#define PACK_HDR	4096
+#define PACK_CHUNK	(64 << 10)	// Image bytes per chunk
+#define PACK_SLOTS	32			// Inflated chunks cached
+#define PACK_BATCH	256			// Chunks read and deflated per round when converting
+#define PACK_LEVEL	6			// zlib compression level
+
+#define PACK_NONE	UINT32_MAX
+
+enum { PACK_ZERO, PACK_RAW, PACK_ZLIB };
+
+struct pack_header {
+	char magic[8];
+	uint32_t chunk_size;
+	uint32_t chunks;
+	uint64_t image_size;
+	uint64_t index;				// Offset of the chunk index
+} __attribute__((packed));
+
+struct pack_entry {
+	uint64_t offset;
+	uint32_t length;			// Bytes stored, 0 for a zero chunk
+	uint32_t type;
+} __attribute__((packed));
+
+struct pack_slot {
+	uint32_t chunk;				// PACK_NONE when empty
+	int dirty;					// Changed since it was last stored
+	uint64_t used;
+	uint8_t* data;
+};
+
+struct pack {
+	pthread_mutex_t lock;
+	uint32_t chunk_size;
+	uint32_t chunks;
+	uint64_t image_size;
+	uint64_t end;				// Where the next rewritten chunk goes
+	struct pack_entry* index;
+	int index_dirty;
+	struct pack_slot slot[PACK_SLOTS];
+	uint8_t* zbuf;				// Deflate output for one chunk
+	uint64_t gen;				// Bumped whenever the index changes
+	uint64_t clock;
+
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t stored;			// Chunks appended to the log
+};
+
+static void* pack_alloc(size_t len) {
+	void* p;
+	return (posix_memalign(&p, PACK_HDR, len)) ? NULL : p;
+}
+
+static uint32_t pack_len(struct pack* p, uint32_t c) {
+	uint64_t left = p->image_size - (uint64_t) c * p->chunk_size;
+	return (left < p->chunk_size) ? left : p->chunk_size;
+}
+
+static int pack_zero(const uint8_t* src, uint32_t len) {
+	return src[0] == 0 && memcmp(src, src + 1, len - 1) == 0;
+}
+
+/* Decide how len bytes of chunk data are stored, filling in e's type and
+length. Returns the bytes to write: NULL for a zero chunk, the deflated
+copy in zbuf, or src itself */
+static const uint8_t* pack_deflate(const uint8_t* src, uint32_t len, uint8_t* zbuf, struct pack_entry* e) {
+	e->offset = 0;
+	e->length = 0;
+	e->type = PACK_ZERO;
+	if (pack_zero(src, len))
+		return NULL;
+
+	uLongf n = compressBound(len);
+	if (compress2(zbuf, &n, src, len, PACK_LEVEL) == Z_OK && n < len) {
+		e->type = PACK_ZLIB;
+		e->length = n;
+		return zbuf;
+	}
+	e->type = PACK_RAW;
+	e->length = len;
+	return src;
+}
+
+/* Read the chunk e describes into dst, len bytes once inflated */
+static int pack_inflate(int fd, struct pack_entry* e, uint8_t* dst, uint32_t len) {
+	if (e->type == PACK_ZERO) {
+		memset(dst, 0, len);
+		return 0;
+	}
+	if (e->type == PACK_RAW)
+		return (pread(fd, dst, len, e->offset) == len) ? 0 : -1;
+
+	uint8_t* src = malloc(e->length);
+	uLongf n = len;
+	int ret = (pread(fd, src, e->length, e->offset) == e->length &&
+		uncompress(dst, &n, src, e->length) == Z_OK && n == len) ? 0 : -1;
+	free(src);
+	return ret;
+}
+
+static int pack_write_header(int fd, uint32_t chunk_size, uint32_t chunks, uint64_t image_size, uint64_t index) {
+	struct pack_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, PACK_MAGIC, sizeof(h.magic));
+	h.chunk_size = chunk_size;
+	h.chunks = chunks;
+	h.image_size = image_size;
+	h.index = index;
+	return (pwrite(fd, &h, sizeof(h), 0) == sizeof(h)) ? 0 : -1;
+}
+
+/* Append the index at the next page boundary past end, make it durable,
+then switch the header over to it. Returns the new end of the file, or 0 */
+static uint64_t pack_write_index(int fd, struct pack_entry* index, uint32_t chunk_size, uint32_t chunks,
+	uint64_t image_size, uint64_t end) {
+	uint64_t at = (end + PACK_HDR - 1) & ~(uint64_t) (PACK_HDR - 1);
+	size_t bytes = (size_t) chunks * sizeof(struct pack_entry);
+	if (pwrite(fd, index, bytes, at) != bytes || fsync(fd) ||
+		pack_write_header(fd, chunk_size, chunks, image_size, at) || fsync(fd))
+		return 0;
+	return at + bytes;
+}
+
+static struct pack_slot* pack_find(struct pack* p, uint32_t c) {
+	for (int q = 0; q < PACK_SLOTS; q++)
+		if (p->slot[q].chunk == c)
+			return &p->slot[q];
+	return NULL;
+}
+
+/* Append a changed chunk to the log and point its index entry there */
+static int pack_store(struct ext2_fs *f, struct pack* p, struct pack_slot* s) {
+	struct pack_entry e;
+	const uint8_t* src = pack_deflate(s->data, pack_len(p, s->chunk), p->zbuf, &e);
+	if (src) {
+		if (pwrite(f->dev, src, e.length, p->end) != e.length)
+			return -1;
+		e.offset = p->end;
+		p->end += e.length;
+	}
+	p->index[s->chunk] = e;
+	p->index_dirty = 1;
+	p->gen++;
+	p->stored++;
+	s->dirty = 0;
+	return 0;
+}
+
+/* The slot holding chunk c, inflating it first unless fill is 0 because the
+caller is about to overwrite all of it. Called and returns with p->lock
+held; the lock is dropped while inflating. Returns NULL on a read error */
+static struct pack_slot* pack_get(struct ext2_fs *f, struct pack* p, uint32_t c, int fill) {
+	for (;;) {
+		struct pack_slot* s = pack_find(p, c);
+		if (s) {
+			p->hits++;
+			s->used = ++p->clock;
+			return s;
+		}
+
+		uint8_t* data = NULL;
+		if (fill) {
+			/* Superseded chunks are never overwritten, so the entry read
+			here stays valid; only a newer one can make it stale */
+			struct pack_entry e = p->index[c];
+			uint64_t gen = p->gen;
+			data = malloc(p->chunk_size);
+			pthread_mutex_unlock(&p->lock);
+			int err = pack_inflate(f->dev, &e, data, pack_len(p, c));
+			pthread_mutex_lock(&p->lock);
+			if (err) {
+				free(data);
+				return NULL;
+			}
+			if (gen != p->gen || pack_find(p, c)) {
+				free(data);
+				continue;
+			}
+		}
+
+		s = &p->slot[0];
+		for (int q = 1; q < PACK_SLOTS && s->chunk != PACK_NONE; q++)
+			if (p->slot[q].chunk == PACK_NONE || p->slot[q].used < s->used)
+				s = &p->slot[q];
+		if (s->dirty && pack_store(f, p, s)) {
+			free(data);
+			return NULL;
+		}
+		if (data) {
+			free(s->data);
+			s->data = data;
+		}
+		p->misses++;
+		s->chunk = c;
+		s->used = ++p->clock;
+		return s;
+	}
+}
+
+/* Recognise a packed image on f->dev and load its index. Returns 0 if the
+image is packed or plain, -1 if it is packed but damaged */
+int ext2_pack_init(struct ext2_fs *f) {
+	f->pack = NULL;
+	uint8_t* hdr = pack_alloc(PACK_HDR);
+	struct pack_header h;
+	if (pread(f->dev, hdr, PACK_HDR, 0) < (ssize_t) sizeof(h) || memcmp(hdr, PACK_MAGIC, sizeof(h.magic))) {
+		free(hdr);
+		return 0;
+	}
+	memcpy(&h, hdr, sizeof(h));
+	free(hdr);
+
+	struct stat st;
+	size_t bytes = (size_t) h.chunks * sizeof(struct pack_entry);
+	if (h.chunk_size < 1024 || h.chunk_size & (h.chunk_size - 1) || !h.image_size ||
+		h.chunks != (h.image_size + h.chunk_size - 1) / h.chunk_size || h.index % PACK_HDR ||
+		fstat(f->dev, &st) || h.index + bytes > st.st_size) {
+		printf("packed image: bad header\n");
+		return -1;
+	}
+
+	struct pack* p = calloc(1, sizeof(struct pack));
+	pthread_mutex_init(&p->lock, NULL);
+	p->chunk_size = h.chunk_size;
+	p->chunks = h.chunks;
+	p->image_size = h.image_size;
+	p->end = st.st_size;
+	p->index = pack_alloc((bytes + PACK_HDR - 1) & ~(size_t) (PACK_HDR - 1));
+	p->zbuf = malloc(compressBound(p->chunk_size));
+	for (int q = 0; q < PACK_SLOTS; q++) {
+		p->slot[q].chunk = PACK_NONE;
+		p->slot[q].data = malloc(p->chunk_size);
+	}
+	f->pack = p;
+
+	int bad = pread(f->dev, p->index, (bytes + PACK_HDR - 1) & ~(size_t) (PACK_HDR - 1), h.index) < (ssize_t) bytes;
+	for (uint32_t c = 0; c < p->chunks && !bad; c++) {
+		struct pack_entry* e = &p->index[c];
+		bad = e->type > PACK_ZLIB || e->offset + e->length > st.st_size ||
+			(e->type == PACK_RAW && e->length != pack_len(p, c));
+	}
+	if (bad) {
+		printf("packed image: bad chunk index\n");
+		ext2_pack_release(f);
+		return -1;
+	}
+	return 0;
+}
+
+/* Store every changed chunk and commit a new index */
+int ext2_pack_flush(struct ext2_fs *f) {
+	struct pack* p = f->pack;
+	if (!p)
+		return 0;
+	int ret = 0;
+	pthread_mutex_lock(&p->lock);
+	for (int q = 0; q < PACK_SLOTS && !ret; q++)
+		if (p->slot[q].dirty)
+			ret = pack_store(f, p, &p->slot[q]);
+	if (!ret && p->index_dirty) {
+		uint64_t end = pack_write_index(f->dev, p->index, p->chunk_size, p->chunks, p->image_size, p->end);
+		if (end) {
+			p->end = end;
+			p->index_dirty = 0;
+		} else
+			ret = -1;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return ret;
+}
+
+void ext2_pack_release(struct ext2_fs *f) {
+	struct pack* p = f->pack;
+	if (!p)
+		return;
+	if (ext2_pack_flush(f))
+		perror("packed image flush");
+	for (int q = 0; q < PACK_SLOTS; q++)
+		free(p->slot[q].data);
+	pthread_mutex_destroy(&p->lock);
+	free(p->index);
+	free(p->zbuf);
+	free(p);
+	f->pack = NULL;
+}
+
+ssize_t ext2_pack_read(struct ext2_fs *f, void* buf, size_t len, uint64_t off) {
+	struct pack* p = f->pack;
+	if (off >= p->image_size)
+		return 0;
+	if (len > p->image_size - off)
+		len = p->image_size - off;
+
+	size_t done = 0;
+	pthread_mutex_lock(&p->lock);
+	while (done < len) {
+		uint64_t pos = off + done;
+		uint32_t at = pos % p->chunk_size;
+		size_t n = (p->chunk_size - at < len - done) ? p->chunk_size - at : len - done;
+		struct pack_slot* s = pack_get(f, p, pos / p->chunk_size, 1);
+		if (!s)
+			break;
+		memcpy((char*) buf + done, s->data + at, n);
+		done += n;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return (done) ? done : -1;
+}
+
+ssize_t ext2_pack_write(struct ext2_fs *f, const void* buf, size_t len, uint64_t off) {
+	struct pack* p = f->pack;
+	if (off + len > p->image_size)
+		return -1;
+
+	size_t done = 0;
+	pthread_mutex_lock(&p->lock);
+	while (done < len) {
+		uint64_t pos = off + done;
+		uint32_t c = pos / p->chunk_size;
+		uint32_t at = pos % p->chunk_size;
+		size_t n = (p->chunk_size - at < len - done) ? p->chunk_size - at : len - done;
+		struct pack_slot* s = pack_get(f, p, c, at || n < pack_len(p, c));
+		if (!s)
+			break;
+		memcpy(s->data + at, (const char*) buf + done, n);
+		s->dirty = 1;
+		done += n;
+	}
+	pthread_mutex_unlock(&p->lock);
+	return (done == len) ? done : -1;
+}
+
+void ext2_pack_stats(struct ext2_fs *f) {
+	struct pack* p = f->pack;
+	if (!p)
+		return;
+	pthread_mutex_lock(&p->lock);
+	uint64_t reads = p->hits + p->misses;
+	printf("packed image: %u chunks of %u KiB, %llu chunk reads, %llu hits (%.1f%%), %llu chunks rewritten\n",
+		p->chunks, p->chunk_size / 1024, (unsigned long long) reads, (unsigned long long) p->hits,
+		(reads) ? 100.0 * p->hits / reads : 0.0, (unsigned long long) p->stored);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* One round of a conversion: workers read and deflate chunks first to
+first + count into their own slots, which are then written out in order */
+struct pack_job {
+	struct ext2_fs* f;
+	int packed;
+	uint32_t chunk_size;
+	uint32_t bound;				// Deflate output room per chunk
+	uint64_t image_size;
+	uint32_t first;
+	uint32_t count;
+	uint8_t* raw;				// count * chunk_size
+	uint8_t* z;					// count * bound
+	struct pack_entry* e;		// Entry for each chunk of the round
+	const uint8_t** out;		// Bytes to write for each, NULL for zero
+
+	pthread_mutex_t lock;
+	uint32_t next;
+	int errors;
+};
+
+static void* pack_worker(void* arg) {
+	struct pack_job* job = arg;
+	struct ext2_fs* f = job->f;
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		uint32_t q = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (q >= job->count)
+			break;
+
+		uint64_t pos = (uint64_t) (job->first + q) * job->chunk_size;
+		uint32_t len = (job->image_size - pos < job->chunk_size) ? job->image_size - pos : job->chunk_size;
+		uint8_t* raw = job->raw + (size_t) q * job->chunk_size;
+		if (buffer_read_blocks(f, pos / f->block_size, len / f->block_size, raw) < 0) {
+			pthread_mutex_lock(&job->lock);
+			job->errors++;
+			pthread_mutex_unlock(&job->lock);
+			continue;
+		}
+		if (job->packed)
+			job->out[q] = pack_deflate(raw, len, job->z + (size_t) q * job->bound, &job->e[q]);
+		else {
+			job->e[q].length = len;
+			job->out[q] = (pack_zero(raw, len)) ? NULL : raw;
+		}
+	}
+	return NULL;
+}
+
+/* Copy the mounted image to path, as a packed image if packed is set and as
+a plain one otherwise. Zero chunks take no space in either */
+int ext2_pack_convert(struct ext2_fs *f, char* path, int packed, int workers) {
+	struct stat src, dst;
+	int fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0) {
+		perror(path);
+		return -1;
+	}
+	if (fstat(f->dev, &src) == 0 && fstat(fd, &dst) == 0 && src.st_dev == dst.st_dev && src.st_ino == dst.st_ino) {
+		printf("%s: is the image being converted\n", path);
+		close(fd);
+		return -1;
+	}
+	ftruncate(fd, 0);
+
+	struct pack_job job;
+	memset(&job, 0, sizeof(job));
+	job.f = f;
+	job.packed = packed;
+	job.chunk_size = PACK_CHUNK;
+	job.bound = compressBound(PACK_CHUNK);
+	job.image_size = (uint64_t) f->sb->blocks_count * f->block_size;
+	pthread_mutex_init(&job.lock, NULL);
+
+	uint32_t chunks = (job.image_size + PACK_CHUNK - 1) / PACK_CHUNK;
+	struct pack_entry* index = pack_alloc((size_t) chunks * sizeof(struct pack_entry) + PACK_HDR);
+	job.raw = malloc((size_t) PACK_BATCH * PACK_CHUNK);
+	job.z = malloc((size_t) PACK_BATCH * job.bound);
+	job.out = malloc(PACK_BATCH * sizeof(uint8_t*));
+	if (workers < 1)
+		workers = 1;
+	pthread_t* threads = malloc(workers * sizeof(pthread_t));
+
+	uint64_t end = PACK_HDR;
+	uint64_t stored = 0;
+	uint32_t zero = 0;
+	for (job.first = 0; job.first < chunks && !job.errors; job.first += job.count) {
+		job.count = (chunks - job.first < PACK_BATCH) ? chunks - job.first : PACK_BATCH;
+		job.e = &index[job.first];
+		job.next = 0;
+		for (int q = 0; q < workers; q++)
+			pthread_create(&threads[q], NULL, pack_worker, &job);
+		for (int q = 0; q < workers; q++)
+			pthread_join(threads[q], NULL);
+
+		for (uint32_t q = 0; q < job.count && !job.errors; q++) {
+			struct pack_entry* e = &job.e[q];
+			if (!job.out[q]) {
+				zero++;
+				continue;
+			}
+			uint64_t at = (packed) ? end : (uint64_t) (job.first + q) * PACK_CHUNK;
+			if (pwrite(fd, job.out[q], e->length, at) != e->length) {
+				perror(path);
+				job.errors++;
+			}
+			e->offset = at;
+			end += e->length;
+			stored += e->length;
+		}
+	}
+
+	if (!job.errors) {
+		if (packed)
+			end = pack_write_index(fd, index, PACK_CHUNK, chunks, job.image_size, end);
+		else
+			end = (ftruncate(fd, job.image_size) || fsync(fd)) ? 0 : job.image_size;
+		if (!end) {
+			perror(path);
+			job.errors++;
+		}
+	}
+	if (!job.errors)
+		printf("%s: %llu image bytes, %llu bytes stored, %u of %u chunks zero\n", path,
+			(unsigned long long) job.image_size, (unsigned long long) stored, zero, chunks);
+
+	free(threads);
+	free(job.out);
+	free(job.z);
+	free(job.raw);
+	free(index);
+	pthread_mutex_destroy(&job.lock);
+	close(fd);
+	return (job.errors) ? -1 : 0;
+}
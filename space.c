@@ -0,0 +1,430 @@
+/*
+space.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* Resident free-space summary.
+
+Each group's block and inode bitmap is read once and then kept in memory.
+For each group the summary also holds its largest run of free bits, and a
+max tree over the groups' largest runs answers "first group at or after g
+with a free run of len" in O(log n). Allocation and freeing go through
+here, so searching for space never reads a bitmap twice. A changed bitmap
+is only marked dirty, and written out by ext2_space_flush from ext2_sync or
+at unmount, so a burst of allocations in one group writes its bitmap once.
+
+The largest run is kept up to date in place as bits are taken from it or
+freed next to it. It may then understate the group's true largest run, but
+it is always a real free run, and empty only when the group is full: once
+it has shrunk to nothing or to half of what the last full scan found, the
+group is scanned again.
+
+Images of up to SPACE_EAGER_GROUPS groups have every bitmap read at mount,
+by several threads at once. Larger ones start from the free counts in the
+group descriptors, which bound each group's largest run from above, and
+read a group's bitmaps the first time a search or an update reaches it.
+Mounting then costs the same however large the image is.
+
+Callers hold ext2_acquire_fs for everything but loading and releasing. */
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define SPACE_LOAD_THREADS	16		// Most bitmap readers at mount
+#define SPACE_LOAD_GROUPS	32		// Fewest groups worth a thread
+#define SPACE_RUN_MIN		16		// Smallest file placed by free run
+#define SPACE_EAGER_GROUPS	1024	// Most groups loaded in full at mount
+
+struct space_map {
+	int inodes;				// Inode bitmaps rather than block bitmaps
+	int groups;
+	uint32_t bits;			// Bits in each group but perhaps the last
+	uint32_t last_bits;
+	uint8_t** bitmap;		// One block per group, NULL until read
+	uint32_t* run_start;	// Largest free run of each group
+	uint32_t* run_len;
+	uint32_t* run_scan;		// run_len as the last full scan found it
+	uint8_t* dirty;			// Bitmaps changed since the last flush, a bit each
+	uint32_t size;			// Leaves of the tree, a power of two
+	uint32_t* tree;			// Leaf g at size + g; inner nodes hold the max below
+};
+
+struct space_load {
+	struct ext2_fs* f;
+	pthread_mutex_t lock;
+	int next;				// Next group to read
+	int errors;
+};
+
+static void space_scan(struct ext2_fs *f, struct space_map* m, int g);
+static void space_tree_update(struct space_map* m, int g);
+
+static uint32_t space_group_bits(struct space_map* m, int g) {
+	return (g == m->groups - 1) ? m->last_bits : m->bits;
+}
+
+/* Read group g's bitmap and find its largest run. Bits past the end of the
+group count as used, whatever the image says. A bitmap that can't be read
+is taken as full, so nothing is allocated from it */
+static int space_load_group(struct ext2_fs *f, struct space_map* m, int g) {
+	uint8_t* b = malloc(f->block_size);
+	uint32_t block = (m->inodes) ? f->bg[g].inode_bitmap : f->bg[g].block_bitmap;
+	int ret = 0;
+	if (buffer_read_blocks(f, block, 1, b) != f->block_size) {
+		printf("group %d: could not read %s bitmap\n", g, (m->inodes) ? "inode" : "block");
+		memset(b, 0xff, f->block_size);
+		ret = -1;
+	}
+	for (uint32_t bit = space_group_bits(m, g); bit < f->block_size * 8; bit++)
+		b[bit / 8] |= 1 << (bit % 8);
+	m->bitmap[g] = b;
+	space_scan(f, m, g);
+	return ret;
+}
+
+uint8_t* ext2_space_bitmap(struct ext2_fs *f, struct space_map* m, int g) {
+	if (!m->bitmap[g]) {
+		space_load_group(f, m, g);
+		space_tree_update(m, g);
+	}
+	return m->bitmap[g];
+}
+
+static void space_tree_update(struct space_map* m, int g) {
+	uint32_t q = m->size + g;
+	m->tree[q] = m->run_len[g];
+	for (q /= 2; q; q /= 2) {
+		uint32_t a = m->tree[2 * q], b = m->tree[2 * q + 1];
+		m->tree[q] = (a > b) ? a : b;
+	}
+}
+
+/* Find group g's largest free run. Whole words of free or used bits are
+taken at once */
+static void space_scan(struct ext2_fs *f, struct space_map* m, int g) {
+	uint8_t* b = m->bitmap[g];
+	uint32_t n = space_group_bits(m, g);
+	uint32_t best = 0, best_start = 0, run = 0;
+
+	for (uint32_t q = 0; q < n; ) {
+		if (q % 64 == 0 && q + 64 <= n) {
+			uint64_t w;
+			memcpy(&w, b + q / 8, sizeof(w));
+			if (w == 0) {
+				run += 64;
+				q += 64;
+				continue;
+			}
+			if (w == ~0ULL) {
+				if (run > best) {
+					best = run;
+					best_start = q - run;
+				}
+				run = 0;
+				q += 64;
+				continue;
+			}
+		}
+		if (b[q / 8] & (1 << (q % 8))) {
+			if (run > best) {
+				best = run;
+				best_start = q - run;
+			}
+			run = 0;
+		} else
+			run++;
+		q++;
+	}
+	if (run > best) {
+		best = run;
+		best_start = n - run;
+	}
+
+	m->run_start[g] = best_start;
+	m->run_len[g] = best;
+	m->run_scan[g] = best;
+}
+
+/* First leaf at or after lo under node q, covering [l, r), whose run is at
+least len */
+static int space_tree_first(struct space_map* m, uint32_t q, uint32_t l, uint32_t r, uint32_t lo, uint32_t len) {
+	if (r <= lo || m->tree[q] < len)
+		return -1;
+	if (r - l == 1)
+		return l;
+	uint32_t mid = (l + r) / 2;
+	int g = space_tree_first(m, 2 * q, l, mid, lo, len);
+	return (g >= 0) ? g : space_tree_first(m, 2 * q + 1, mid, r, lo, len);
+}
+
+/* First group at or after g, wrapping round, with a free run of at least
+len bits. Returns -1 when there is none. A group not read yet only has an
+upper bound for its run, so it is read and the search repeated */
+int ext2_space_find(struct ext2_fs *f, struct space_map* m, int g, uint32_t len) {
+	if (len < 1)
+		len = 1;
+	for (;;) {
+		int found = space_tree_first(m, 1, 0, m->size, g, len);
+		if (found < 0 && g > 0)
+			found = space_tree_first(m, 1, 0, m->size, 0, len);
+		if (found < 0 || found >= m->groups)
+			return -1;
+		if (m->bitmap[found])
+			return found;
+		ext2_space_bitmap(f, m, found);
+	}
+}
+
+/* Largest free run of group g, as its first bit and length */
+uint32_t ext2_space_run(struct space_map* m, int g, uint32_t* start) {
+	*start = m->run_start[g];
+	return m->run_len[g];
+}
+
+/* Where to start laying out a new file of count blocks that would like to
+live in group g. Small files pack in from the group's data start; larger
+ones go to the first free run from g on that holds them whole, so they are
+not split across the holes early in a group */
+uint32_t ext2_space_goal(struct ext2_fs *f, int g, uint32_t count) {
+	struct ext2_superblock* s = f->sb;
+	struct space_map* m = f->bmap;
+	uint32_t goal = ext2_group_data_start(f, g);
+	if (count < SPACE_RUN_MIN)
+		return goal;
+	if (count > m->bits / 2)
+		count = m->bits / 2;
+
+	ext2_acquire_fs(f);
+	int h = ext2_space_find(f, m, g, count);
+	if (h >= 0)
+		goal = s->first_data_block + h * s->blocks_per_group + m->run_start[h];
+	ext2_release_fs(f);
+	return goal;
+}
+
+/* Mark group g's bitmap for the next flush and rescan its summary, after
+the caller changed bits in it directly */
+void ext2_space_sync_group(struct ext2_fs *f, struct space_map* m, int g) {
+	ext2_space_bitmap(f, m, g);
+	m->dirty[g / 8] |= 1 << (g % 8);
+	space_scan(f, m, g);
+	space_tree_update(m, g);
+}
+
+/* Set bit of group g used or free. The free counts are the caller's.
+Taking a bit from the largest run keeps the larger side of it, and freeing
+a bit grows the run it joins, if that run is now the largest; neither needs
+a scan of the group */
+void ext2_space_mark(struct ext2_fs *f, struct space_map* m, int g, uint32_t bit, int used) {
+	uint8_t* b = ext2_space_bitmap(f, m, g);
+	uint32_t start = m->run_start[g];
+	uint32_t end = start + m->run_len[g];
+	m->dirty[g / 8] |= 1 << (g % 8);
+
+	if (used) {
+		b[bit / 8] |= 1 << (bit % 8);
+		if (bit < start || bit >= end)
+			return;
+		if (bit - start >= end - bit - 1)
+			end = bit;
+		else
+			start = bit + 1;
+	} else {
+		b[bit / 8] &= ~(1 << (bit % 8));
+		uint32_t lo = bit, hi = bit + 1;
+		while (lo > 0 && !(b[(lo - 1) / 8] & (1 << ((lo - 1) % 8))))
+			lo--;
+		while (hi < space_group_bits(m, g) && !(b[hi / 8] & (1 << (hi % 8))))
+			hi++;
+		if (hi - lo <= end - start)
+			return;
+		start = lo;
+		end = hi;
+		if (end - start > m->run_scan[g])
+			m->run_scan[g] = end - start;
+	}
+
+	m->run_start[g] = start;
+	m->run_len[g] = end - start;
+	if (!m->run_len[g] || m->run_len[g] < m->run_scan[g] / 2)
+		space_scan(f, m, g);
+	space_tree_update(m, g);
+}
+
+/* Write out every bitmap changed since the last flush */
+void ext2_space_flush(struct ext2_fs *f) {
+	struct space_map* maps[2] = { f->bmap, f->imap };
+	for (int q = 0; q < 2; q++) {
+		struct space_map* m = maps[q];
+		if (!m)
+			continue;
+		for (int g = 0; g < m->groups; g++) {
+			if (!(m->dirty[g / 8] & (1 << (g % 8))))
+				continue;
+			m->dirty[g / 8] &= ~(1 << (g % 8));
+			uint32_t block = (m->inodes) ? f->bg[g].inode_bitmap : f->bg[g].block_bitmap;
+			buffer_write_blocks(f, block, 1, m->bitmap[g]);
+		}
+	}
+}
+
+static struct space_map* space_new(struct ext2_fs *f, int inodes) {
+	struct ext2_superblock* s = f->sb;
+	struct space_map* m = calloc(1, sizeof(struct space_map));
+	m->inodes = inodes;
+	m->groups = f->num_bg;
+	if (inodes) {
+		m->bits = m->last_bits = s->inodes_per_group;
+	} else {
+		m->bits = s->blocks_per_group;
+		m->last_bits = s->blocks_count - s->first_data_block - (f->num_bg - 1) * s->blocks_per_group;
+	}
+	m->bitmap = calloc(f->num_bg, sizeof(uint8_t*));
+	m->run_start = calloc(f->num_bg, sizeof(uint32_t));
+	m->run_len = calloc(f->num_bg, sizeof(uint32_t));
+	m->run_scan = calloc(f->num_bg, sizeof(uint32_t));
+	m->dirty = calloc((f->num_bg + 7) / 8, 1);
+	for (m->size = 1; m->size < f->num_bg; m->size *= 2)
+		;
+	m->tree = calloc(2 * m->size, sizeof(uint32_t));
+
+	/* Until a group is read, its free count stands in for its largest run */
+	for (int g = 0; g < f->num_bg; g++)
+		m->tree[m->size + g] = (inodes) ? f->bg[g].free_inodes_count : f->bg[g].free_blocks_count;
+	return m;
+}
+
+static void space_tree_build(struct space_map* m) {
+	for (uint32_t n = m->size - 1; n > 0; n--) {
+		uint32_t a = m->tree[2 * n], b = m->tree[2 * n + 1];
+		m->tree[n] = (a > b) ? a : b;
+	}
+}
+
+static void space_free(struct space_map* m) {
+	if (!m)
+		return;
+	for (int g = 0; g < m->groups; g++)
+		free(m->bitmap[g]);
+	free(m->bitmap);
+	free(m->run_start);
+	free(m->run_len);
+	free(m->run_scan);
+	free(m->dirty);
+	free(m->tree);
+	free(m);
+}
+
+static void* space_load_worker(void* arg) {
+	struct space_load* job = arg;
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		int g = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (g >= job->f->num_bg)
+			break;
+
+		/* Each reader only fills in its own groups' leaves */
+		int err = 0;
+		struct space_map* maps[2] = { job->f->bmap, job->f->imap };
+		for (int q = 0; q < 2; q++) {
+			err |= space_load_group(job->f, maps[q], g);
+			maps[q]->tree[maps[q]->size + g] = maps[q]->run_len[g];
+		}
+		if (err) {
+			pthread_mutex_lock(&job->lock);
+			job->errors++;
+			pthread_mutex_unlock(&job->lock);
+		}
+	}
+	return NULL;
+}
+
+/* Forget the summary without writing anything back */
+static void space_drop(struct ext2_fs *f) {
+	space_free(f->bmap);
+	space_free(f->imap);
+	f->bmap = NULL;
+	f->imap = NULL;
+}
+
+/* Build the summary. When every group is read up front, groups are handed
+out one at a time to a few reader threads, and the inner nodes of the tree
+are built once they are done. A summary already loaded is dropped unwritten,
+as reloading means the bitmaps on disk were replaced underneath it */
+int ext2_space_load(struct ext2_fs *f) {
+	space_drop(f);
+	f->bmap = space_new(f, 0);
+	f->imap = space_new(f, 1);
+	if (f->num_bg > SPACE_EAGER_GROUPS) {
+		space_tree_build(f->bmap);
+		space_tree_build(f->imap);
+		return 0;
+	}
+
+	struct space_load job;
+	job.f = f;
+	job.next = 0;
+	job.errors = 0;
+	pthread_mutex_init(&job.lock, NULL);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = f->num_bg / SPACE_LOAD_GROUPS;
+	if (threads > cpus)
+		threads = cpus;
+	if (threads > SPACE_LOAD_THREADS)
+		threads = SPACE_LOAD_THREADS;
+
+	if (threads <= 1)
+		space_load_worker(&job);
+	else {
+		pthread_t* t = malloc(threads * sizeof(pthread_t));
+		for (int q = 0; q < threads; q++)
+			pthread_create(&t[q], NULL, space_load_worker, &job);
+		for (int q = 0; q < threads; q++)
+			pthread_join(t[q], NULL);
+		free(t);
+	}
+	pthread_mutex_destroy(&job.lock);
+
+	space_tree_build(f->bmap);
+	space_tree_build(f->imap);
+
+	if (job.errors) {
+		space_drop(f);
+		return -1;
+	}
+	return 0;
+}
+
+/* Drop the summary, writing out any bitmaps still dirty first */
+void ext2_space_release(struct ext2_fs *f) {
+	ext2_space_flush(f);
+	space_drop(f);
+}
@@ -3,90 +3,125 @@
 #include "ext2.h"
 #include <stdio.h>
 
-/* Core virtual filesystem abstraction layer */
-
-
-struct filesystem* device_list = NULL;
-
-void acquire_fs(struct ext2_fs *f) {
+/* Mounting, the superblock write-back and path lookup. Everything a mount
+needs lives in its struct ext2_fs; there is no process-wide state */
 
+void ext2_acquire_fs(struct ext2_fs *f) {
+	pthread_mutex_lock(&f->mutex);
 }
 
-void release_fs(struct ext2_fs *f) {
-
+void ext2_release_fs(struct ext2_fs *f) {
+	pthread_mutex_unlock(&f->mutex);
 }
 
-void sync(struct ext2_fs *f) {
+/* Write the dirty bitmaps, the superblock and the group descriptors. In
+ordered mode a barrier goes first, so they never reach the disk ahead of the
+blocks they account for; in per-operation mode a flush follows, so the image
+is durable when ext2_sync() returns. Neither is done holding the filesystem
+lock */
+void ext2_sync(struct ext2_fs *f) {
+	ext2_barrier(f);
+	ext2_acquire_fs(f);
+	ext2_space_flush(f);
 	f->sb->wtime = time(NULL);
 	ext2_superblock_write(f);
 	ext2_blockdesc_write(f);
+	ext2_release_fs(f);
+	if (f->durability == EXT2_DURABLE_OP)
+		ext2_flush(f);
 }
 
-struct ext2_fs* ext2_mount(int dev) {
+/* Mount the image open on file descriptor dev, reading and writing through
+ov if it is not NULL. dev may hold a packed image. Returns NULL if dev does
+not hold an ext2 filesystem */
+struct ext2_fs* ext2_mount(int dev, struct overlay* ov) {
 	struct ext2_fs* efs = malloc(sizeof(struct ext2_fs));
-	struct filesystem vfs;
 
 	efs->dev = dev;
 	efs->block_size = 1024;
 	efs->sb = NULL;
 	efs->bg = NULL;
-
-	strcpy(vfs.mount, ROOT_NAME);
-	vfs.type = EXT2;
-	vfs.data.fs = efs;
-	vfs.dev = dev;
-
-	fs_dev_register(dev, &vfs);
-	ext2_superblock_read(efs);
-
-	ext2_blockdesc_read(efs);
-
-	bg_dump(efs);
-
-	return efs;
-}
-
-int fs_dev_register(int dev, struct filesystem* f) {
-	if (dev >= MAX_DEVICES || !device_list)
-		return -1;
-	device_list[dev] = *f;
-}
-void fs_dev_init() {
-	if (device_list)
-		return;
-	device_list = malloc(sizeof(struct filesystem) * MAX_DEVICES);
-}
-
-/* Virtual filesystem layer. Search through the mount point list.
-If the mount name is not found, default to root */
-struct filesystem* fs_dev_from_mount(char* mount) {
-	if (!device_list)
+	efs->bg_dirty = NULL;
+	efs->overlay = ov;
+	efs->dirs = NULL;
+	efs->rsv = NULL;
+	efs->bmap = NULL;
+	efs->imap = NULL;
+	efs->cache = NULL;
+	efs->direct = 0;
+	efs->dio = NULL;
+	efs->pack = NULL;
+	efs->durability = EXT2_DURABLE_NONE;
+	efs->unflushed = 0;
+	efs->flushes = 0;
+	pthread_mutex_init(&efs->mutex, NULL);
+	pthread_mutex_init(&efs->dir_lock, NULL);
+
+	if (ext2_pack_init(efs)) {
+		ext2_umount(efs);
+		return NULL;
+	}
+	ext2_dio_init(efs);
+	if (ext2_superblock_read(efs)) {
+		ext2_umount(efs);
 		return NULL;
-	for (int i = 0; i < MAX_DEVICES; i++)
-		if (strcmp(device_list[i].mount, mount) == 0)
-			return &device_list[i];
-	return fs_dev_from_mount(ROOT_NAME);
+	}
+	efs->cache = ext2_cache_init(efs);
+	if (ext2_blockdesc_read(efs) || ext2_space_load(efs)) {
+		ext2_umount(efs);
+		return NULL;
+	}
+	return efs;
 }
 
-void trav_device_list() {
-	if (!device_list)
-		return NULL;
-	for (int i = 0; i < MAX_DEVICES; i++)
-		printf("device %d: %s\ttype: %d\tfs: %x\n", i, device_list[i].mount, device_list[i].type, device_list[i].data);
+/* Release a mounted image. The descriptor and overlay stay open; they belong
+to the caller */
+void ext2_umount(struct ext2_fs *f) {
+	ext2_dir_forget(f, 0);
+	ext2_unreserve(f, 0);
+	ext2_space_release(f);
+	ext2_cache_release(f);
+	ext2_dio_release(f);
+	ext2_pack_release(f);
+	pthread_mutex_destroy(&f->dir_lock);
+	pthread_mutex_destroy(&f->mutex);
+	free(f->sb);
+	free(f->bg);
+	free(f->bg_dirty);
+	free(f);
 }
 
 /* Returns inode of file in a path /usr/sbin/file.c would return the inode
 number of file.c, or -1 if any member of the path cannot be found */
-int pathize(struct ext2_fs* f, char* path) {
+int ext2_pathize(struct ext2_fs* f, char* path) {
 
 	
-	char* pch = strtok(path, "/");
+	char* save;
+	char* pch = strtok_r(path, "/", &save);
 
 	int parent = 2;
 	while(pch) {
 		parent = ext2_find_child(f, pch, parent);
 		//printf("%s inode: %i\n", pch, parent);
-		pch = strtok(NULL, "/");
+		pch = strtok_r(NULL, "/", &save);
 	}
 	return parent;
 }
+
+/* Resolves every component of path but the last, returning the inode of the
+containing directory. name is pointed at the last component, inside path */
+int ext2_pathize_parent(struct ext2_fs* f, char* path, char** name) {
+	while (strlen(path) > 1 && path[strlen(path) - 1] == '/')
+		path[strlen(path) - 1] = '\0';
+
+	char* slash = strrchr(path, '/');
+	if (!slash) {
+		*name = path;
+		return 2;
+	}
+	*name = slash + 1;
+	if (slash == path)
+		return 2;
+	*slash = '\0';
+	return ext2_pathize(f, path);
+}
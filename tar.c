@@ -0,0 +1,674 @@
+/*
+tar.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* Streaming import of a tar archive (ustar, pax and GNU long names) into the
+image.
+
+The archive is read once, front to back, from a file descriptor that can be
+a pipe. Every entry is created in the image as its header goes by, and file
+data is written through a 1 MiB buffer straight into the new inode, so no
+file is ever held whole in memory or staged on the host. Each file keeps a
+preallocation window while it is written, so it stays contiguous.
+
+Metadata commits are deferred: the superblock and group descriptors are only
+written every TAR_SYNC_BYTES of data and at the end, instead of once per
+file, and directory attributes are applied after the last entry, since adding
+entries to a directory would otherwise change its times again. Missing
+parent directories are created on the way. */
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#define TAR_BLOCK		512
+#define TAR_CHUNK		(1 << 20)	// Input buffer, and the most data written at once
+#define TAR_SYNC_BYTES	(64 << 20)	// Data imported between superblock writes
+
+/* Entry types followed by file data */
+#define TAR_DATA(t)		((t) == '0' || (t) == '\0' || (t) == '7')
+
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+} __attribute__((packed));
+
+/* Values a pax header ('x' for the next entry, 'g' for all that follow) or
+a GNU long name entry sets in place of the ustar fields */
+struct tar_attrs {
+	char* path;
+	char* link;
+	uint64_t size;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t mtime;
+	int has_size;
+	int has_uid;
+	int has_gid;
+	int has_mtime;
+};
+
+/* Directory attributes, applied once every entry is in */
+struct tar_dir {
+	uint32_t inode;
+	uint16_t mode;
+	uint16_t uid;
+	uint16_t gid;
+	uint32_t mtime;
+};
+
+struct tar_job {
+	struct ext2_fs* f;
+	int fd;
+	char* in;					// Buffered input
+	size_t in_len;
+	size_t in_pos;
+	uint64_t consumed;			// Archive bytes read so far
+	char* chunk;				// File data on its way to the image
+
+	int root;					// Image directory the archive is unpacked into
+	char* cached_dir;			// Last parent resolved, relative to root
+	int cached_inode;
+
+	struct tar_attrs local;
+	struct tar_attrs global;
+
+	struct tar_dir* dirs;
+	int ndirs;
+	int dirs_size;
+
+	int files;
+	int dir_count;
+	int symlinks;
+	int links;
+	int skipped;
+	int errors;
+	uint64_t bytes;
+	uint64_t unsynced;
+};
+
+/* Read exactly n bytes of the archive, or fewer at its end */
+static size_t tar_read(struct tar_job* job, char* dst, size_t n) {
+	size_t done = 0;
+	while (done < n) {
+		if (job->in_pos == job->in_len) {
+			ssize_t r = read(job->fd, job->in, TAR_CHUNK);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				break;
+			job->in_len = r;
+			job->in_pos = 0;
+		}
+		size_t len = job->in_len - job->in_pos;
+		if (len > n - done)
+			len = n - done;
+		if (dst)
+			memcpy(dst + done, job->in + job->in_pos, len);
+		job->in_pos += len;
+		done += len;
+	}
+	job->consumed += done;
+	return done;
+}
+
+/* Skip n bytes of data plus the padding out to the next header */
+static int tar_skip(struct tar_job* job, uint64_t n) {
+	n = (n + TAR_BLOCK - 1) & ~(uint64_t) (TAR_BLOCK - 1);
+	while (n) {
+		size_t len = (n < TAR_CHUNK) ? n : TAR_CHUNK;
+		if (tar_read(job, NULL, len) != len)
+			return -1;
+		n -= len;
+	}
+	return 0;
+}
+
+/* Octal, space or NUL terminated, or base-256 when the top bit is set */
+static uint64_t tar_number(const char* p, int len) {
+	uint64_t v = 0;
+	if ((uint8_t) p[0] & 0x80) {
+		v = p[0] & 0x3F;
+		for (int q = 1; q < len; q++)
+			v = (v << 8) | (uint8_t) p[q];
+		return v;
+	}
+	int q = 0;
+	while (q < len && (p[q] == ' ' || p[q] == '0'))
+		q++;
+	for (; q < len && p[q] >= '0' && p[q] <= '7'; q++)
+		v = (v << 3) | (p[q] - '0');
+	return v;
+}
+
+static int tar_checksum(struct tar_header* h) {
+	uint8_t* p = (uint8_t*) h;
+	uint32_t sum = 0;
+	int32_t ssum = 0;
+	for (int q = 0; q < TAR_BLOCK; q++) {
+		int in_field = q >= offsetof(struct tar_header, chksum) && q < offsetof(struct tar_header, typeflag);
+		sum += (in_field) ? ' ' : p[q];
+		ssum += (in_field) ? ' ' : (int8_t) p[q];
+	}
+	uint64_t want = tar_number(h->chksum, sizeof(h->chksum));
+	return want == sum || want == (uint64_t) ssum;
+}
+
+static void tar_attrs_clear(struct tar_attrs* a) {
+	free(a->path);
+	free(a->link);
+	memset(a, 0, sizeof(struct tar_attrs));
+}
+
+/* Parse the "length key=value\n" records of a pax header into a */
+static void tar_pax(char* data, size_t len, struct tar_attrs* a) {
+	size_t off = 0;
+	while (off < len) {
+		char* rec = data + off;
+		char* end;
+		unsigned long rec_len = strtoul(rec, &end, 10);
+		if (!rec_len || off + rec_len > len || *end != ' ')
+			break;
+		char* key = end + 1;
+		char* eq = memchr(key, '=', rec + rec_len - key);
+		off += rec_len;
+		if (!eq || rec[rec_len - 1] != '\n')
+			continue;
+		char* value = eq + 1;
+		size_t value_len = rec + rec_len - 1 - value;
+		size_t key_len = eq - key;
+
+		if (key_len == 4 && !memcmp(key, "path", 4)) {
+			free(a->path);
+			a->path = strndup(value, value_len);
+		} else if (key_len == 8 && !memcmp(key, "linkpath", 8)) {
+			free(a->link);
+			a->link = strndup(value, value_len);
+		} else if (key_len == 4 && !memcmp(key, "size", 4)) {
+			a->size = strtoull(value, NULL, 10);
+			a->has_size = 1;
+		} else if (key_len == 5 && !memcmp(key, "mtime", 5)) {
+			a->mtime = strtoull(value, NULL, 10);
+			a->has_mtime = 1;
+		} else if (key_len == 3 && !memcmp(key, "uid", 3)) {
+			a->uid = strtoul(value, NULL, 10);
+			a->has_uid = 1;
+		} else if (key_len == 3 && !memcmp(key, "gid", 3)) {
+			a->gid = strtoul(value, NULL, 10);
+			a->has_gid = 1;
+		}
+	}
+}
+
+/* Read an entry's data whole; only for pax headers and long names */
+static char* tar_read_small(struct tar_job* job, uint64_t size) {
+	if (size > TAR_CHUNK) {
+		printf("tar: %llu byte extended header at %llu is too large\n",
+			(unsigned long long) size, (unsigned long long) job->consumed);
+		return NULL;
+	}
+	char* data = malloc(size + 1);
+	if (tar_read(job, data, size) != size) {
+		free(data);
+		return NULL;
+	}
+	data[size] = '\0';
+	uint64_t pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+	if (tar_read(job, NULL, pad) != pad) {
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+/* Make an archive path relative to the import root: leading slashes, "."
+and empty components go. Returns NULL for a path that climbs out with "..",
+or an empty string for the root itself */
+static char* tar_clean(const char* path) {
+	char* out = malloc(strlen(path) + 1);
+	size_t len = 0;
+	const char* p = path;
+	while (*p) {
+		while (*p == '/')
+			p++;
+		const char* end = strchr(p, '/');
+		size_t n = (end) ? end - p : strlen(p);
+		if (n == 2 && p[0] == '.' && p[1] == '.') {
+			free(out);
+			return NULL;
+		}
+		if (n && !(n == 1 && p[0] == '.')) {
+			if (len)
+				out[len++] = '/';
+			memcpy(out + len, p, n);
+			len += n;
+		}
+		p += n;
+	}
+	out[len] = '\0';
+	return out;
+}
+
+/* Inode of the directory at rel (relative to the root), creating missing
+directories on the way when create is set. Returns -1 if it can't be had */
+static int tar_dir(struct tar_job* job, char* rel, int create) {
+	struct ext2_fs* f = job->f;
+	if (job->cached_dir && strcmp(job->cached_dir, rel) == 0)
+		return job->cached_inode;
+
+	char* p = strdup(rel);
+	char* save;
+	int dir = job->root;
+	for (char* name = strtok_r(p, "/", &save); name && dir > 0; name = strtok_r(NULL, "/", &save)) {
+		int child = ext2_find_child(f, name, dir);
+		if (child <= 0) {
+			if (!create || strlen(name) > 255) {
+				dir = -1;
+				break;
+			}
+			child = ext2_create_dir(f, name, dir);
+			if (child > 0) {
+				struct ext2_inode* in = ext2_read_inode(f, child);
+				in->mode = EXT2_IFDIR | 0755;
+				ext2_write_inode(f, child, in);
+				free(in);
+				job->dir_count++;
+			}
+		} else {
+			struct ext2_inode* in = ext2_read_inode(f, child);
+			if ((in->mode & 0xF000) != EXT2_IFDIR)
+				child = -1;
+			free(in);
+		}
+		dir = child;
+	}
+	free(p);
+
+	if (dir > 0) {
+		free(job->cached_dir);
+		job->cached_dir = strdup(rel);
+		job->cached_inode = dir;
+	}
+	return dir;
+}
+
+/* Split rel into its parent directory (created if missing) and last name */
+static int tar_parent(struct tar_job* job, char* rel, char** name) {
+	char* slash = strrchr(rel, '/');
+	if (!slash) {
+		*name = rel;
+		return job->root;
+	}
+	*slash = '\0';
+	int dir = tar_dir(job, rel, 1);
+	*slash = '/';
+	*name = slash + 1;
+	return dir;
+}
+
+static void tar_set_attrs(struct ext2_fs* f, uint32_t i_no, uint16_t mode, uint16_t uid, uint16_t gid, uint32_t mtime) {
+	struct ext2_inode* in = ext2_read_inode(f, i_no);
+	in->mode = (in->mode & 0xF000) | mode;
+	in->uid = uid;
+	in->gid = gid;
+	in->atime = in->mtime = mtime;
+	ext2_write_inode(f, i_no, in);
+	free(in);
+}
+
+/* Create (or empty, if it is already there) the regular file name in parent
+and stream size bytes of archive data into it. A file that can't be written
+in full is unlinked again, and the rest of its data skipped */
+static int tar_file(struct tar_job* job, int parent, char* name, uint64_t size, uint16_t mode) {
+	struct ext2_fs* f = job->f;
+	if (size > UINT32_MAX) {
+		printf("%s: too large for ext2\n", name);
+		tar_skip(job, size);
+		return -1;
+	}
+
+	int i_no = ext2_find_child(f, name, parent);
+	if (i_no > 0) {
+		struct ext2_inode* in = ext2_read_inode(f, i_no);
+		int type = in->mode & 0xF000;
+		free(in);
+		if (type != EXT2_IFREG) {
+			printf("%s: already exists\n", name);
+			tar_skip(job, size);
+			return -1;
+		}
+		ext2_truncate(f, i_no, 0);
+	} else {
+		i_no = ext2_alloc_inode(f, parent, EXT2_IFREG | mode);
+		if (!i_no) {
+			printf("%s: out of inodes\n", name);
+			tar_skip(job, size);
+			return -1;
+		}
+		struct ext2_inode* in = calloc(1, INODE_SIZE);
+		in->mode = EXT2_IFREG | mode;
+		in->links_count = 1;
+		in->atime = in->ctime = in->mtime = time(NULL);
+		ext2_write_inode(f, i_no, in);
+		if (ext2_add_child(f, parent, i_no, name, EXT2_FT_REG_FILE) <= 0) {
+			in->links_count = 0;
+			in->dtime = time(NULL);
+			ext2_write_inode(f, i_no, in);
+			ext2_free_inode(f, i_no);
+			free(in);
+			tar_skip(job, size);
+			return -1;
+		}
+		free(in);
+	}
+
+	int ret = 0;
+	int full = 0;
+	uint64_t off = 0;
+	ext2_reserve(f, i_no);
+	while (off < size) {
+		size_t len = (size - off < TAR_CHUNK) ? size - off : TAR_CHUNK;
+		if (tar_read(job, job->chunk, len) != len) {
+			printf("%s: archive ends inside the file\n", name);
+			ret = -1;
+			break;
+		}
+		off += len;
+		if (ext2_write_at(f, i_no, job->chunk, len, off - len) != len) {
+			printf("%s: out of space\n", name);
+			ret = -1;
+			full = 1;
+			break;
+		}
+	}
+	ext2_unreserve(f, i_no);
+
+	/* The padding is counted from the full size, not from where we stopped */
+	uint64_t pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+	if (full)
+		tar_skip(job, size - off + pad);
+	else if (!ret && tar_read(job, NULL, pad) != pad)
+		ret = -1;
+	if (ret) {
+		ext2_remove_child(f, parent, name);
+		ext2_remove_link(f, i_no);
+		return -1;
+	}
+	job->bytes += off;
+	job->unsynced += off;
+	return i_no;
+}
+
+/* Handle one entry whose header (with any pax or long name values folded
+in) has been read. Returns -1 when the archive can't be followed further */
+static int tar_entry(struct tar_job* job, struct tar_header* h, char* path, char* link, uint64_t size) {
+	struct ext2_fs* f = job->f;
+	struct tar_attrs* a = &job->local;
+	struct tar_attrs* g = &job->global;
+	uint16_t mode = tar_number(h->mode, sizeof(h->mode)) & 07777;
+	uint16_t uid = a->has_uid ? a->uid : g->has_uid ? g->uid : tar_number(h->uid, sizeof(h->uid));
+	uint16_t gid = a->has_gid ? a->gid : g->has_gid ? g->gid : tar_number(h->gid, sizeof(h->gid));
+	uint32_t mtime = a->has_mtime ? a->mtime : g->has_mtime ? g->mtime : tar_number(h->mtime, sizeof(h->mtime));
+	char type = h->typeflag;
+
+	char* rel = tar_clean(path);
+	if (!rel) {
+		printf("%s: leaves the import directory, skipped\n", path);
+		job->skipped++;
+		return tar_skip(job, TAR_DATA(type) ? size : 0);
+	}
+
+	char* name;
+	int parent = (*rel) ? tar_parent(job, rel, &name) : -1;
+	int ret = 0;
+
+	if (type == '5') {
+		int i_no = (*rel) ? tar_dir(job, rel, 1) : job->root;
+		if (i_no <= 0) {
+			printf("%s: can't create directory\n", path);
+			job->errors++;
+		} else {
+			if (job->ndirs == job->dirs_size) {
+				job->dirs_size = (job->dirs_size) ? job->dirs_size * 2 : 64;
+				job->dirs = realloc(job->dirs, job->dirs_size * sizeof(struct tar_dir));
+			}
+			struct tar_dir* d = &job->dirs[job->ndirs++];
+			d->inode = i_no;
+			d->mode = mode;
+			d->uid = uid;
+			d->gid = gid;
+			d->mtime = mtime;
+		}
+	} else if (!*rel || parent <= 0 || strlen(name) > 255) {
+		printf("%s: can't create\n", path);
+		job->errors++;
+		ret = tar_skip(job, TAR_DATA(type) ? size : 0);
+	} else if (TAR_DATA(type)) {
+		int i_no = tar_file(job, parent, name, size, mode);
+		if (i_no > 0) {
+			tar_set_attrs(f, i_no, mode, uid, gid, mtime);
+			job->files++;
+		} else
+			job->errors++;
+	} else if (type == '2') {
+		uint32_t len = strlen(link);
+		uint32_t i_no = (len < f->block_size && ext2_find_child(f, name, parent) <= 0)
+			? ext2_symlink(f, parent, name, link, len) : 0;
+		if (i_no) {
+			tar_set_attrs(f, i_no, 0777, uid, gid, mtime);
+			job->symlinks++;
+		} else {
+			printf("%s: can't create symlink\n", path);
+			job->errors++;
+		}
+	} else if (type == '1') {
+		/* The target is an earlier entry of the same archive */
+		char* target = tar_clean(link);
+		char* slash = (target) ? strrchr(target, '/') : NULL;
+		int target_dir = job->root;
+		if (slash) {
+			*slash = '\0';
+			target_dir = tar_dir(job, target, 0);
+		}
+		char* target_name = (slash) ? slash + 1 : target;
+		int i_no = (target && *target_name && target_dir > 0) ? ext2_find_child(f, target_name, target_dir) : -1;
+		/* Only regular files are linked; a directory must have one name */
+		if (i_no > 0) {
+			struct ext2_inode* in = ext2_read_inode(f, i_no);
+			if ((in->mode & 0xF000) != EXT2_IFREG || in->links_count >= EXT2_LINK_MAX)
+				i_no = -1;
+			free(in);
+		}
+		if (i_no > 0 && ext2_add_child(f, parent, i_no, name, EXT2_FT_REG_FILE) > 0) {
+			ext2_add_link(f, i_no);
+			job->links++;
+		} else {
+			printf("%s: can't link to %s\n", path, link);
+			job->errors++;
+		}
+		free(target);
+	} else {
+		printf("%s: unsupported entry type '%c', skipped\n", path, type);
+		job->skipped++;
+		ret = tar_skip(job, size);
+	}
+	free(rel);
+
+	if (job->unsynced >= TAR_SYNC_BYTES) {
+		ext2_sync(f);
+		job->unsynced = 0;
+	}
+	return ret;
+}
+
+/* Unpack the tar archive read from fd into the image directory at path */
+int ext2_import_tar(struct ext2_fs *f, int fd, char* path) {
+	char* p = strdup(path);
+	int root = ext2_pathize(f, p);
+	free(p);
+	struct ext2_inode* in = (root > 0) ? ext2_read_inode(f, root) : NULL;
+	if (!in || (in->mode & 0xF000) != EXT2_IFDIR) {
+		printf("%s: not a directory in image\n", path);
+		free(in);
+		return -1;
+	}
+	free(in);
+
+	struct tar_job job;
+	memset(&job, 0, sizeof(job));
+	job.f = f;
+	job.fd = fd;
+	job.root = root;
+	job.in = malloc(TAR_CHUNK);
+	job.chunk = malloc(TAR_CHUNK);
+
+	struct tar_header h;
+	int zeroes = 0;
+	int ret = 0;
+	for (;;) {
+		size_t n = tar_read(&job, (char*) &h, TAR_BLOCK);
+		if (n == 0 && !zeroes) {
+			printf("tar: archive ends without its end marker\n");
+			ret = -1;
+			break;
+		}
+		if (n != TAR_BLOCK) {
+			printf("tar: archive truncated at %llu\n", (unsigned long long) job.consumed);
+			ret = -1;
+			break;
+		}
+
+		/* Two zero blocks end the archive */
+		char* b = (char*) &h;
+		int zero = 1;
+		for (int q = 0; q < TAR_BLOCK && zero; q++)
+			zero = !b[q];
+		if (zero) {
+			if (++zeroes == 2)
+				break;
+			continue;
+		}
+		zeroes = 0;
+
+		if (!tar_checksum(&h)) {
+			printf("tar: bad header checksum at %llu\n", (unsigned long long) job.consumed - TAR_BLOCK);
+			ret = -1;
+			break;
+		}
+
+		uint64_t size = tar_number(h.size, sizeof(h.size));
+		if (h.typeflag == 'x' || h.typeflag == 'g' || h.typeflag == 'L' || h.typeflag == 'K') {
+			char* data = tar_read_small(&job, size);
+			if (!data) {
+				ret = -1;
+				break;
+			}
+			if (h.typeflag == 'x')
+				tar_pax(data, size, &job.local);
+			else if (h.typeflag == 'g')
+				tar_pax(data, size, &job.global);
+			else if (h.typeflag == 'L') {
+				free(job.local.path);
+				job.local.path = data;
+				data = NULL;
+			} else {
+				free(job.local.link);
+				job.local.link = data;
+				data = NULL;
+			}
+			free(data);
+			continue;
+		}
+
+		char name[sizeof(h.prefix) + sizeof(h.name) + 2];
+		char link[sizeof(h.linkname) + 1];
+		if (h.prefix[0] && memcmp(h.magic, "ustar", 5) == 0)
+			sprintf(name, "%.*s/%.*s", (int) sizeof(h.prefix), h.prefix, (int) sizeof(h.name), h.name);
+		else
+			sprintf(name, "%.*s", (int) sizeof(h.name), h.name);
+		sprintf(link, "%.*s", (int) sizeof(h.linkname), h.linkname);
+
+		char* entry_path = job.local.path ? job.local.path : job.global.path ? job.global.path : name;
+		char* entry_link = job.local.link ? job.local.link : job.global.link ? job.global.link : link;
+		if (job.local.has_size)
+			size = job.local.size;
+		else if (job.global.has_size)
+			size = job.global.size;
+
+		ret = tar_entry(&job, &h, entry_path, entry_link, size);
+		tar_attrs_clear(&job.local);
+		if (ret) {
+			printf("tar: archive truncated at %llu\n", (unsigned long long) job.consumed);
+			break;
+		}
+	}
+
+	/* Nothing is added to a directory from here on, so its times stay put */
+	for (int q = 0; q < job.ndirs; q++) {
+		struct tar_dir* d = &job.dirs[q];
+		tar_set_attrs(f, d->inode, d->mode, d->uid, d->gid, d->mtime);
+	}
+	ext2_sync(f);
+
+	printf("imported %d files, %d directories, %d symlinks, %d hard links, %llu bytes\n",
+		job.files, job.dir_count, job.symlinks, job.links, (unsigned long long) job.bytes);
+	if (job.skipped)
+		printf("%d entries skipped\n", job.skipped);
+	if (job.errors)
+		printf("%d errors\n", job.errors);
+
+	tar_attrs_clear(&job.local);
+	tar_attrs_clear(&job.global);
+	free(job.cached_dir);
+	free(job.dirs);
+	free(job.in);
+	free(job.chunk);
+	return (ret || job.errors) ? -1 : 0;
+}
@@ -0,0 +1,585 @@
+/*
+verify.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* CRC32C manifests: recording what an image should hold, and checking it.
+
+A manifest lists regular files by their path under some image directory,
+each with its size, a CRC32C of every block and a CRC32C over those block
+CRCs for the file as a whole. One is written by import as files go in, from
+the host data, or from an image by the manifest command. verify then reads
+every listed file back through its block map, with physically contiguous
+blocks read in one go and files spread over several workers, and names each
+block that doesn't match.
+
+The CRC uses the SSE4.2 crc32 instruction when the CPU has it and a
+slicing-by-8 table otherwise; both give the same values.
+
+Manifest layout:
+	struct manifest_header, then the root path
+	per file: struct manifest_file, the path, one uint32_t CRC per block
+*/
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+
+#define CRC32C_POLY			0x82F63B78	// Castagnoli, bit-reflected
+#define MANIFEST_MAGIC		"E2CRC001"
+#define VERIFY_RUN			(1 << 20)	// Largest single read
+#define VERIFY_REPORT_MAX	8			// Blocks named per file before summing up
+
+struct manifest_header {
+	char magic[8];
+	uint32_t block_size;
+	uint32_t files;
+	uint32_t root_len;
+} __attribute__((packed));
+
+struct manifest_file {
+	uint64_t size;
+	uint32_t crc;				// Over the block CRCs
+	uint32_t path_len;
+} __attribute__((packed));
+
+static uint32_t crc_table[8][256];
+static int crc_hw;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc_table[0][n] = c;
+	}
+	for (uint32_t n = 0; n < 256; n++)
+		for (int t = 1; t < 8; t++)
+			crc_table[t][n] = (crc_table[t - 1][n] >> 8) ^ crc_table[0][crc_table[t - 1][n] & 0xFF];
+	#if defined(__x86_64__)
+	__builtin_cpu_init();
+	crc_hw = __builtin_cpu_supports("sse4.2");
+	#endif
+}
+
+static uint32_t crc_sw(uint32_t crc, const uint8_t* p, size_t len) {
+	for (; len && ((uintptr_t) p & 7); len--)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		w ^= crc;
+		crc = crc_table[7][w & 0xFF] ^ crc_table[6][(w >> 8) & 0xFF] ^
+			crc_table[5][(w >> 16) & 0xFF] ^ crc_table[4][(w >> 24) & 0xFF] ^
+			crc_table[3][(w >> 32) & 0xFF] ^ crc_table[2][(w >> 40) & 0xFF] ^
+			crc_table[1][(w >> 48) & 0xFF] ^ crc_table[0][w >> 56];
+	}
+	for (; len; len--)
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const uint8_t* p, size_t len) {
+	uint64_t c = crc;
+	for (; len && ((uintptr_t) p & 7); len--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t w;
+		memcpy(&w, p, 8);
+		c = __builtin_ia32_crc32di(c, w);
+	}
+	for (; len; len--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	return c;
+}
+
+/* Three consecutive len-byte pieces at once. crc32 takes three cycles but
+can start every cycle, so three independent streams keep it busy */
+__attribute__((target("sse4.2")))
+static void crc_sse42_x3(const uint8_t* p, size_t len, uint32_t* out) {
+	uint64_t a = ~0u, b = ~0u, c = ~0u;
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t x, y, z;
+		memcpy(&x, p + i, 8);
+		memcpy(&y, p + len + i, 8);
+		memcpy(&z, p + 2 * len + i, 8);
+		a = __builtin_ia32_crc32di(a, x);
+		b = __builtin_ia32_crc32di(b, y);
+		c = __builtin_ia32_crc32di(c, z);
+	}
+	out[0] = ~crc_sse42(a, p + i, len - i);
+	out[1] = ~crc_sse42(b, p + len + i, len - i);
+	out[2] = ~crc_sse42(c, p + 2 * len + i, len - i);
+}
+#endif
+
+/* CRC32C of len bytes, continuing from crc (0 to start) */
+uint32_t ext2_crc32c(uint32_t crc, const void* data, size_t len) {
+	pthread_once(&crc_once, crc_init);
+	#if defined(__x86_64__)
+	if (crc_hw)
+		return ~crc_sse42(~crc, data, len);
+	#endif
+	return ~crc_sw(~crc, data, len);
+}
+
+/* CRC count whole blocks of data into crc[] */
+static void crc_run(const char* data, uint32_t count, uint32_t block_size, uint32_t* crc) {
+	uint32_t q = 0;
+	pthread_once(&crc_once, crc_init);
+	#if defined(__x86_64__)
+	if (crc_hw)
+		for (; q + 3 <= count; q += 3)
+			crc_sse42_x3((const uint8_t*) data + (size_t) q * block_size, block_size, crc + q);
+	#endif
+	for (; q < count; q++)
+		crc[q] = ext2_crc32c(0, data + (size_t) q * block_size, block_size);
+}
+
+/* CRC each block_size piece of data into crc[]; returns the file CRC */
+static uint32_t crc_blocks(const char* data, uint64_t size, uint32_t block_size, uint32_t* crc) {
+	uint32_t full = size / block_size;
+	uint32_t n = (size + block_size - 1) / block_size;
+	crc_run(data, full, block_size, crc);
+	if (n > full)
+		crc[full] = ext2_crc32c(0, data + (uint64_t) full * block_size, size % block_size);
+	return ext2_crc32c(0, crc, n * sizeof(uint32_t));
+}
+
+struct manifest {
+	FILE* out;
+	char* path;
+	uint32_t block_size;
+	uint32_t files;
+	uint32_t* crc;				// Scratch for ext2_manifest_add
+	uint32_t crc_size;
+};
+
+/* Start a manifest at path for files under the image directory root */
+struct manifest* ext2_manifest_create(char* path, char* root, uint32_t block_size) {
+	FILE* out = fopen(path, "wb");
+	if (!out) {
+		perror(path);
+		return NULL;
+	}
+	struct manifest* m = calloc(1, sizeof(struct manifest));
+	m->out = out;
+	m->path = path;
+	m->block_size = block_size;
+
+	struct manifest_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MANIFEST_MAGIC, sizeof(h.magic));
+	h.block_size = block_size;
+	h.root_len = strlen(root);
+	fwrite(&h, sizeof(h), 1, out);
+	fwrite(root, 1, h.root_len, out);
+	return m;
+}
+
+static void manifest_put(struct manifest* m, const char* name, uint64_t size, uint32_t crc, uint32_t* blocks) {
+	struct manifest_file e;
+	e.size = size;
+	e.crc = crc;
+	e.path_len = strlen(name);
+	fwrite(&e, sizeof(e), 1, m->out);
+	fwrite(name, 1, e.path_len, m->out);
+	fwrite(blocks, sizeof(uint32_t), (size + m->block_size - 1) / m->block_size, m->out);
+	m->files++;
+}
+
+/* Record the file at name, relative to the manifest's root, as holding size
+bytes of data */
+void ext2_manifest_add(struct manifest* m, const char* name, const char* data, uint64_t size) {
+	uint32_t n = (size + m->block_size - 1) / m->block_size;
+	if (n > m->crc_size) {
+		m->crc_size = n;
+		m->crc = realloc(m->crc, n * sizeof(uint32_t));
+	}
+	uint32_t crc = crc_blocks(data, size, m->block_size, m->crc);
+	manifest_put(m, name, size, crc, m->crc);
+}
+
+int ext2_manifest_close(struct manifest* m) {
+	int ret = 0;
+	if (fseek(m->out, offsetof(struct manifest_header, files), SEEK_SET) ||
+		fwrite(&m->files, sizeof(m->files), 1, m->out) != 1)
+		ret = -1;
+	if (fclose(m->out))
+		ret = -1;
+	if (ret)
+		perror(m->path);
+	free(m->crc);
+	free(m);
+	return ret;
+}
+
+/* One file to CRC from the image */
+struct verify_item {
+	char* path;					// Relative to the root
+	uint32_t inode;				// 0 if it isn't in the image
+	uint64_t size;				// Expected size when verifying
+	uint32_t crc;
+	uint32_t* blocks;			// Block CRCs: expected when verifying, found otherwise
+};
+
+struct verify_job {
+	struct ext2_fs* f;
+	struct verify_item* items;
+	int count;
+	int size;
+	int check;					// Compare against blocks[] rather than fill it
+	char* zero;					// A block of zeroes, for holes
+
+	pthread_mutex_t lock;
+	int next;
+	int good;
+	int bad;
+	int errors;
+	uint64_t bytes;
+	uint64_t bad_blocks;
+};
+
+static void verify_queue(struct verify_job* job, char* path, uint32_t inode) {
+	if (job->count == job->size) {
+		job->size = (job->size) ? job->size * 2 : 64;
+		job->items = realloc(job->items, job->size * sizeof(struct verify_item));
+	}
+	struct verify_item* it = &job->items[job->count++];
+	memset(it, 0, sizeof(*it));
+	it->path = path;
+	it->inode = inode;
+}
+
+/* CRC every block of the inode into crc[], reading physically contiguous
+blocks in one go. Returns 0, or -1 on a read error */
+static int verify_crc_inode(struct verify_job* job, struct ext2_inode* in, char* chunk, uint32_t* crc) {
+	struct ext2_fs* f = job->f;
+	uint32_t bs = f->block_size;
+	uint32_t run_max = VERIFY_RUN / bs;
+	uint32_t n;
+	uint32_t* map = ext2_block_map(f, in, &n);
+	int ret = 0;
+
+	for (uint32_t q = 0; q < n && !ret; ) {
+		uint32_t run = 1;
+		if (map[q]) {
+			while (q + run < n && run < run_max && map[q + run] == map[q] + run)
+				run++;
+			ret = (buffer_read_blocks(f, map[q], run, chunk) < 0) ? -1 : 0;
+		}
+		/* Only the file's last block can be partial */
+		uint64_t end = (uint64_t) (q + run) * bs;
+		uint32_t full = (end > in->size) ? run - 1 : run;
+		if (map[q])
+			crc_run(chunk, full, bs, crc + q);
+		else
+			for (uint32_t r = 0; r < full; r++)
+				crc[q + r] = ext2_crc32c(0, job->zero, bs);
+		if (full < run)
+			crc[q + full] = ext2_crc32c(0, (map[q]) ? chunk + (size_t) full * bs : job->zero, in->size % bs);
+		q += run;
+	}
+	free(map);
+	return ret;
+}
+
+/* Compare what was found against the manifest, naming the blocks that differ */
+static int verify_compare(struct verify_job* job, struct verify_item* it, struct ext2_inode* in, uint32_t* found) {
+	uint32_t* map = NULL;
+	uint32_t n = (it->size + job->f->block_size - 1) / job->f->block_size;
+	uint32_t mapped = 0;
+	uint32_t bad = 0;
+
+	for (uint32_t q = 0; q < n; q++) {
+		if (found[q] == it->blocks[q])
+			continue;
+		if (bad < VERIFY_REPORT_MAX) {
+			if (!map)
+				map = ext2_block_map(job->f, in, &mapped);
+			printf("%s: block %u (image block %u) differs\n", it->path, q, (q < mapped) ? map[q] : 0);
+		}
+		bad++;
+	}
+	if (bad > VERIFY_REPORT_MAX)
+		printf("%s: %u more blocks differ\n", it->path, bad - VERIFY_REPORT_MAX);
+	free(map);
+	return bad;
+}
+
+static void* verify_worker(void* arg) {
+	struct verify_job* job = arg;
+	struct ext2_fs* f = job->f;
+	char* chunk;
+	posix_memalign((void**) &chunk, 4096, VERIFY_RUN);
+	uint32_t* found = NULL;
+	uint32_t found_size = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		int idx = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (idx >= job->count)
+			break;
+
+		struct verify_item* it = &job->items[idx];
+		if (!it->inode)
+			continue;
+		struct ext2_inode* in = ext2_read_inode(f, it->inode);
+		uint32_t n = (in->size + f->block_size - 1) / f->block_size;
+		if (n > found_size) {
+			found_size = n;
+			found = realloc(found, n * sizeof(uint32_t));
+		}
+
+		int err = verify_crc_inode(job, in, chunk, found);
+		uint32_t crc = ext2_crc32c(0, found, n * sizeof(uint32_t));
+		uint32_t bad = 0;
+		if (err)
+			printf("%s: read error\n", it->path);
+		else if (!job->check) {
+			it->size = in->size;
+			it->crc = crc;
+			it->blocks = malloc((n + 1) * sizeof(uint32_t));
+			memcpy(it->blocks, found, n * sizeof(uint32_t));
+		} else if (in->size != it->size) {
+			printf("%s: %u bytes, manifest has %llu\n", it->path, in->size, (unsigned long long) it->size);
+			bad = 1;
+		} else if (crc != it->crc)
+			bad = verify_compare(job, it, in, found);
+
+		pthread_mutex_lock(&job->lock);
+		if (err)
+			job->errors++;
+		else {
+			job->bytes += in->size;
+			job->bad_blocks += bad;
+			if (bad)
+				job->bad++;
+			else
+				job->good++;
+		}
+		pthread_mutex_unlock(&job->lock);
+		free(in);
+	}
+	free(found);
+	free(chunk);
+	return NULL;
+}
+
+static void verify_run(struct verify_job* job, int workers) {
+	job->zero = calloc(1, job->f->block_size);
+	pthread_mutex_init(&job->lock, NULL);
+	if (workers < 1)
+		workers = 1;
+	if (workers > job->count)
+		workers = (job->count) ? job->count : 1;
+
+	pthread_t* threads = malloc(workers * sizeof(pthread_t));
+	for (int q = 0; q < workers; q++)
+		pthread_create(&threads[q], NULL, verify_worker, job);
+	for (int q = 0; q < workers; q++)
+		pthread_join(threads[q], NULL);
+	free(threads);
+	pthread_mutex_destroy(&job->lock);
+	free(job->zero);
+}
+
+static void verify_free(struct verify_job* job) {
+	for (int q = 0; q < job->count; q++) {
+		free(job->items[q].path);
+		free(job->items[q].blocks);
+	}
+	free(job->items);
+}
+
+static void verify_walk(struct verify_job* job, int dir_inode, char* prefix) {
+	struct ext2_fs* f = job->f;
+	struct ext2_inode* dir = ext2_read_inode(f, dir_inode);
+	int len;
+	char* buf = ext2_read_dir(f, dir, &len);
+	free(dir);
+
+	for (int off = 0; off < len; ) {
+		struct ext2_dirent* d = (struct ext2_dirent*) (buf + off);
+		if (d->rec_len == 0)
+			break;
+		off += d->rec_len;
+		if (!d->inode)
+			continue;
+		if (d->name[0] == '.' && (d->name_len == 1 || (d->name_len == 2 && d->name[1] == '.')))
+			continue;
+
+		char* path = malloc(strlen(prefix) + d->name_len + 2);
+		sprintf(path, "%s%s%.*s", prefix, (*prefix) ? "/" : "", d->name_len, d->name);
+		struct ext2_inode* in = ext2_read_inode(f, d->inode);
+		if ((in->mode & 0xF000) == EXT2_IFDIR) {
+			verify_walk(job, d->inode, path);
+			free(path);
+		} else if ((in->mode & 0xF000) == EXT2_IFREG)
+			verify_queue(job, path, d->inode);
+		else
+			free(path);
+		free(in);
+	}
+	free(buf);
+}
+
+/* Write a manifest of every regular file under path in the image */
+int ext2_manifest(struct ext2_fs *f, char* path, char* out, int workers) {
+	char* p = strdup(path);
+	int i_no = ext2_pathize(f, p);
+	free(p);
+	struct ext2_inode* in = (i_no > 0) ? ext2_read_inode(f, i_no) : NULL;
+	if (!in || (in->mode & 0xF000) != EXT2_IFDIR) {
+		printf("%s: not a directory in image\n", path);
+		free(in);
+		return -1;
+	}
+	free(in);
+
+	struct verify_job job;
+	memset(&job, 0, sizeof(job));
+	job.f = f;
+	verify_walk(&job, i_no, "");
+	verify_run(&job, workers);
+
+	struct manifest* m = (job.errors) ? NULL : ext2_manifest_create(out, path, f->block_size);
+	int ret = -1;
+	if (m) {
+		for (int q = 0; q < job.count; q++)
+			manifest_put(m, job.items[q].path, job.items[q].size, job.items[q].crc, job.items[q].blocks);
+		ret = ext2_manifest_close(m);
+	}
+	if (!ret)
+		printf("%s: %d files, %llu bytes\n", out, job.count, (unsigned long long) job.bytes);
+	verify_free(&job);
+	return ret;
+}
+
+/* The inode at path below dir, or 0 */
+static uint32_t verify_lookup(struct ext2_fs *f, int dir, char* path) {
+	char* save;
+	for (char* pch = strtok_r(path, "/", &save); pch && dir > 0; pch = strtok_r(NULL, "/", &save))
+		dir = ext2_find_child(f, pch, dir);
+	return (dir > 0) ? dir : 0;
+}
+
+/* Check every file the manifest lists against the image */
+int ext2_verify(struct ext2_fs *f, char* manifest, int workers) {
+	int fd = open(manifest, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(manifest);
+		return -1;
+	}
+	char* buf = malloc(st.st_size + 1);
+	ssize_t got = pread(fd, buf, st.st_size, 0);
+	close(fd);
+
+	struct manifest_header h;
+	if (got != st.st_size || got < sizeof(h) || memcmp(buf, MANIFEST_MAGIC, sizeof(h.magic))) {
+		printf("%s: not a manifest\n", manifest);
+		free(buf);
+		return -1;
+	}
+	memcpy(&h, buf, sizeof(h));
+	if (h.block_size != f->block_size) {
+		printf("%s: made for %u byte blocks, image has %d\n", manifest, h.block_size, f->block_size);
+		free(buf);
+		return -1;
+	}
+
+	char* end = buf + st.st_size;
+	char* p = buf + sizeof(h);
+	char* root = strndup(p, h.root_len);
+	p += h.root_len;
+	int dir = ext2_pathize(f, root);
+	free(root);
+
+	struct verify_job job;
+	memset(&job, 0, sizeof(job));
+	job.f = f;
+	job.check = 1;
+	int missing = 0;
+	for (uint32_t q = 0; q < h.files; q++) {
+		struct manifest_file e;
+		if (end - p < sizeof(e))
+			break;
+		memcpy(&e, p, sizeof(e));
+		p += sizeof(e);
+		uint64_t n = (e.size + h.block_size - 1) / h.block_size;
+		if (end - p < e.path_len + n * sizeof(uint32_t))
+			break;
+
+		char* path = strndup(p, e.path_len);
+		char* tmp = strdup(path);
+		uint32_t inode = (dir > 0) ? verify_lookup(f, dir, tmp) : 0;
+		free(tmp);
+		if (!inode) {
+			printf("%s: missing\n", path);
+			missing++;
+		}
+		verify_queue(&job, path, inode);
+		struct verify_item* it = &job.items[job.count - 1];
+		it->size = e.size;
+		it->crc = e.crc;
+		it->blocks = malloc((n + 1) * sizeof(uint32_t));
+		memcpy(it->blocks, p + e.path_len, n * sizeof(uint32_t));
+		p += e.path_len + n * sizeof(uint32_t);
+	}
+	free(buf);
+	if (job.count != h.files) {
+		printf("%s: truncated after %d of %u files\n", manifest, job.count, h.files);
+		job.errors++;
+	}
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	verify_run(&job, workers);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	pthread_once(&crc_once, crc_init);
+
+	printf("verified %d files, %llu bytes in %.2fs (%.0f MB/s, %s CRC): %d match, %d differ (%llu blocks), %d missing, %d errors\n",
+		job.good + job.bad, (unsigned long long) job.bytes, secs, (secs > 0) ? job.bytes / secs / 1e6 : 0.0,
+		(crc_hw) ? "SSE4.2" : "table", job.good, job.bad, (unsigned long long) job.bad_blocks, missing, job.errors);
+	int ret = (job.bad || missing || job.errors) ? -1 : 0;
+	verify_free(&job);
+	return ret;
+}
@@ -0,0 +1,442 @@
+/*
+walk.c - ext2util
+===============================================================================
+MIT License
+Copyright (c) 2007-2016 Michael Lazear
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+===============================================================================
+*/
+
+/* Breadth-first tree walk with batched inode table reads.
+
+The walk goes a level at a time. Every directory of the current level is
+read, in the order of its first data block, and its entries are gathered
+into one list. The list is sorted by inode number, which is also inode table
+order, so each table block holding one of them is read exactly once, with
+neighbouring blocks coalesced into a single read. Only then are the entries
+handed to the caller and the subdirectories queued as the next level. A walk
+over a whole image costs about one pass over the inode tables instead of one
+random read per entry.
+
+find and du are built on the walk. */
+
+#include "ext2.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <fnmatch.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#define WALK_RUN_BYTES	(1 << 20)	// Largest single inode table read
+#define WALK_GAP		8			// Unneeded table blocks read through rather than seeked over
+
+struct walk_dir {
+	uint32_t inode;
+	int parent;
+	int depth;
+	char* path;					// Freed once the level below has been listed
+	struct ext2_inode in;
+};
+
+/* An entry gathered from a directory of the current level */
+struct walk_child {
+	uint32_t inode;
+	int parent;					// Index into dirs
+	uint32_t name;				// Offset into names
+	uint8_t name_len;
+};
+
+struct walk {
+	struct ext2_fs* f;
+	walk_fn fn;
+	void* arg;
+
+	struct walk_dir* dirs;
+	int ndirs;
+	int dirs_size;
+
+	struct walk_child* kids;
+	struct ext2_inode* table;	// Inode of each kid, filled by walk_load
+	int nkids;
+	int kids_size;
+	char* names;
+	size_t names_len;
+	size_t names_size;
+
+	uint8_t* seen;				// Directories already queued, a bit per inode
+	char* run;					// Inode table read buffer
+	char* path;					// Path of the entry being handed out
+	size_t path_size;
+
+	uint64_t entries;
+	uint64_t table_blocks;
+	uint64_t reads;
+};
+
+static uint32_t walk_table_block(struct ext2_fs* f, uint32_t inode) {
+	uint32_t per = f->block_size / INODE_SIZE;
+	uint32_t g = (inode - 1) / f->sb->inodes_per_group;
+	uint32_t index = (inode - 1) % f->sb->inodes_per_group;
+	return f->bg[g].inode_table + index / per;
+}
+
+static char* walk_join(struct walk* w, char* dir, char* name, int name_len) {
+	size_t len = strlen(dir);
+	if (len + name_len + 2 > w->path_size) {
+		w->path_size = (len + name_len + 2) * 2;
+		w->path = realloc(w->path, w->path_size);
+	}
+	memcpy(w->path, dir, len);
+	if (!len || dir[len - 1] != '/')
+		w->path[len++] = '/';
+	memcpy(w->path + len, name, name_len);
+	w->path[len + name_len] = '\0';
+	return w->path;
+}
+
+static void walk_add_dir(struct walk* w, uint32_t inode, int parent, int depth, char* path, struct ext2_inode* in) {
+	if (w->ndirs == w->dirs_size) {
+		w->dirs_size = (w->dirs_size) ? w->dirs_size * 2 : 64;
+		w->dirs = realloc(w->dirs, w->dirs_size * sizeof(struct walk_dir));
+	}
+	struct walk_dir* d = &w->dirs[w->ndirs++];
+	d->inode = inode;
+	d->parent = parent;
+	d->depth = depth;
+	d->path = strdup(path);
+	d->in = *in;
+	w->seen[inode / 8] |= 1 << (inode % 8);
+}
+
+/* Gather the entries of directory d into the kid list */
+static void walk_list(struct walk* w, int d) {
+	struct ext2_fs* f = w->f;
+	int len;
+	char* buf = ext2_read_dir(f, &w->dirs[d].in, &len);
+
+	for (int off = 0; off < len; ) {
+		struct ext2_dirent* e = (struct ext2_dirent*) (buf + off);
+		if (e->rec_len == 0)
+			break;
+		off += e->rec_len;
+
+		if (!e->inode || e->inode > f->sb->inodes_count)
+			continue;
+		if (e->name[0] == '.' && (e->name_len == 1 || (e->name_len == 2 && e->name[1] == '.')))
+			continue;
+
+		if (w->nkids == w->kids_size) {
+			w->kids_size = (w->kids_size) ? w->kids_size * 2 : 1024;
+			w->kids = realloc(w->kids, w->kids_size * sizeof(struct walk_child));
+		}
+		if (w->names_len + e->name_len > w->names_size) {
+			w->names_size = (w->names_size + e->name_len) * 2;
+			w->names = realloc(w->names, w->names_size);
+		}
+		struct walk_child* k = &w->kids[w->nkids++];
+		k->inode = e->inode;
+		k->parent = d;
+		k->name = w->names_len;
+		k->name_len = e->name_len;
+		memcpy(w->names + w->names_len, e->name, e->name_len);
+		w->names_len += e->name_len;
+	}
+	free(buf);
+}
+
+/* Read the inodes of every kid (sorted by inode number) from the inode
+tables, each table block once */
+static int walk_load(struct walk* w) {
+	struct ext2_fs* f = w->f;
+	uint32_t per = f->block_size / INODE_SIZE;
+	uint32_t run_max = WALK_RUN_BYTES / f->block_size;
+	w->table = realloc(w->table, w->kids_size * sizeof(struct ext2_inode));
+
+	for (int q = 0; q < w->nkids; ) {
+		uint32_t first = walk_table_block(f, w->kids[q].inode);
+		uint32_t last = first;
+		int end = q + 1;
+		for (; end < w->nkids; end++) {
+			uint32_t b = walk_table_block(f, w->kids[end].inode);
+			if (b < last || b - last > WALK_GAP || b - first >= run_max)
+				break;
+			last = b;
+		}
+
+		if (buffer_read_blocks(f, first, last - first + 1, w->run) != (size_t) (last - first + 1) * f->block_size)
+			return -1;
+		w->reads++;
+		w->table_blocks += last - first + 1;
+
+		for (; q < end; q++) {
+			uint32_t index = (w->kids[q].inode - 1) % f->sb->inodes_per_group;
+			uint32_t b = walk_table_block(f, w->kids[q].inode);
+			memcpy(&w->table[q], w->run + (size_t) (b - first) * f->block_size + (index % per) * INODE_SIZE, INODE_SIZE);
+		}
+	}
+	return 0;
+}
+
+static int kid_cmp(const void* a, const void* b) {
+	const struct walk_child* x = a;
+	const struct walk_child* y = b;
+	return (x->inode > y->inode) - (x->inode < y->inode);
+}
+
+/* Directories of a level are listed in the order their data starts on disk */
+struct dir_order {
+	uint32_t block;
+	int dir;
+};
+
+static int dir_order_cmp(const void* a, const void* b) {
+	const struct dir_order* x = a;
+	const struct dir_order* y = b;
+	return (x->block > y->block) - (x->block < y->block);
+}
+
+/* Call fn for path and everything below it, a directory level at a time.
+Within a level, entries come in inode number order */
+int ext2_walk(struct ext2_fs *f, char* path, walk_fn fn, void* arg) {
+	char* p = strdup(path);
+	int i_no = ext2_pathize(f, p);
+	free(p);
+	if (i_no <= 0) {
+		printf("%s: not found in image\n", path);
+		return -1;
+	}
+
+	struct walk w;
+	memset(&w, 0, sizeof(w));
+	w.f = f;
+	w.fn = fn;
+	w.arg = arg;
+	w.seen = calloc(f->sb->inodes_count / 8 + 1, 1);
+	w.run = malloc(WALK_RUN_BYTES);
+
+	struct walk_entry e;
+	struct ext2_inode* in = ext2_read_inode(f, i_no);
+	e.inode = i_no;
+	e.in = in;
+	e.path = path;
+	e.depth = 0;
+	e.parent = -1;
+	e.dir = ((in->mode & 0xF000) == EXT2_IFDIR) ? 0 : -1;
+	if (e.dir == 0)
+		walk_add_dir(&w, i_no, -1, 0, path, in);
+	fn(&e, arg);
+	free(in);
+
+	int ret = 0;
+	for (int level = 0; level < w.ndirs && !ret; ) {
+		int level_end = w.ndirs;
+		int count = level_end - level;
+		struct dir_order* order = malloc(count * sizeof(struct dir_order));
+		for (int q = 0; q < count; q++) {
+			order[q].block = w.dirs[level + q].in.block[0];
+			order[q].dir = level + q;
+		}
+		qsort(order, count, sizeof(struct dir_order), dir_order_cmp);
+
+		w.nkids = 0;
+		w.names_len = 0;
+		for (int q = 0; q < count; q++)
+			walk_list(&w, order[q].dir);
+		free(order);
+
+		qsort(w.kids, w.nkids, sizeof(struct walk_child), kid_cmp);
+		if (walk_load(&w)) {
+			perror("inode table read");
+			ret = -1;
+			break;
+		}
+
+		for (int q = 0; q < w.nkids; q++) {
+			struct walk_child* k = &w.kids[q];
+			struct walk_dir* parent = &w.dirs[k->parent];
+			e.inode = k->inode;
+			e.in = &w.table[q];
+			e.path = walk_join(&w, parent->path, w.names + k->name, k->name_len);
+			e.depth = parent->depth + 1;
+			e.parent = k->parent;
+			e.dir = -1;
+			if ((e.in->mode & 0xF000) == EXT2_IFDIR && !(w.seen[k->inode / 8] & (1 << (k->inode % 8)))) {
+				e.dir = w.ndirs;
+				walk_add_dir(&w, k->inode, k->parent, e.depth, e.path, e.in);
+			}
+			fn(&e, arg);
+			w.entries++;
+		}
+
+		for (int q = level; q < level_end; q++) {
+			free(w.dirs[q].path);
+			w.dirs[q].path = NULL;
+		}
+		level = level_end;
+	}
+
+	printf("walked %d directories, %llu entries; %llu inode table blocks in %llu reads\n",
+		w.ndirs, (unsigned long long) w.entries, (unsigned long long) w.table_blocks,
+		(unsigned long long) w.reads);
+
+	for (int q = 0; q < w.ndirs; q++)
+		free(w.dirs[q].path);
+	free(w.dirs);
+	free(w.kids);
+	free(w.table);
+	free(w.names);
+	free(w.seen);
+	free(w.run);
+	free(w.path);
+	return ret;
+}
+
+/* find ---------------------------------------------------------------------*/
+
+static int find_cmp(uint64_t value, int cmp, uint64_t ref) {
+	if (cmp > 0)
+		return value > ref;
+	if (cmp < 0)
+		return value < ref;
+	return value == ref;
+}
+
+static void find_visit(struct walk_entry* e, void* arg) {
+	struct find_filter* ff = arg;
+	char* name = strrchr(e->path, '/');
+	name = (name && name[1]) ? name + 1 : e->path;
+
+	if (ff->type && (e->in->mode & 0xF000) != ff->type)
+		return;
+	if (ff->name && fnmatch(ff->name, name, 0))
+		return;
+	if (ff->size_set && !find_cmp(e->in->size, ff->size_cmp, ff->size))
+		return;
+	if (ff->mtime_set) {
+		int64_t age = (int64_t) time(NULL) - e->in->mtime;
+		if (!find_cmp((age < 0) ? 0 : age / 86400, ff->mtime_cmp, ff->mtime_days))
+			return;
+	}
+	printf("%s\n", e->path);
+	ff->matches++;
+}
+
+/* Print every path under path that passes the filter */
+int ext2_find(struct ext2_fs *f, char* path, struct find_filter* ff) {
+	ff->matches = 0;
+	int ret = ext2_walk(f, path, find_visit, ff);
+	printf("%llu matches\n", (unsigned long long) ff->matches);
+	return ret;
+}
+
+/* du -----------------------------------------------------------------------*/
+
+struct du_dir {
+	int parent;
+	char* path;				// Only kept for directories that get printed
+	uint64_t blocks;		// 512-byte sectors, this directory and below
+	uint64_t bytes;			// Apparent size, this directory and below
+};
+
+struct du_job {
+	struct du_dir* dirs;
+	int ndirs;
+	int size;
+	int max_depth;
+	uint8_t* linked;		// Multiply linked inodes already counted, a bit each
+	uint64_t files;
+};
+
+static void du_visit(struct walk_entry* e, void* arg) {
+	struct du_job* job = arg;
+	struct du_dir* d;
+
+	if (e->dir >= 0) {
+		if (e->dir >= job->size) {
+			job->size = (e->dir + 1) * 2;
+			job->dirs = realloc(job->dirs, job->size * sizeof(struct du_dir));
+		}
+		job->ndirs = e->dir + 1;
+		d = &job->dirs[e->dir];
+		d->parent = e->parent;
+		d->path = (job->max_depth < 0 || e->depth <= job->max_depth) ? strdup(e->path) : NULL;
+		d->blocks = 0;
+		d->bytes = 0;
+	} else {
+		if (e->parent < 0)
+			return;
+		d = &job->dirs[e->parent];
+		job->files++;
+	}
+
+	/* Hard linked files count once, like du */
+	if (e->dir < 0 && e->in->links_count > 1) {
+		if (job->linked[e->inode / 8] & (1 << (e->inode % 8)))
+			return;
+		job->linked[e->inode / 8] |= 1 << (e->inode % 8);
+	}
+	d->blocks += e->in->blocks;
+	d->bytes += e->in->size;
+}
+
+/* Print the disk usage of every directory under path, down to max_depth
+levels below it (all of them when max_depth is negative). The walk numbers
+directories breadth first, so summing them in reverse folds every directory
+into its parent after all of its own subdirectories */
+int ext2_du(struct ext2_fs *f, char* path, int max_depth) {
+	struct du_job job;
+	memset(&job, 0, sizeof(job));
+	job.max_depth = max_depth;
+	job.linked = calloc(f->sb->inodes_count / 8 + 1, 1);
+
+	int ret = ext2_walk(f, path, du_visit, &job);
+	int ndirs = job.ndirs;
+	if (!ret && !ndirs) {
+		printf("%s: not a directory\n", path);
+		ret = -1;
+	}
+
+	for (int q = ndirs - 1; q >= 0; q--) {
+		struct du_dir* d = &job.dirs[q];
+		if (d->path)
+			printf("%llu\t%s\n", (unsigned long long) (d->blocks / 2), d->path);
+		if (d->parent >= 0) {
+			job.dirs[d->parent].blocks += d->blocks;
+			job.dirs[d->parent].bytes += d->bytes;
+		}
+	}
+	if (ndirs)
+		printf("%llu KiB used, %llu bytes in %d directories and %llu files\n",
+			(unsigned long long) (job.dirs[0].blocks / 2), (unsigned long long) job.dirs[0].bytes,
+			ndirs, (unsigned long long) job.files);
+
+	for (int q = 0; q < ndirs; q++)
+		free(job.dirs[q].path);
+	free(job.dirs);
+	free(job.linked);
+	return ret;
+}